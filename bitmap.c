@@ -7,6 +7,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "bitmap.h"
 
 #define nth_bit_mask(n) (1 << (n))
@@ -34,6 +38,79 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Skip whole words with every bit set, starting at word w and stopping before
+// word end_word. Returns the first word that may have a clear bit.
+static int skip_full_words(const uint64_t *words, int w, int end_word) {
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi32(-1);
+  while (w + 4 <= end_word) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (words + w));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != -1) {
+      break;
+    }
+    w += 4;
+  }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi32(-1);
+  while (w + 2 <= end_word) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (words + w));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff) {
+      break;
+    }
+    w += 2;
+  }
+#endif
+  while (w < end_word && words[w] == UINT64_MAX) {
+    w++;
+  }
+  return w;
+}
+
+// Find the first clear bit in [start, end).
+// Bit i lives in byte i / 8, which on a little-endian machine is bit i % 64
+// of word i / 64, so the word scan agrees with bitmap_get.
+int bitmap_find_clear(void *bm, int start, int end) {
+  const uint64_t *words = (const uint64_t *) bm;
+  int end_word = (end + 63) / 64;
+  if (start >= end) {
+    return -1;
+  }
+
+  int w = start / 64;
+  uint64_t free = ~words[w] & (UINT64_MAX << (start % 64));
+  while (free == 0) {
+    w = skip_full_words(words, w + 1, end_word);
+    if (w >= end_word) {
+      return -1;
+    }
+    free = ~words[w];
+  }
+
+  int i = w * 64 + __builtin_ctzll(free);
+  return i < end ? i : -1;
+}
+
+// Find the first set bit in [start, end).
+int bitmap_find_set(void *bm, int start, int end) {
+  const uint64_t *words = (const uint64_t *) bm;
+  int end_word = (end + 63) / 64;
+  if (start >= end) {
+    return -1;
+  }
+
+  int w = start / 64;
+  uint64_t used = words[w] & (UINT64_MAX << (start % 64));
+  while (used == 0) {
+    if (++w >= end_word) {
+      return -1;
+    }
+    used = words[w];
+  }
+
+  int i = w * 64 + __builtin_ctzll(used);
+  return i < end ? i : -1;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
@@ -26,6 +26,34 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first clear bit in the range [start, end).
+ *
+ * Scans a 64-bit word at a time (and whole vectors of full words when SSE2
+ * or AVX2 is available). The bitmap must be 8-byte aligned and padded to a
+ * whole number of words.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start First bit index to consider.
+ * @param end One past the last bit index to consider.
+ *
+ * @return The index of the first clear bit, or -1 if every bit is set.
+ */
+int bitmap_find_clear(void *bm, int start, int end);
+
+/**
+ * Find the first set bit in the range [start, end).
+ *
+ * Has the same alignment requirements as bitmap_find_clear.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start First bit index to consider.
+ * @param end One past the last bit index to consider.
+ *
+ * @return The index of the first set bit, or -1 if every bit is clear.
+ */
+int bitmap_find_set(void *bm, int start, int end);
+
 /**
  * Pretty-print a bitmap. 
  *
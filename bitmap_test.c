@@ -1,30 +1,126 @@
+/**
+ * @file bitmap_test.c
+ *
+ * Checks bitmap_get/bitmap_put and the word-at-a-time searches against the
+ * bit a bit-by-bit scan would find: at word boundaries, on empty and full
+ * bitmaps, with ranges that start and end inside a word, and with the only
+ * clear bit behind every possible run of full words, which is what the
+ * SSE2 and AVX2 word skipping has to get right.
+ *
+ * Build with the bitmap, once as is (SSE2 on x86-64) and once with -mavx2:
+ *   gcc -g -o bitmap_test bitmap_test.c bitmap.c
+ */
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "bitmap.h"
 
-#define SIZE 256
+#define SIZE 2048 // bits
+#define WORDS (SIZE / 64)
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: " __VA_ARGS__);                                            \
+      putchar('\n');                                                           \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// What the searches should find, a bit at a time.
+static int slow_find(void *bm, int start, int end, int v) {
+  for (int i = start; i < end; i++) {
+    if (bitmap_get(bm, i) == v) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void check_range(uint64_t *bm, int start, int end) {
+  int want = slow_find(bm, start, end, 0);
+  int got = bitmap_find_clear(bm, start, end);
+  CHECK(got == want, "bitmap_find_clear(%d, %d) is %d, not %d", start, end, got, want);
+  want = slow_find(bm, start, end, 1);
+  got = bitmap_find_set(bm, start, end);
+  CHECK(got == want, "bitmap_find_set(%d, %d) is %d, not %d", start, end, got, want);
+}
 
 int main(int argc, char **argv) {
+  static uint64_t bm[WORDS];
+
+  // single bits, on both sides of a word boundary
+  int bits[] = {0, 1, 7, 8, 63, 64, 65, 127, 128, SIZE - 1};
+  for (size_t b = 0; b < sizeof(bits) / sizeof(bits[0]); b++) {
+    int i = bits[b];
+    memset(bm, 0, sizeof(bm));
+    bitmap_put(bm, i, 1);
+    CHECK(bitmap_get(bm, i) == 1, "bit %d not set", i);
+    CHECK(i == 0 || bitmap_get(bm, i - 1) == 0, "setting bit %d set bit %d", i, i - 1);
+    CHECK(i == SIZE - 1 || bitmap_get(bm, i + 1) == 0, "setting bit %d set bit %d", i, i + 1);
+    CHECK(bitmap_find_set(bm, 0, SIZE) == i, "first set bit is not %d", i);
+    CHECK(bitmap_find_set(bm, i, i + 1) == i, "bit %d not found in [%d, %d)", i, i, i + 1);
+    CHECK(bitmap_find_set(bm, i + 1, SIZE) == -1, "a set bit after %d", i);
+    CHECK(bitmap_find_clear(bm, i, SIZE) == (i == SIZE - 1 ? -1 : i + 1),
+          "first clear bit from %d is not %d", i, i + 1);
+    bitmap_put(bm, i, 0);
+    CHECK(bitmap_get(bm, i) == 0, "bit %d not cleared", i);
+    CHECK(bitmap_find_set(bm, 0, SIZE) == -1, "clearing bit %d left a set bit", i);
+  }
 
-  long bm[SIZE / sizeof(long)] = {0};
-  printf("Initial: \n");
-  bitmap_print(bm, SIZE);
+  // an empty bitmap, and empty ranges
+  memset(bm, 0, sizeof(bm));
+  CHECK(bitmap_find_clear(bm, 0, SIZE) == 0, "empty bitmap: first clear bit is not 0");
+  CHECK(bitmap_find_clear(bm, 64, SIZE) == 64, "empty bitmap: first clear bit from 64 is not 64");
+  CHECK(bitmap_find_clear(bm, 70, 70) == -1, "found a clear bit in an empty range");
+  CHECK(bitmap_find_set(bm, 0, SIZE) == -1, "empty bitmap has a set bit");
 
-  printf("\nSetting bit 2: \n");
-  bitmap_put(bm, 2, 1);
-  bitmap_print(bm, SIZE);
+  // a full bitmap, and a range that ends just before its only clear bit
+  memset(bm, 0xff, sizeof(bm));
+  CHECK(bitmap_find_clear(bm, 0, SIZE) == -1, "full bitmap has a clear bit");
+  CHECK(bitmap_find_clear(bm, 100, SIZE) == -1, "full bitmap has a clear bit after 100");
+  CHECK(bitmap_find_set(bm, 100, SIZE) == 100, "full bitmap: first set bit from 100 is not 100");
+  bitmap_put(bm, 1000, 0);
+  CHECK(bitmap_find_clear(bm, 0, 1000) == -1, "bit 1000 found in [0, 1000)");
+  CHECK(bitmap_find_clear(bm, 0, 1001) == 1000, "bit 1000 not found in [0, 1001)");
+  CHECK(bitmap_find_clear(bm, 1001, SIZE) == -1, "a clear bit after 1000");
 
-  printf("\nSetting bit 65: \n");
-  bitmap_put(bm, 65, 1);
-  bitmap_print(bm, SIZE);
+  // the only clear bit after each run of full words, searched for from the
+  // start, from its word and from each word boundary before it, so that the
+  // word skipping stops at every offset into a vector of words
+  for (int i = 0; i < SIZE; i++) {
+    memset(bm, 0xff, sizeof(bm));
+    bitmap_put(bm, i, 0);
+    for (int start = 0; start <= i; start += 64) {
+      int got = bitmap_find_clear(bm, start, SIZE);
+      CHECK(got == i, "only clear bit %d: found %d from %d", i, got, start);
+    }
+    CHECK(bitmap_find_clear(bm, i - i % 64, SIZE) == i, "only clear bit %d not found in its word", i);
+    CHECK(bitmap_find_clear(bm, i, i + 1) == i, "only clear bit %d not found in [%d, %d)", i, i, i + 1);
+    CHECK(bitmap_find_clear(bm, 0, i) == -1, "only clear bit %d found before itself", i);
 
-  printf("\nSetting bit 0: \n");
-  bitmap_put(bm, 0, 1);
-  bitmap_print(bm, SIZE);
+    memset(bm, 0, sizeof(bm));
+    bitmap_put(bm, i, 1);
+    CHECK(bitmap_find_set(bm, 0, SIZE) == i, "only set bit %d not found", i);
+  }
 
-  printf("\nSetting bit 255: \n");
-  bitmap_put(bm, 255, 1);
-  bitmap_print(bm, SIZE);
+  // random bitmaps, mostly full as a busy disk's are, over random ranges
+  srand(1);
+  for (int round = 0; round < 200; round++) {
+    for (int w = 0; w < WORDS; w++) {
+      bm[w] = rand() % 4 ? UINT64_MAX : ((uint64_t) rand() << 33) ^ ((uint64_t) rand() << 2) ^ rand();
+    }
+    for (int r = 0; r < 50; r++) {
+      int start = rand() % SIZE;
+      check_range(bm, start, start + rand() % (SIZE - start + 1));
+    }
+    check_range(bm, 0, SIZE);
+  }
 
-  return 0;
+  printf("bitmap_test: %s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
 }
@@ -10,27 +10,37 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <sys/mman.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "blocks_backend.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
+int BLOCK_COUNT = 0;         // set from the superblock by blocks_init
 const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+// free runs alloc_blocks examines before settling for the longest one seen
+#define ALLOC_SCAN_RUNS 64
 
-int block_list[256];
+// guards the block bitmap, the allocation cursor and the image size
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// what the allocators search: the block bitmap plus the blocks the journal
+// keeps back after they are freed (see journal_free); made on first use
+static uint8_t *alloc_map = 0;
 
 static int blocks_fd = -1;
-static void *blocks_base = 0;
+static const block_backend_t *backend = &mmap_backend;
+static __thread int op_depth = 0; // nesting of blocks_op_begin on this thread
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -43,67 +53,451 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+// Write a fresh, empty filesystem layout to the given disk image.
+int blocks_format(const char *image_path, int block_count, int max_block_count,
+                  int inode_count, int inode_size, int journal_blocks) {
+  superblock_t sb = {0};
+  sb.magic = NUFS_MAGIC;
+  sb.version = NUFS_VERSION;
+  sb.block_size = BLOCK_SIZE;
+  sb.block_count = block_count;
+  sb.max_block_count = max_block_count;
+  sb.inode_count = inode_count;
+
+  // superblock, block bitmap (sized for the maximum), inode bitmap, inodes,
+  // journal
+  int bbm_blocks = bytes_to_blocks((max_block_count + 7) / 8);
+  int ibm_blocks = bytes_to_blocks((inode_count + 7) / 8);
+  int table_blocks = bytes_to_blocks(inode_count * inode_size);
+  sb.block_bitmap_start = 1;
+  sb.inode_bitmap_start = sb.block_bitmap_start + bbm_blocks;
+  sb.inode_table_start = sb.inode_bitmap_start + ibm_blocks;
+  sb.journal_start = sb.inode_table_start + table_blocks;
+  sb.journal_blocks = journal_blocks;
+  sb.data_start = sb.journal_start + journal_blocks;
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  if (max_block_count < block_count || sb.data_start >= block_count) {
+    return -EINVAL;
+  }
+
+  int fd = open(image_path, O_CREAT | O_RDWR, 0644);
+  assert(fd != -1);
+
+  // truncating to zero first clears any previous contents
+  int rv = ftruncate(fd, 0);
+  assert(rv == 0);
+  rv = ftruncate(fd, (off_t) block_count * BLOCK_SIZE);
   assert(rv == 0);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+  // the metadata blocks are allocated from the start
+  uint8_t *bbm = calloc(bbm_blocks, BLOCK_SIZE);
+  for (int i = 0; i < sb.data_start; i++) {
+    bitmap_put(bbm, i, 1);
+  }
+
+  rv = pwrite(fd, bbm, (size_t) bbm_blocks * BLOCK_SIZE,
+              (off_t) sb.block_bitmap_start * BLOCK_SIZE);
+  assert(rv == bbm_blocks * BLOCK_SIZE);
+  rv = pwrite(fd, &sb, sizeof(sb), 0);
+  assert(rv == sizeof(sb));
+  free(bbm);
+
+  rv = fsync(fd);
+  assert(rv == 0);
+  close(fd);
+  return 0;
+}
+
+// Check whether the given disk image carries a superblock we can mount.
+int blocks_probe(const char *image_path) {
+  int fd = open(image_path, O_RDONLY);
+  if (fd == -1) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+
+  superblock_t sb;
+  int rv = pread(fd, &sb, sizeof(sb), 0);
+  close(fd);
+  if (rv < 0) {
+    return -errno;
+  }
+
+  // a short or empty file, or one without our magic, holds no file system
+  if (rv != sizeof(sb) || sb.magic != NUFS_MAGIC) {
+    return 0;
+  }
+  if (sb.version != NUFS_VERSION || sb.block_size != BLOCK_SIZE) {
+    return -EPROTONOSUPPORT;
+  }
+  return 1;
+}
+
+// Choose how blocks_init will reach the image.
+int blocks_set_backend(const char *name, long cache_size) {
+  if (strcmp(name, "mmap") == 0) {
+    backend = &mmap_backend;
+  } else if (strcmp(name, "pread") == 0) {
+    backend = &pread_backend;
+  } else if (strcmp(name, "direct") == 0) {
+    backend = &direct_backend;
+  } else {
+    return -EINVAL;
+  }
+  if (cache_size > 0) {
+    pio_set_cache_size(cache_size);
+  }
+  return 0;
+}
+
+// Choose how the pread and direct backends issue I/O.
+int blocks_set_io_engine(const char *name) {
+  return pio_set_engine(name);
+}
+
+// Load the given (formatted) disk image.
+void blocks_init(const char *image_path) {
+  blocks_fd = open(image_path, O_RDWR);
+  assert(blocks_fd != -1);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  superblock_t sb;
+  int rv = pread(blocks_fd, &sb, sizeof(sb), 0);
+  assert(rv == sizeof(sb) && sb.magic == NUFS_MAGIC);
 
-  for (int i = 0; i < BLOCK_COUNT; i++)
-    block_list[i] = i;
+  backend->init(blocks_fd, &sb);
+  BLOCK_COUNT = sb.block_count;
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
-  assert(rv == 0);
+  free(alloc_map);
+  alloc_map = 0;
+  backend->free();
+  close(blocks_fd);
+  blocks_fd = -1;
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return backend->get_block(bnum);
+}
+
+// Get the number of the block containing the given address in the image.
+int blocks_bnum(const void *ptr) {
+  return backend->bnum(ptr);
+}
+
+// Start bringing a run of blocks into memory.
+void blocks_prefetch(int bnum, int count) {
+  backend->prefetch(bnum, count);
+}
+
+// Note that the contents of a block were changed.
+void blocks_mark_dirty(int bnum) {
+  if (backend->mark_dirty) {
+    backend->mark_dirty(bnum);
+  }
+}
+
+// Keep a block's changes out of the image until it is released.
+void blocks_hold(int bnum) {
+  if (backend->hold) {
+    backend->hold(bnum);
+  }
+}
+
+// Let a held block be written back again.
+void blocks_release(int bnum) {
+  if (backend->release) {
+    backend->release(bnum);
+  }
+}
+
+// Write a copy of a block to its place in the image file.
+int blocks_write_copy(int bnum, const void *data) {
+  ssize_t rv = pwrite(blocks_fd, data, BLOCK_SIZE, (off_t) bnum * BLOCK_SIZE);
+  if (rv < 0) {
+    return -errno;
+  }
+  return rv == BLOCK_SIZE ? 0 : -EIO;
+}
+
+// Wait for what was written to the image file to reach the disk.
+int blocks_flush() {
+  return fdatasync(blocks_fd) == 0 ? 0 : -errno;
+}
+
+// Start an operation; block pointers stay valid until the outermost one ends.
+void blocks_op_begin() {
+  op_depth++;
+}
+
+// End an operation, releasing its blocks if it was the outermost one.
+void blocks_op_end() {
+  if (--op_depth == 0 && backend->op_end) {
+    backend->op_end();
+  }
+}
+
+// Write a run of blocks back to the image file and wait for the disk.
+int blocks_sync(int bnum, int count) {
+  return backend->sync(bnum, count, 1);
+}
+
+// Start writing a run of blocks back to the image file without waiting.
+int blocks_writeback(int bnum, int count) {
+  return backend->sync(bnum, count, 0);
+}
+
+// Get the statistics of the block cache.
+void blocks_get_stats(blocks_stats_t *st) {
+  memset(st, 0, sizeof(*st));
+  if (backend->get_stats) {
+    backend->get_stats(st);
+  }
+}
+
+// Get the image file, if reading it gives the current contents of blocks.
+int blocks_image_fd() {
+  return backend->coherent ? blocks_fd : -1;
+}
+
+// Return a pointer to the superblock of the loaded image.
+superblock_t *get_superblock() { return blocks_get_block(0); }
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() {
+  return blocks_get_block(get_superblock()->block_bitmap_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  return blocks_get_block(get_superblock()->inode_bitmap_start);
+}
+
+// Record the bitmap blocks holding the given bits in the journal.
+static void dirty_bitmap_bits(int first, int count) {
+  int bits_per_block = BLOCK_SIZE * 8;
+  int start = get_superblock()->block_bitmap_start;
+  for (int b = first / bits_per_block; b <= (first + count - 1) / bits_per_block; b++) {
+    journal_dirty(start + b);
+  }
+}
+
+// Get the allocation map, copying the block bitmap into it the first time;
+// the caller holds blocks_lock.
+static uint8_t *get_alloc_map() {
+  if (!alloc_map) {
+    superblock_t *sb = get_superblock();
+    size_t bytes = (size_t) (sb->inode_bitmap_start - sb->block_bitmap_start) * BLOCK_SIZE;
+    int rv = posix_memalign((void **) &alloc_map, 64, bytes);
+    assert(rv == 0);
+    memcpy(alloc_map, get_blocks_bitmap(), bytes);
+  }
+  return alloc_map;
+}
+
+// Mark a run of blocks used in the block bitmap and the allocation map; the
+// caller holds blocks_lock.
+static void take_blocks(int bnum, int count) {
+  uint8_t *bbm = get_blocks_bitmap();
+  for (int ii = bnum; ii < bnum + count; ii++) {
+    bitmap_put(bbm, ii, 1);
+    bitmap_put(alloc_map, ii, 1);
+  }
+  dirty_bitmap_bits(bnum, count);
+}
+
+// Mark a run of blocks free in the block bitmap, and in the allocation map
+// too unless the journal keeps them back; the caller holds blocks_lock.
+static void put_blocks(int bnum, int count) {
+  uint8_t *bbm = get_blocks_bitmap();
+  uint8_t *map = get_alloc_map();
+  int reuse = !journal_free(bnum, count);
+  for (int ii = bnum; ii < bnum + count; ii++) {
+    bitmap_put(bbm, ii, 0);
+    if (reuse) {
+      bitmap_put(map, ii, 0);
+    }
+  }
+  dirty_bitmap_bits(bnum, count);
+}
+
+// Grow the image; the caller holds blocks_lock.
+static int grow_locked() {
+  superblock_t *sb = get_superblock();
+  int old_count = sb->block_count;
+  int new_count = old_count * 2;
+  if (new_count > sb->max_block_count) {
+    new_count = sb->max_block_count;
+  }
+  if (new_count == old_count) {
+    return -ENOSPC;
+  }
+
+  int rv = ftruncate(blocks_fd, (off_t) new_count * BLOCK_SIZE);
+  if (rv != 0) {
+    return -errno;
+  }
+  rv = backend->grow(old_count, new_count);
+  if (rv != 0) {
+    return rv;
+  }
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+  sb->block_count = new_count;
+  journal_dirty(0);
+  BLOCK_COUNT = new_count;
+  TRACE(BLOCKS_GROW, new_count);
+  stats_count(STATS_IMAGE_GROWS, 1);
+  return 0;
+}
+
+// Grow the image, doubling its block count up to the superblock maximum.
+int blocks_grow() {
+  pthread_mutex_lock(&blocks_lock);
+  int rv = grow_locked();
+  pthread_mutex_unlock(&blocks_lock);
+  return rv;
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+  superblock_t *sb = get_superblock();
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
+  pthread_mutex_lock(&blocks_lock);
+  uint8_t *bbm = get_alloc_map();
+  do {
+    // next fit: search from the cursor to the end, then wrap around
+    int start = sb->block_cursor;
+    if (start < sb->data_start || start >= BLOCK_COUNT) {
+      start = sb->data_start;
+    }
+    int ii = bitmap_find_clear(bbm, start, BLOCK_COUNT);
+    if (ii < 0) {
+      ii = bitmap_find_clear(bbm, sb->data_start, start);
+    }
+    if (ii >= 0) {
+      take_blocks(ii, 1);
+      sb->block_cursor = ii + 1;
+      pthread_mutex_unlock(&blocks_lock);
+      TRACE(ALLOC_BLOCK, ii);
+      stats_count(STATS_BLOCK_ALLOCS, 1);
+      stats_count(STATS_BLOCKS_ALLOCATED, 1);
+      stats_record(STATS_BLOCK_SCAN, ii >= start ? ii - start + 1
+                                                 : BLOCK_COUNT - start + ii - sb->data_start + 1);
       return ii;
     }
+  } while (grow_locked() == 0);
+
+  pthread_mutex_unlock(&blocks_lock);
+  return -1;
+}
+
+// Find the longest free run (capped at count) in [start, end), looking at no
+// more than *budget runs. Returns its first block, sets *len and adds the
+// bits it looked at to *scanned.
+static int longest_free_run(void *bbm, int start, int end, int count,
+                            int *budget, int *len, int *scanned) {
+  int best = -1;
+  *len = 0;
+
+  int ii = start;
+  while (*budget > 0) {
+    int next = bitmap_find_clear(bbm, ii, end);
+    if (next < 0) {
+      ii = end;
+      break;
+    }
+    ii = next;
+
+    int limit = end - ii < count ? end : ii + count;
+    int used = bitmap_find_set(bbm, ii, limit);
+    int run = (used < 0 ? limit : used) - ii;
+    if (run > *len) {
+      best = ii;
+      *len = run;
+    }
+
+    ii += run;
+    *budget -= 1;
+    if (*len == count) {
+      break;
+    }
   }
 
+  *scanned += ii - start;
+  return best;
+}
+
+// Allocate a run of contiguous blocks near a goal block.
+int alloc_blocks(int count, int hint, int *got) {
+  superblock_t *sb = get_superblock();
+
+  pthread_mutex_lock(&blocks_lock);
+  uint8_t *bbm = get_alloc_map();
+  do {
+    int start = hint > 0 ? hint : sb->block_cursor;
+    if (start < sb->data_start || start >= BLOCK_COUNT) {
+      start = sb->data_start;
+    }
+
+    // search from the goal to the end, then wrap around
+    int budget = ALLOC_SCAN_RUNS;
+    int len, scanned = 0;
+    int best = longest_free_run(bbm, start, BLOCK_COUNT, count, &budget, &len,
+                                &scanned);
+    if (len < count) {
+      int wrap_len;
+      int wrap = longest_free_run(bbm, sb->data_start, start, count, &budget,
+                                  &wrap_len, &scanned);
+      if (wrap_len > len) {
+        best = wrap;
+        len = wrap_len;
+      }
+    }
+
+    if (best >= 0) {
+      take_blocks(best, len);
+      sb->block_cursor = best + len;
+      pthread_mutex_unlock(&blocks_lock);
+      TRACE(ALLOC_BLOCKS, count, hint, best, len);
+      stats_count(STATS_BLOCK_ALLOCS, 1);
+      stats_count(STATS_BLOCKS_ALLOCATED, len);
+      stats_record(STATS_BLOCK_SCAN, scanned);
+      *got = len;
+      return best;
+    }
+  } while (grow_locked() == 0);
+
+  pthread_mutex_unlock(&blocks_lock);
+  *got = 0;
   return -1;
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  TRACE(FREE_BLOCK, bnum);
+  stats_count(STATS_BLOCKS_FREED, 1);
+  pthread_mutex_lock(&blocks_lock);
+  put_blocks(bnum, 1);
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+// Deallocate a run of contiguous blocks.
+void free_blocks(int bnum, int count) {
+  TRACE(FREE_BLOCKS, bnum, count);
+  stats_count(STATS_BLOCKS_FREED, count);
+  pthread_mutex_lock(&blocks_lock);
+  put_blocks(bnum, count);
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+// Let the allocators have a run of blocks the journal kept back.
+void blocks_reuse(int bnum, int count) {
+  pthread_mutex_lock(&blocks_lock);
+  uint8_t *bbm = get_blocks_bitmap();
+  uint8_t *map = get_alloc_map();
+  for (int ii = bnum; ii < bnum + count; ii++) {
+    bitmap_put(map, ii, bitmap_get(bbm, ii));
+  }
+  pthread_mutex_unlock(&blocks_lock);
 }
@@ -4,19 +4,62 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * Block data is accessed using pointers. By default the disk image is
+ * mmapped; it can instead be reached with pread/pwrite through a bounded
+ * cache (see blocks_set_backend and blocks_backend.h).
+ * Block 0 holds the superblock, which records the geometry of the image and
+ * where the bitmaps and the inode table live.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+// 2: 256-byte inodes with inline data, 3: nanosecond timestamps,
+// 4: parent pointers in directory inodes
+#define NUFS_VERSION 4
+
+extern int BLOCK_COUNT;      // blocks currently in the image (from the superblock)
+extern const int BLOCK_SIZE; // default = 4K
+
+/**
+ * On-disk superblock, stored at the start of block 0.
+ */
+typedef struct superblock {
+  uint32_t magic;              // NUFS_MAGIC
+  uint32_t version;            // NUFS_VERSION
+  uint32_t block_size;         // bytes per block
+  uint32_t block_count;        // blocks currently in the image
+  uint32_t max_block_count;    // blocks the block bitmap has room for
+  uint32_t inode_count;        // entries in the inode table
+  uint32_t block_bitmap_start; // first block of the block bitmap
+  uint32_t inode_bitmap_start; // first block of the inode bitmap
+  uint32_t inode_table_start;  // first block of the inode table
+  uint32_t data_start;         // first block handed out by alloc_block
+  uint32_t block_cursor;       // where the next block search starts
+  uint32_t inode_cursor;       // where the next inode search starts
+  uint32_t journal_start;      // first block of the metadata journal
+  uint32_t journal_blocks;     // blocks in the journal (0 = no journal)
+} superblock_t;
+
+/**
+ * Statistics of the block cache kept by the pread and direct backends.
+ */
+typedef struct blocks_stats {
+  long hits;         // blocks found in the cache
+  long misses;       // blocks read because they were not
+  long ghost_hits;   // misses on blocks evicted recently (ARC adapts on these)
+  long prefetched;   // blocks read ahead
+  long evictions;    // frames reused for another block
+  long evict_writes; // dirty blocks written back to be evicted
+  long writebacks;   // dirty blocks written back in the background
+  int frames;        // frames in the cache
+  int dirty;         // frames changed since they were last written
+  int target;        // ARC's target for frames holding blocks used once
+} blocks_stats_t;
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
-extern int block_list[256];
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
  *
@@ -27,7 +70,61 @@ extern int block_list[256];
 int bytes_to_blocks(int bytes);
 
 /**
- * Load and initialize the given disk image.
+ * Write a fresh, empty filesystem layout to the given disk image.
+ *
+ * Any existing contents of the image are discarded.
+ *
+ * @param image_path Path to the disk image file.
+ * @param block_count Initial number of blocks in the image.
+ * @param max_block_count Number of blocks the image may grow to.
+ * @param inode_count Number of entries in the inode table.
+ * @param inode_size Size of one inode table entry in bytes.
+ * @param journal_blocks Blocks to reserve for the metadata journal (0 = none).
+ *
+ * @return 0 on success, -EINVAL if the geometry does not fit.
+ */
+int blocks_format(const char *image_path, int block_count, int max_block_count,
+                  int inode_count, int inode_size, int journal_blocks);
+
+/**
+ * Check whether the given disk image carries a superblock we can mount.
+ *
+ * @param image_path Path to the disk image file.
+ *
+ * @return 1 if it does, 0 if the image holds no nufs file system (it is
+ * missing, empty or has no NUFS_MAGIC) and may be formatted,
+ * -EPROTONOSUPPORT if it holds one of another version or block size, or
+ * -errno if it cannot be read.
+ */
+int blocks_probe(const char *image_path);
+
+/**
+ * Choose how blocks_init will reach the image: "mmap" (the default),
+ * "pread" (pread/pwrite through a bounded cache of data blocks) or "direct"
+ * (the same with O_DIRECT).
+ *
+ * @param name Name of the backend.
+ * @param cache_size Bytes of data blocks the pread and direct backends may
+ *                   keep in memory (0 = the default).
+ *
+ * @return 0 on success, -EINVAL for an unknown backend.
+ */
+int blocks_set_backend(const char *name, long cache_size);
+
+/**
+ * Choose how the pread and direct backends issue their I/O: "sync" (the
+ * default; one preadv or pwritev per run of consecutive blocks) or "uring"
+ * (every run of a batch in a single io_uring submission, falling back to
+ * sync if io_uring is not available).
+ *
+ * @param name Name of the engine.
+ *
+ * @return 0 on success, -EINVAL for an unknown engine.
+ */
+int blocks_set_io_engine(const char *name);
+
+/**
+ * Load the given (formatted) disk image.
  *
  * @param image_path Path to the disk image file.
  */
@@ -43,10 +140,141 @@ void blocks_free();
  *
  * @param bnum Block number (index).
  *
- * @return Pointer to the beginning of the block in memory.
+ * The pointer stays valid until the calling thread's outermost operation
+ * ends (see blocks_op_begin); blocks got outside any operation stay valid
+ * until the next one ends.
+ *
+ * @return Pointer to the beginning of the block in memory, or NULL if the
+ *         pread or direct backend could not read it from the image.
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Start bringing a run of blocks into memory, so that getting them later
+ * does not wait for the disk block by block. The pread and direct backends
+ * read every missing block of the run in one batch; the mmap backend asks
+ * the kernel to read the run ahead.
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_prefetch(int bnum, int count);
+
+/**
+ * Note that the contents of a block were changed, so that a backend that
+ * caches blocks writes it back. The journal does this for every block it is
+ * told about; data blocks are marked by whoever writes them.
+ *
+ * @param bnum Block number.
+ */
+void blocks_mark_dirty(int bnum);
+
+/**
+ * Keep the changes to a block out of the image until blocks_release: the
+ * backend neither writes the block back nor drops it from memory, so only
+ * blocks_write_copy reaches its place in the image. The journal holds every
+ * block it is told about until the commit covering it is home.
+ *
+ * @param bnum Block number.
+ */
+void blocks_hold(int bnum);
+
+/**
+ * Let a held block be written back and evicted again. The image file must
+ * already hold its current contents.
+ *
+ * @param bnum Block number.
+ */
+void blocks_release(int bnum);
+
+/**
+ * Write a copy of a block to the block's place in the image file, leaving
+ * what blocks_get_block shows alone. Does not wait for the disk (see
+ * blocks_flush).
+ *
+ * @param bnum Block number.
+ * @param data BLOCK_SIZE bytes to write, page aligned (the direct backend
+ *             writes them with O_DIRECT).
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int blocks_write_copy(int bnum, const void *data);
+
+/**
+ * Wait for everything written to the image file so far to reach the disk.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int blocks_flush();
+
+/**
+ * Start an operation on the calling thread. Operations nest, and blocks got
+ * during them stay in memory until the outermost one ends. Taking an inode
+ * lock starts one and releasing it ends it (see inode.h).
+ */
+void blocks_op_begin();
+
+/**
+ * End an operation started with blocks_op_begin.
+ */
+void blocks_op_end();
+
+/**
+ * Get the number of the block containing the given address in the image.
+ *
+ * @param ptr Pointer into a block got with blocks_get_block.
+ *
+ * @return The block number.
+ */
+int blocks_bnum(const void *ptr);
+
+/**
+ * Write a run of blocks back to the image file and wait for them to reach
+ * the disk (msync with MS_SYNC, or pwrite and fdatasync).
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int blocks_sync(int bnum, int count);
+
+/**
+ * Start writing a run of blocks back to the image file, without waiting for
+ * them to reach the disk.
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 0 on success, -errno on failure.
+ */
+int blocks_writeback(int bnum, int count);
+
+/**
+ * Get the statistics of the block cache. With the mmap backend, which
+ * leaves caching to the kernel, they are all zero.
+ *
+ * @param st Filled in with the statistics.
+ */
+void blocks_get_stats(blocks_stats_t *st);
+
+/**
+ * Get the open image file, for callers that read blocks from it directly
+ * (e.g. to splice them into another file). Only the mmap backend qualifies:
+ * its mapping shares the page cache, so the file always has what was
+ * written. The others keep changes in their own cache until writeback.
+ *
+ * @return The image's file descriptor, or -1 if it may be out of date.
+ */
+int blocks_image_fd();
+
+/**
+ * Return a pointer to the superblock of the loaded image.
+ *
+ * @return A pointer to the superblock.
+ */
+superblock_t *get_superblock();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -61,15 +289,41 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Grow the image, doubling its block count up to the superblock maximum.
+ *
+ * Pointers to blocks stay valid.
+ *
+ * @return 0 on success, -ENOSPC if the image is already at its maximum.
+ */
+int blocks_grow();
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block at or after the allocation cursor (wrapping
+ * around to the start of the data area) and marks it as allocated, growing
+ * the image if every block is in use.
  *
- * @return The index of the newly allocated block.
+ * @return The index of the newly allocated block, or -1 if the disk is full.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of contiguous blocks near a goal block.
+ *
+ * Looks for count free blocks in a row starting at or after the hint
+ * (wrapping around to the start of the data area). If no run is long enough
+ * within a bounded search, the longest run seen is returned instead.
+ *
+ * @param count Number of blocks wanted.
+ * @param hint Goal block, e.g. the one after a file's last block (0 = none).
+ * @param got Set to the number of blocks actually allocated.
+ *
+ * @return The first block of the allocated run, or -1 if the disk is full.
+ */
+int alloc_blocks(int count, int hint, int *got);
+
 /**
  * Deallocate the block with the given number.
  *
@@ -77,4 +331,21 @@ int alloc_block();
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a run of contiguous blocks.
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ */
+void free_blocks(int bnum, int count);
+
+/**
+ * Let the allocators hand out a run of blocks that the journal kept back
+ * when they were freed (see journal_free).
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_reuse(int bnum, int count);
+
 #endif
@@ -0,0 +1,124 @@
+/**
+ * @file blocks_backend.h
+ *
+ * The interface between blocks.c and the ways it can reach the image file.
+ *
+ * blocks.c owns the image file, its geometry and the allocators, and hands
+ * every access to a block's bytes to one of these backends:
+ *
+ *  - mmap (the default) maps the image MAP_SHARED and leaves caching and
+ *    writeback to the kernel, except that on an image with a journal the
+ *    metadata region, and any data block the journal holds, are mapped
+ *    MAP_PRIVATE so that the kernel cannot write them behind its back.
+ *  - pread keeps the metadata region (everything before data_start) in one
+ *    resident buffer and the data blocks in a bounded ARC cache of frames,
+ *    read with pread on a miss and written with pwrite when evicted, synced
+ *    or written back in the background.
+ *  - direct is pread with the image opened O_DIRECT, so the page cache is
+ *    bypassed and the frame cache is the only copy in memory.
+ *
+ * The pread and direct backends batch their I/O into runs of consecutive
+ * blocks, issued either with preadv/pwritev or all at once through io_uring
+ * (see pio_set_engine).
+ *
+ * A block pointer stays valid until the thread's outermost operation ends
+ * (see blocks_op_begin in blocks.h).
+ */
+#ifndef BLOCKS_BACKEND_H
+#define BLOCKS_BACKEND_H
+
+#include <sys/uio.h>
+
+#include "blocks.h"
+
+typedef struct block_backend {
+  const char *name;
+  // Whether reading the image file gives every block's current contents.
+  int coherent;
+  // Start using the open image described by sb.
+  void (*init)(int fd, const superblock_t *sb);
+  // Write everything back and let go of the image (fd is closed by the caller).
+  void (*free)();
+  void *(*get_block)(int bnum);
+  int (*bnum)(const void *ptr);
+  // Start bringing a run of blocks into memory.
+  void (*prefetch)(int bnum, int count);
+  // Note that a block's contents changed (NULL if the backend cannot tell).
+  void (*mark_dirty)(int bnum);
+  // Write a run of blocks back, waiting for the disk if wait is set.
+  int (*sync)(int bnum, int count, int wait);
+  // Keep a block's changes out of the image until it is released (NULL if
+  // nothing needs doing).
+  void (*hold)(int bnum);
+  // A held block's contents are in the image file again.
+  void (*release)(int bnum);
+  // The file was extended from old_count to new_count blocks.
+  int (*grow)(int old_count, int new_count);
+  // The thread's outermost operation ended (NULL if nothing is pinned).
+  void (*op_end)();
+  // Fill in cache statistics (NULL if the backend keeps no cache).
+  void (*get_stats)(blocks_stats_t *st);
+} block_backend_t;
+
+extern const block_backend_t mmap_backend;
+extern const block_backend_t pread_backend;
+extern const block_backend_t direct_backend;
+
+/**
+ * Set the size of the frame cache used by the pread and direct backends.
+ *
+ * @param bytes Cache size in bytes.
+ */
+void pio_set_cache_size(long bytes);
+
+/**
+ * Choose how the pread and direct backends issue I/O: "sync" (preadv and
+ * pwritev, one call per run) or "uring" (every run of a batch in one
+ * io_uring submission).
+ *
+ * @param name Name of the engine.
+ *
+ * @return 0 on success, -EINVAL for an unknown engine.
+ */
+int pio_set_engine(const char *name);
+
+/**
+ * A run of consecutive blocks to read or write, one buffer per block.
+ */
+typedef struct block_io {
+  int bnum;          // first block of the run
+  int count;         // blocks in the run
+  struct iovec *iov; // count buffers of BLOCK_SIZE bytes
+} block_io_t;
+
+/**
+ * Set up an io_uring instance for the engine.
+ *
+ * @param entries Submission queue size.
+ *
+ * @return 0 on success, -errno if io_uring is not available.
+ */
+int uring_open(int entries);
+
+/**
+ * Read or write a batch of runs, submitting as many as fit in the ring at
+ * once and waiting for all of them.
+ *
+ * @param fd The image file.
+ * @param ios The runs.
+ * @param n Number of runs.
+ * @param write 1 to write the runs, 0 to read them.
+ *
+ * @return 0 on success, -errno (or -EIO for a short transfer) if a run
+ *         failed, or 1 if io_uring itself failed: the ring has then been
+ *         closed, nothing is left in flight, and the runs should be redone
+ *         without it.
+ */
+int uring_rw(int fd, block_io_t *ios, int n, int write);
+
+/**
+ * Tear down the io_uring instance.
+ */
+void uring_close();
+
+#endif
@@ -0,0 +1,177 @@
+/**
+ * @file blocks_mmap.c
+ *
+ * Block backend that maps the image into memory.
+ *
+ * Address space for the largest image is reserved up front, so growing the
+ * image never moves the mapping out from under pointers into it.
+ *
+ * On an image with a journal, the metadata region is mapped MAP_PRIVATE and
+ * written back with pwrite when synced, and a data block the journal holds
+ * (a directory or extent block) is remapped MAP_PRIVATE until it is
+ * released, so that the kernel never writes a change the journal has not
+ * committed. By the time a held block is released the journal has written
+ * it home, so mapping the file back over it loses nothing.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "blocks_backend.h"
+
+static int mmap_fd = -1;
+static char *mmap_base = 0;
+static size_t mmap_reserved = 0; // bytes of address space reserved for the image
+static int meta_blocks = 0;      // blocks before data_start if mapped privately, else 0
+static char *meta_dirty = 0;     // one flag per private metadata block
+
+// Map a run of blocks over the reservation, privately or shared.
+static void map_blocks(int bnum, int count, int private) {
+  size_t offset = (size_t) bnum * BLOCK_SIZE;
+  void *mapped = mmap(mmap_base + offset, (size_t) count * BLOCK_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      (private ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED, mmap_fd,
+                      offset);
+  assert(mapped == mmap_base + offset);
+}
+
+static void mmap_init(int fd, const superblock_t *sb) {
+  mmap_fd = fd;
+  mmap_reserved = (size_t) sb->max_block_count * BLOCK_SIZE;
+  mmap_base = mmap(0, mmap_reserved, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(mmap_base != MAP_FAILED);
+
+  map_blocks(0, sb->block_count, 0);
+  if (sb->journal_blocks > 1) {
+    meta_blocks = sb->data_start;
+    meta_dirty = calloc(meta_blocks, 1);
+    map_blocks(0, meta_blocks, 1);
+  }
+}
+
+static int mmap_sync(int bnum, int count, int wait);
+
+static void mmap_free() {
+  if (meta_blocks > 0) {
+    memset(meta_dirty, 1, meta_blocks);
+    mmap_sync(0, meta_blocks, 1);
+    free(meta_dirty);
+    meta_dirty = 0;
+    meta_blocks = 0;
+  }
+  int rv = munmap(mmap_base, mmap_reserved);
+  assert(rv == 0);
+  mmap_base = 0;
+  mmap_fd = -1;
+}
+
+static void *mmap_get_block(int bnum) {
+  return mmap_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+static int mmap_bnum(const void *ptr) {
+  return ((const char *) ptr - mmap_base) / BLOCK_SIZE;
+}
+
+// the kernel reads the run ahead in the background
+static void mmap_prefetch(int bnum, int count) {
+  madvise(mmap_get_block(bnum), (size_t) count * BLOCK_SIZE, MADV_WILLNEED);
+}
+
+static void mmap_mark_dirty(int bnum) {
+  if (bnum < meta_blocks) {
+    __atomic_store_n(&meta_dirty[bnum], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Write the private metadata blocks of a run that were marked dirty (or all
+// of them, if the run lies within the metadata region: the journal names
+// exactly the blocks it wants written).
+static int write_meta(int bnum, int count) {
+  int named = bnum + count <= meta_blocks;
+  int end = bnum + count < meta_blocks ? bnum + count : meta_blocks;
+  int rv = 0;
+  for (int b = bnum; b < end; b++) {
+    if (!__atomic_exchange_n(&meta_dirty[b], 0, __ATOMIC_RELAXED) && !named) {
+      continue;
+    }
+    ssize_t n = pwrite(mmap_fd, mmap_get_block(b), BLOCK_SIZE, (off_t) b * BLOCK_SIZE);
+    if (n != BLOCK_SIZE) {
+      meta_dirty[b] = 1; // try again next time
+      rv = n < 0 ? -errno : -EIO;
+    }
+  }
+  return rv;
+}
+
+// msync waits for the disk; sync_file_range only starts the writeback
+static int mmap_sync(int bnum, int count, int wait) {
+  int rv = write_meta(bnum, count);
+  int wrote_meta = bnum < meta_blocks;
+  if (bnum < meta_blocks) {
+    count -= bnum + count < meta_blocks ? count : meta_blocks - bnum;
+    bnum = meta_blocks;
+  }
+  if (count > 0) {
+    int r;
+    if (wait) {
+      r = msync(mmap_get_block(bnum), (size_t) count * BLOCK_SIZE, MS_SYNC);
+    } else {
+      r = sync_file_range(mmap_fd, (off_t) bnum * BLOCK_SIZE,
+                          (off_t) count * BLOCK_SIZE, SYNC_FILE_RANGE_WRITE);
+    }
+    if (r != 0 && rv == 0) {
+      rv = -errno;
+    }
+  }
+  if (wait && wrote_meta && fdatasync(mmap_fd) != 0 && rv == 0) {
+    rv = -errno;
+  }
+  return rv;
+}
+
+// a held data block gets a private copy of its page; metadata already has one.
+// Readers of the block may run while it is remapped: both mappings hold the
+// same bytes at that moment (a block is held before it changes, and let go
+// only once the file has its last commit), and the kernel swaps them with
+// the address space locked, so a reader sees one or the other
+static void mmap_hold(int bnum) {
+  if (meta_blocks > 0 && bnum >= meta_blocks) {
+    map_blocks(bnum, 1, 1);
+  }
+}
+
+static void mmap_release(int bnum) {
+  if (meta_blocks > 0 && bnum >= meta_blocks) {
+    map_blocks(bnum, 1, 0);
+  }
+}
+
+// map the new tail over the reserved range right after the current mapping
+static int mmap_grow(int old_count, int new_count) {
+  map_blocks(old_count, new_count - old_count, 0);
+  return 0;
+}
+
+const block_backend_t mmap_backend = {
+    .name = "mmap",
+    .coherent = 1, // the mapping is the page cache, except for held blocks
+    .init = mmap_init,
+    .free = mmap_free,
+    .get_block = mmap_get_block,
+    .bnum = mmap_bnum,
+    .prefetch = mmap_prefetch,
+    .mark_dirty = mmap_mark_dirty,
+    .sync = mmap_sync,
+    .hold = mmap_hold,
+    .release = mmap_release,
+    .grow = mmap_grow,
+    .op_end = 0,
+    .get_stats = 0,
+};
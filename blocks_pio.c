@@ -0,0 +1,1008 @@
+/**
+ * @file blocks_pio.c
+ *
+ * Block backends that reach the image with pread and pwrite.
+ *
+ * The metadata region (superblock, bitmaps, inode table and journal) is read
+ * into one buffer when the image is loaded and stays there. Data blocks are
+ * kept in a bounded buffer cache of frames, replaced with ARC: a frame used
+ * once sits on T1, a frame used again moves to T2, and the blocks most
+ * recently evicted from each are remembered on the ghost lists B1 and B2. A
+ * miss on a ghost tells ARC which of recency and frequency it is short of,
+ * and it moves its target size for T1 accordingly. A sequential scan only
+ * ever fills T1, so it cannot push out the blocks that are used over and
+ * over. Blocks read ahead join T1 and are not promoted by their first use.
+ *
+ * A frame is pinned from the time a thread gets it until the thread's
+ * outermost operation ends. Pinned frames are never reused (if every frame
+ * is pinned, the cache grows rather than wait), and a sync waits for a dirty
+ * frame to be unpinned before writing it, so it never writes a block that is
+ * halfway through a change. A background thread writes dirty frames back
+ * periodically and whenever too much of the cache is dirty, so eviction
+ * seldom has to.
+ *
+ * No I/O is done with the cache lock held. A frame being read in is marked
+ * loading and one being written back is marked writing; neither is reused,
+ * and a thread getting one waits for its I/O to finish. A block that cannot
+ * be read is dropped from the cache again, and getting it fails.
+ *
+ * A frame the journal holds (see blocks_hold) is neither evicted nor
+ * written back until the journal releases it, having written a committed
+ * copy of it home itself.
+ *
+ * Reads and writes are batched: a prefetch reads every missing block of a
+ * run at once, and a sync gathers every dirty block of its range. The blocks
+ * of a batch are sorted and coalesced into runs of consecutive blocks, each
+ * issued with one preadv/pwritev or, with the uring engine, all of them with
+ * one io_uring submission.
+ *
+ * The direct backend is the same with the image opened O_DIRECT. All buffers
+ * are page aligned, so both backends work on every filesystem that supports
+ * O_DIRECT at all.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks_backend.h"
+#include "trace.h"
+
+#define PIO_DEFAULT_CACHE (64L << 20) // bytes of data blocks kept in memory
+#define PIO_MIN_FRAMES 1024           // smallest cache, whatever was asked for
+#define PIO_RUN_MAX 256               // blocks in one readv or writev
+#define PIO_RING_ENTRIES 64           // io_uring submission queue size
+#define PIO_WRITEBACK_MS 500          // how often dirty frames are written back
+#define PIO_WRITEBACK_BATCH 256       // most frames written back at once
+#define PIO_DIRTY_RATIO 8             // wake the writeback at 1/8 of frames dirty
+
+// The lists every frame and ghost is on.
+enum { LIST_FREE, LIST_T1, LIST_T2, LIST_B1, LIST_B2, LIST_GFREE, NLISTS };
+
+typedef struct lru {
+  int head; // most recently used, -1 if empty
+  int tail; // least recently used
+  int size;
+} lru_t;
+
+typedef struct link {
+  int prev; // towards the head
+  int next; // towards the tail
+} link_t;
+
+typedef struct frame {
+  int bnum;         // block held by the frame, -1 if none
+  int next;         // next frame in the same hash chain, -1 at the end
+  int list;         // LIST_FREE, LIST_T1 or LIST_T2
+  int pins;         // operations using the frame right now
+  char dirty;       // changed since it was last written
+  char prefetched;  // read ahead and not used since
+  char loading;     // being read in, contents not there yet
+  char writing;     // being written back
+  char journaled;   // held by the journal: not evicted or written back
+  char *data;
+} frame_t;
+
+// A block recently evicted from T1 (on B1) or T2 (on B2).
+typedef struct ghost {
+  int bnum;
+  int next; // next ghost in the same hash chain
+  int list; // LIST_B1, LIST_B2 or LIST_GFREE
+} ghost_t;
+
+// Frames are added in chunks, so their buffers never move.
+typedef struct chunk {
+  char *base;
+  int first; // index of the chunk's first frame
+  int count;
+} chunk_t;
+
+static long cache_size = PIO_DEFAULT_CACHE;
+static int use_direct = 0;
+static int use_uring = 0; // asked for with pio_set_engine
+static int have_uring = 0; // and the ring was set up; ring_lock guards both
+static int pio_fd = -1;
+
+// The ring takes one batch at a time.
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int meta_blocks;  // blocks before data_start, always resident
+static char *meta;       // their contents
+static char *meta_dirty; // one flag per metadata block
+
+// Guards everything below.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpinned = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER; // a frame finished loading or writing
+static frame_t *frames = 0;
+static link_t *frame_links = 0;
+static int nframes = 0;  // also ARC's capacity c, and the number of ghosts
+static ghost_t *ghosts = 0;
+static link_t *ghost_links = 0;
+static chunk_t *chunks = 0;
+static int nchunks = 0;
+static int *buckets = 0; // first frame of each hash chain
+static int *ghost_buckets = 0;
+static int nbuckets = 0; // a power of two
+static lru_t lists[NLISTS];
+static int target = 0; // ARC's target size for T1 (p)
+static int ndirty = 0;
+static blocks_stats_t stats;
+
+// Background writeback.
+static pthread_t writeback_thread;
+static pthread_cond_t writeback_wake = PTHREAD_COND_INITIALIZER;
+static int writeback_stop = 0;
+
+// Frames pinned by this thread's current operation.
+static __thread int *held = 0;
+static __thread int nheld = 0;
+static __thread int held_capacity = 0;
+
+void pio_set_cache_size(long bytes) { cache_size = bytes; }
+
+int pio_set_engine(const char *name) {
+  if (strcmp(name, "sync") == 0) {
+    use_uring = 0;
+  } else if (strcmp(name, "uring") == 0) {
+    use_uring = 1;
+  } else {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static void *alloc_aligned(size_t size) {
+  void *ptr;
+  int rv = posix_memalign(&ptr, 4096, size);
+  assert(rv == 0);
+  return ptr;
+}
+
+// Frames and ghosts share the list code; these pick the right links.
+static link_t *links_of(int list) {
+  return list >= LIST_B1 ? ghost_links : frame_links;
+}
+
+static void list_push(int list, int i) {
+  link_t *links = links_of(list);
+  lru_t *l = &lists[list];
+  links[i].prev = -1;
+  links[i].next = l->head;
+  if (l->head >= 0) {
+    links[l->head].prev = i;
+  } else {
+    l->tail = i;
+  }
+  l->head = i;
+  l->size++;
+}
+
+static void list_remove(int list, int i) {
+  link_t *links = links_of(list);
+  lru_t *l = &lists[list];
+  if (links[i].prev >= 0) {
+    links[links[i].prev].next = links[i].next;
+  } else {
+    l->head = links[i].next;
+  }
+  if (links[i].next >= 0) {
+    links[links[i].next].prev = links[i].prev;
+  } else {
+    l->tail = links[i].prev;
+  }
+  l->size--;
+}
+
+static void move_frame(int idx, int list) {
+  list_remove(frames[idx].list, idx);
+  frames[idx].list = list;
+  list_push(list, idx);
+}
+
+static int bucket_of(int bnum) {
+  return ((uint32_t) bnum * 2654435761u) & (nbuckets - 1);
+}
+
+// Rebuild the hash tables for the current number of frames.
+static void rehash() {
+  int size = 64;
+  while (size < 2 * nframes) {
+    size *= 2;
+  }
+  free(buckets);
+  free(ghost_buckets);
+  buckets = malloc(size * sizeof(int));
+  ghost_buckets = malloc(size * sizeof(int));
+  nbuckets = size;
+  for (int i = 0; i < nbuckets; i++) {
+    buckets[i] = -1;
+    ghost_buckets[i] = -1;
+  }
+  for (int i = 0; i < nframes; i++) {
+    if (frames[i].bnum >= 0) {
+      int b = bucket_of(frames[i].bnum);
+      frames[i].next = buckets[b];
+      buckets[b] = i;
+    }
+    if (ghosts[i].list != LIST_GFREE) {
+      int b = bucket_of(ghosts[i].bnum);
+      ghosts[i].next = ghost_buckets[b];
+      ghost_buckets[b] = i;
+    }
+  }
+}
+
+// Add count empty frames (and as many ghosts) to the cache; cache_lock held
+// (or not shared yet).
+static void add_frames(int count) {
+  char *base = alloc_aligned((size_t) count * BLOCK_SIZE);
+  chunks = realloc(chunks, (nchunks + 1) * sizeof(chunk_t));
+  chunks[nchunks++] = (chunk_t){base, nframes, count};
+
+  frames = realloc(frames, (nframes + count) * sizeof(frame_t));
+  frame_links = realloc(frame_links, (nframes + count) * sizeof(link_t));
+  ghosts = realloc(ghosts, (nframes + count) * sizeof(ghost_t));
+  ghost_links = realloc(ghost_links, (nframes + count) * sizeof(link_t));
+  for (int i = nframes; i < nframes + count; i++) {
+    frames[i] = (frame_t){-1, -1, LIST_FREE, 0, 0, 0, 0, 0, 0, base + (size_t) (i - nframes) * BLOCK_SIZE};
+    list_push(LIST_FREE, i);
+    ghosts[i] = (ghost_t){-1, -1, LIST_GFREE};
+    list_push(LIST_GFREE, i);
+  }
+  nframes += count;
+  rehash();
+}
+
+static int find_frame(int bnum) {
+  for (int i = buckets[bucket_of(bnum)]; i >= 0; i = frames[i].next) {
+    if (frames[i].bnum == bnum) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void unhash(int idx) {
+  int *link = &buckets[bucket_of(frames[idx].bnum)];
+  while (*link != idx) {
+    link = &frames[*link].next;
+  }
+  *link = frames[idx].next;
+  frames[idx].bnum = -1;
+}
+
+static int find_ghost(int bnum) {
+  for (int i = ghost_buckets[bucket_of(bnum)]; i >= 0; i = ghosts[i].next) {
+    if (ghosts[i].bnum == bnum) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void forget_ghost(int g) {
+  int *link = &ghost_buckets[bucket_of(ghosts[g].bnum)];
+  while (*link != g) {
+    link = &ghosts[*link].next;
+  }
+  *link = ghosts[g].next;
+  list_remove(ghosts[g].list, g);
+  ghosts[g].list = LIST_GFREE;
+  list_push(LIST_GFREE, g);
+}
+
+// Remember an evicted block on B1 or B2.
+static void add_ghost(int bnum, int list) {
+  if (lists[LIST_GFREE].size == 0) {
+    forget_ghost(lists[LIST_B1].size >= lists[LIST_B2].size ? lists[LIST_B1].tail
+                                                            : lists[LIST_B2].tail);
+  }
+  int g = lists[LIST_GFREE].tail;
+  list_remove(LIST_GFREE, g);
+  ghosts[g].bnum = bnum;
+  ghosts[g].list = list;
+  list_push(list, g);
+  int b = bucket_of(bnum);
+  ghosts[g].next = ghost_buckets[b];
+  ghost_buckets[b] = g;
+}
+
+static void set_dirty(int idx, int dirty) {
+  if (frames[idx].dirty != dirty) {
+    frames[idx].dirty = dirty;
+    ndirty += dirty ? 1 : -1;
+  }
+}
+
+// A block waiting to be read or written, and the buffer it goes through.
+typedef struct pending {
+  int bnum;
+  char *buf;
+} pending_t;
+
+static int compare_pending(const void *a, const void *b) {
+  return ((const pending_t *) a)->bnum - ((const pending_t *) b)->bnum;
+}
+
+// Read or write one run with a single system call.
+static int rw_run(block_io_t *io, int write) {
+  off_t off = (off_t) io->bnum * BLOCK_SIZE;
+  ssize_t rv = write ? pwritev(pio_fd, io->iov, io->count, off)
+                     : preadv(pio_fd, io->iov, io->count, off);
+  if (rv != (ssize_t) io->count * BLOCK_SIZE) {
+    return rv < 0 ? -errno : -EIO;
+  }
+  return 0;
+}
+
+// Read or write a set of blocks, sorted and coalesced into runs of
+// consecutive blocks; cache_lock not held.
+static int do_io(pending_t *blocks, int n, int write) {
+  if (n == 0) {
+    return 0;
+  }
+  qsort(blocks, n, sizeof(pending_t), compare_pending);
+  struct iovec *iov = malloc(n * sizeof(struct iovec));
+  block_io_t *runs = malloc(n * sizeof(block_io_t));
+  int nruns = 0;
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = blocks[i].buf;
+    iov[i].iov_len = BLOCK_SIZE;
+    block_io_t *last = nruns > 0 ? &runs[nruns - 1] : 0;
+    if (last && last->bnum + last->count == blocks[i].bnum && last->count < PIO_RUN_MAX) {
+      last->count++;
+    } else {
+      runs[nruns++] = (block_io_t){blocks[i].bnum, 1, &iov[i]};
+    }
+  }
+
+  int rv = 0;
+  pthread_mutex_lock(&ring_lock);
+  int uring = have_uring;
+  if (uring) {
+    rv = uring_rw(pio_fd, runs, nruns, write);
+    if (rv > 0) {
+      fprintf(stderr, "nufs: io_uring failed, using preadv/pwritev from now on\n");
+      have_uring = uring = 0;
+      rv = 0;
+    }
+  }
+  pthread_mutex_unlock(&ring_lock);
+  if (!uring) {
+    for (int i = 0; i < nruns && rv == 0; i++) {
+      rv = rw_run(&runs[i], write);
+    }
+  }
+  free(iov);
+  free(runs);
+  return rv;
+}
+
+// Mark dirty, unpinned frames as being written back; cache_lock held. They
+// count as clean from here on, and are dirty again if the write fails.
+static void begin_writes(const int *idxs, int n) {
+  for (int i = 0; i < n; i++) {
+    frames[idxs[i]].writing = 1;
+    set_dirty(idxs[i], 0);
+  }
+}
+
+// Finish writing frames back; cache_lock held.
+static void end_writes(const int *idxs, int n, int rv) {
+  for (int i = 0; i < n; i++) {
+    frames[idxs[i]].writing = 0;
+    if (rv < 0) {
+      set_dirty(idxs[i], 1);
+    }
+  }
+  pthread_cond_broadcast(&io_done);
+  pthread_cond_broadcast(&unpinned);
+}
+
+// Write a list of dirty, unpinned frames back in one batch; cache_lock
+// held, and dropped while they are written.
+static int write_frames(int *idxs, int n) {
+  pending_t *blocks = malloc((n > 0 ? n : 1) * sizeof(pending_t));
+  for (int i = 0; i < n; i++) {
+    blocks[i] = (pending_t){frames[idxs[i]].bnum, frames[idxs[i]].data};
+  }
+  begin_writes(idxs, n);
+  pthread_mutex_unlock(&cache_lock);
+  int rv = do_io(blocks, n, 1);
+  pthread_mutex_lock(&cache_lock);
+  end_writes(idxs, n, rv);
+  free(blocks);
+  return rv;
+}
+
+static int held_here(int idx) {
+  for (int i = 0; i < nheld; i++) {
+    if (held[i] == idx) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Collect the frames holding blocks in [lo, end) that are dirty or being
+// written back; cache_lock held.
+static int dirty_frames(int lo, int end, int *out) {
+  int n = 0;
+  if (end - lo > nframes) {
+    for (int idx = 0; idx < nframes; idx++) {
+      if ((frames[idx].dirty || frames[idx].writing) && frames[idx].bnum >= lo &&
+          frames[idx].bnum < end) {
+        out[n++] = idx;
+      }
+    }
+  } else {
+    for (int b = lo; b < end; b++) {
+      int idx = find_frame(b);
+      if (idx >= 0 && (frames[idx].dirty || frames[idx].writing)) {
+        out[n++] = idx;
+      }
+    }
+  }
+  return n;
+}
+
+// The least recently used frame on a list that can be reused, or -1.
+static int lru_unpinned(int list) {
+  int idx = lists[list].tail;
+  while (idx >= 0 && (frames[idx].pins > 0 || frames[idx].writing || frames[idx].journaled)) {
+    idx = frame_links[idx].prev;
+  }
+  return idx;
+}
+
+// ARC's REPLACE: free up a frame, evicting from T1 if it is over its
+// target (or at it, when the block being brought in was on B2) and from T2
+// otherwise; cache_lock held, and dropped while a dirty frame is written
+// back, after which the choice is made again.
+static int replace(int from_b2) {
+  for (int tries = 0; lists[LIST_FREE].size == 0 && tries < nframes; tries++) {
+    int t1 = lists[LIST_T1].size;
+    int from_t1 = t1 > 0 && (t1 > target || (from_b2 && t1 == target));
+    int idx = lru_unpinned(from_t1 ? LIST_T1 : LIST_T2);
+    if (idx < 0) {
+      idx = lru_unpinned(from_t1 ? LIST_T2 : LIST_T1);
+    }
+    if (idx < 0) {
+      break; // everything is pinned by operations in flight
+    }
+
+    frame_t *f = &frames[idx];
+    if (f->dirty) {
+      int bnum = f->bnum;
+      int rv = write_frames(&idx, 1);
+      if (rv < 0) {
+        fprintf(stderr, "nufs: cannot write back block %d: %s\n", bnum, strerror(-rv));
+        if (frames[idx].bnum == bnum && frames[idx].list != LIST_FREE) {
+          move_frame(idx, frames[idx].list); // try the others first
+        }
+      } else {
+        stats.evict_writes++;
+      }
+      continue;
+    }
+    // a block read ahead and never used is not worth remembering
+    if (!f->prefetched) {
+      add_ghost(f->bnum, f->list == LIST_T1 ? LIST_B1 : LIST_B2);
+    }
+    unhash(idx);
+    move_frame(idx, LIST_FREE);
+    stats.evictions++;
+  }
+
+  if (lists[LIST_FREE].size == 0) {
+    add_frames(nframes / 4);
+    TRACE(FRAMES_GROW, nframes);
+  }
+  return lists[LIST_FREE].tail;
+}
+
+// Give a frame to a block that is about to be read, following ARC for a
+// demand miss; cache_lock held. The frame comes back pinned and loading,
+// or -1 if another thread brought the block in while replace had the lock
+// dropped.
+static int admit(int bnum, int demand) {
+  int c = nframes;
+  int list = LIST_T1;
+  int from_b2 = 0;
+  int g = find_ghost(bnum);
+  if (g >= 0 && demand) {
+    // evicted too soon: grow whichever list it was evicted from
+    int b1 = lists[LIST_B1].size;
+    int b2 = lists[LIST_B2].size;
+    if (ghosts[g].list == LIST_B1) {
+      int delta = b2 / b1 > 1 ? b2 / b1 : 1;
+      target = target + delta < c ? target + delta : c;
+    } else {
+      int delta = b1 / b2 > 1 ? b1 / b2 : 1;
+      target = target - delta > 0 ? target - delta : 0;
+      from_b2 = 1;
+    }
+    forget_ghost(g);
+    list = LIST_T2;
+    stats.ghost_hits++;
+  } else {
+    if (g >= 0) {
+      forget_ghost(g);
+    }
+    // keep |T1| + |B1| <= c and the whole directory within 2c
+    int t1b1 = lists[LIST_T1].size + lists[LIST_B1].size;
+    int all = t1b1 + lists[LIST_T2].size + lists[LIST_B2].size;
+    if (t1b1 >= c && lists[LIST_B1].size > 0) {
+      forget_ghost(lists[LIST_B1].tail);
+    } else if (all >= 2 * c && lists[LIST_B2].size > 0) {
+      forget_ghost(lists[LIST_B2].tail);
+    }
+  }
+
+  int idx = replace(from_b2);
+  if (find_frame(bnum) >= 0) {
+    return -1;
+  }
+  frame_t *f = &frames[idx];
+  f->bnum = bnum;
+  f->prefetched = !demand;
+  f->loading = 1;
+  f->pins++;
+  set_dirty(idx, 0);
+  move_frame(idx, list);
+  int b = bucket_of(bnum);
+  f->next = buckets[b];
+  buckets[b] = idx;
+  return idx;
+}
+
+// Frees a thread's list of pinned frames when the thread exits.
+static pthread_key_t held_key;
+static pthread_once_t held_once = PTHREAD_ONCE_INIT;
+
+static void make_held_key() { pthread_key_create(&held_key, free); }
+
+// Remember that this thread's operation has a frame pinned.
+static void hold(int idx) {
+  if (nheld == held_capacity) {
+    held_capacity = held_capacity ? 2 * held_capacity : 64;
+    held = realloc(held, held_capacity * sizeof(int));
+    pthread_once(&held_once, make_held_key);
+    pthread_setspecific(held_key, held);
+  }
+  held[nheld++] = idx;
+}
+
+// Write back up to a batch of dirty, unpinned frames, least recently used
+// first; cache_lock held.
+static void write_back_some() {
+  int idxs[PIO_WRITEBACK_BATCH];
+  int n = 0;
+  for (int list = LIST_T1; list <= LIST_T2; list++) {
+    for (int idx = lists[list].tail; idx >= 0 && n < PIO_WRITEBACK_BATCH;
+         idx = frame_links[idx].prev) {
+      if (frames[idx].dirty && frames[idx].pins == 0 && !frames[idx].journaled) {
+        idxs[n++] = idx;
+      }
+    }
+  }
+  int rv = write_frames(idxs, n);
+  if (rv < 0) {
+    fprintf(stderr, "nufs: background writeback failed: %s\n", strerror(-rv));
+  } else {
+    stats.writebacks += n;
+  }
+}
+
+// Writeback thread: every PIO_WRITEBACK_MS, or sooner if woken because too
+// much of the cache is dirty.
+static void *writeback_main(void *arg) {
+  pthread_mutex_lock(&cache_lock);
+  while (!writeback_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += PIO_WRITEBACK_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&writeback_wake, &cache_lock, &deadline);
+    if (!writeback_stop && ndirty > 0) {
+      write_back_some();
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+static void pio_init(int fd, const superblock_t *sb) {
+  pio_fd = fd;
+  meta_blocks = sb->data_start;
+  meta = alloc_aligned((size_t) meta_blocks * BLOCK_SIZE);
+  meta_dirty = calloc(meta_blocks, 1);
+  size_t size = (size_t) meta_blocks * BLOCK_SIZE;
+  for (size_t done = 0; done < size;) {
+    ssize_t rv = pread(fd, meta + done, size - done, done);
+    assert(rv > 0);
+    done += rv;
+  }
+
+  if (use_direct) {
+    int flags = fcntl(fd, F_GETFL);
+    if (fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) {
+      fprintf(stderr, "nufs: O_DIRECT not supported for this image (%s), "
+                      "going through the page cache\n", strerror(errno));
+    }
+  }
+
+  if (use_uring) {
+    int rv = uring_open(PIO_RING_ENTRIES);
+    if (rv < 0) {
+      fprintf(stderr, "nufs: io_uring not available (%s), using preadv/pwritev\n",
+              strerror(-rv));
+    }
+    have_uring = rv == 0;
+  }
+
+  for (int list = 0; list < NLISTS; list++) {
+    lists[list] = (lru_t){-1, -1, 0};
+  }
+  target = 0;
+  ndirty = 0;
+  memset(&stats, 0, sizeof(stats));
+  long count = cache_size / BLOCK_SIZE;
+  add_frames(count < PIO_MIN_FRAMES ? PIO_MIN_FRAMES : count);
+  printf("+ %s backend (%s): %d metadata blocks resident, %d frames\n",
+         use_direct ? "direct" : "pread", have_uring ? "io_uring" : "sync",
+         meta_blocks, nframes);
+
+  writeback_stop = 0;
+  pthread_create(&writeback_thread, 0, writeback_main, 0);
+}
+
+static void direct_init(int fd, const superblock_t *sb) {
+  use_direct = 1;
+  pio_init(fd, sb);
+}
+
+// Finish reading frames in; cache_lock held. A frame that could not be
+// read is dropped, so that the next thread to get its block tries again.
+static void end_loads(const int *idxs, int n, int rv) {
+  for (int i = 0; i < n; i++) {
+    frame_t *f = &frames[idxs[i]];
+    f->loading = 0;
+    if (rv < 0) {
+      unhash(idxs[i]);
+      move_frame(idxs[i], LIST_FREE);
+    }
+  }
+  pthread_cond_broadcast(&io_done);
+}
+
+static void *pio_get_block(int bnum) {
+  if (bnum < meta_blocks) {
+    return meta + (size_t) bnum * BLOCK_SIZE;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  int idx = find_frame(bnum);
+  while (idx < 0 || frames[idx].loading || frames[idx].writing) {
+    if (idx >= 0) {
+      pthread_cond_wait(&io_done, &cache_lock); // loaded, written or dropped
+      idx = find_frame(bnum);
+      continue;
+    }
+    idx = admit(bnum, 1);
+    if (idx < 0) {
+      idx = find_frame(bnum);
+      continue;
+    }
+    stats.misses++;
+    pending_t one = {bnum, frames[idx].data};
+    pthread_mutex_unlock(&cache_lock);
+    int rv = do_io(&one, 1, 0);
+    pthread_mutex_lock(&cache_lock);
+    end_loads(&idx, 1, rv);
+    if (rv < 0) {
+      frames[idx].pins--;
+      pthread_mutex_unlock(&cache_lock);
+      fprintf(stderr, "nufs: cannot read block %d: %s\n", bnum, strerror(-rv));
+      return 0;
+    }
+    hold(idx); // admit pinned it
+    char *data = frames[idx].data;
+    pthread_mutex_unlock(&cache_lock);
+    return data;
+  }
+
+  stats.hits++;
+  // the first use of a block read ahead is its first use, not a repeat
+  move_frame(idx, frames[idx].prefetched ? LIST_T1 : LIST_T2);
+  frames[idx].prefetched = 0;
+  frame_t *f = &frames[idx];
+  // the same block is often got again and again by one operation
+  if (nheld == 0 || held[nheld - 1] != idx) {
+    f->pins++;
+    hold(idx);
+  }
+  char *data = f->data;
+  pthread_mutex_unlock(&cache_lock);
+  return data;
+}
+
+// Read every block of the run that is not cached yet in one batch.
+static void pio_prefetch(int bnum, int count) {
+  if (bnum < meta_blocks) {
+    count -= meta_blocks - bnum;
+    bnum = meta_blocks;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  if (count > nframes / 4) {
+    count = nframes / 4; // never push out most of the cache
+  }
+  pending_t *blocks = malloc((count > 0 ? count : 1) * sizeof(pending_t));
+  int *taken = malloc((count > 0 ? count : 1) * sizeof(int));
+  int n = 0;
+  for (int b = bnum; b < bnum + count; b++) {
+    if (find_frame(b) < 0) {
+      int idx = admit(b, 0); // pinned, so admitting the next block can't reuse it
+      if (idx >= 0) {
+        taken[n] = idx;
+        blocks[n++] = (pending_t){b, frames[idx].data};
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  int rv = do_io(blocks, n, 0);
+  pthread_mutex_lock(&cache_lock);
+  end_loads(taken, n, rv);
+  for (int i = 0; i < n; i++) {
+    frames[taken[i]].pins--;
+  }
+  if (rv == 0) {
+    stats.prefetched += n;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(blocks);
+  free(taken);
+}
+
+static int pio_bnum(const void *ptr) {
+  const char *p = ptr;
+  if (p >= meta && p < meta + (size_t) meta_blocks * BLOCK_SIZE) {
+    return (p - meta) / BLOCK_SIZE;
+  }
+
+  int bnum = -1;
+  pthread_mutex_lock(&cache_lock);
+  for (int c = 0; c < nchunks; c++) {
+    chunk_t *ch = &chunks[c];
+    if (p >= ch->base && p < ch->base + (size_t) ch->count * BLOCK_SIZE) {
+      bnum = frames[ch->first + (p - ch->base) / BLOCK_SIZE].bnum;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  assert(bnum >= 0);
+  return bnum;
+}
+
+static void pio_mark_dirty(int bnum) {
+  if (bnum < meta_blocks) {
+    __atomic_store_n(&meta_dirty[bnum], 1, __ATOMIC_RELAXED);
+    return;
+  }
+  pthread_mutex_lock(&cache_lock);
+  int idx = find_frame(bnum);
+  if (idx >= 0) {
+    set_dirty(idx, 1);
+    if (ndirty == nframes / PIO_DIRTY_RATIO) {
+      pthread_cond_signal(&writeback_wake);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// Write back the dirty blocks in a run, coalesced into as few writes as
+// possible and issued as one batch.
+//
+// A dirty frame that another thread has pinned may be halfway through a
+// change, so with wait set the sync waits for it to be let go, and without
+// it the frame is left for later. Frames the journal holds are skipped.
+// Metadata blocks are not pinned: without a journal, like the kernel writing
+// back a mapped image, a sync may catch one mid-change; with one, they are
+// only marked when the journal cannot hold them. A run within the metadata
+// region (the journal naming exactly the blocks it wants written) is
+// written whether or not marked.
+static int pio_sync(int bnum, int count, int wait) {
+  int end = bnum + count;
+  int named = end <= meta_blocks;
+  int lo = bnum > meta_blocks ? bnum : meta_blocks;
+
+  pthread_mutex_lock(&cache_lock);
+  int *idxs = malloc(nframes * sizeof(int));
+  for (int busy = 1; wait && busy;) {
+    busy = 0;
+    int n = dirty_frames(lo, end, idxs);
+    for (int i = 0; i < n && !busy; i++) {
+      frame_t *f = &frames[idxs[i]];
+      busy = !f->journaled && ((f->pins > 0 && !held_here(idxs[i])) || f->writing);
+    }
+    if (busy) {
+      pthread_cond_wait(&unpinned, &cache_lock);
+      idxs = realloc(idxs, nframes * sizeof(int));
+    }
+  }
+
+  int meta_end = end < meta_blocks ? end : meta_blocks;
+  int nmeta = meta_end > bnum ? meta_end - bnum : 0;
+  pending_t *blocks = malloc((nmeta + nframes + 1) * sizeof(pending_t));
+  int n = 0;
+  for (int b = bnum; b < meta_end; b++) {
+    if (__atomic_exchange_n(&meta_dirty[b], 0, __ATOMIC_RELAXED) || named) {
+      blocks[n++] = (pending_t){b, meta + (size_t) b * BLOCK_SIZE};
+    }
+  }
+  int nwritten = n;
+  int nfound = dirty_frames(lo, end, idxs);
+  for (int i = 0; i < nfound; i++) {
+    frame_t *f = &frames[idxs[i]];
+    if (f->pins == 0 && !f->writing && !f->journaled) {
+      blocks[n++] = (pending_t){f->bnum, f->data};
+      idxs[n - 1 - nwritten] = idxs[i];
+    }
+  }
+  begin_writes(idxs, n - nwritten);
+  pthread_mutex_unlock(&cache_lock);
+  int rv = do_io(blocks, n, 1);
+  pthread_mutex_lock(&cache_lock);
+  end_writes(idxs, n - nwritten, rv);
+  if (rv < 0) {
+    for (int i = 0; i < n; i++) {
+      if (blocks[i].bnum < meta_blocks) {
+        meta_dirty[blocks[i].bnum] = 1; // try again next time
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(idxs);
+  free(blocks);
+
+  if (rv == 0 && wait && fdatasync(pio_fd) != 0) {
+    rv = -errno;
+  }
+  return rv;
+}
+
+// The journal only holds blocks it has just changed, so they are resident
+// (and pinned by the operation that changed them).
+static void set_journaled(int bnum, int journaled) {
+  if (bnum < meta_blocks) {
+    return; // only ever written when named or marked
+  }
+  pthread_mutex_lock(&cache_lock);
+  int idx = find_frame(bnum);
+  if (idx >= 0) {
+    frames[idx].journaled = journaled;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void pio_hold(int bnum) { set_journaled(bnum, 1); }
+
+static void pio_release(int bnum) { set_journaled(bnum, 0); }
+
+// New blocks read back as zeros, so there is nothing to do.
+static int pio_grow(int old_count, int new_count) { return 0; }
+
+static void pio_op_end() {
+  int released = 0;
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < nheld; i++) {
+    if (--frames[held[i]].pins == 0 && frames[held[i]].dirty) {
+      released = 1;
+    }
+  }
+  if (released) {
+    pthread_cond_broadcast(&unpinned);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  nheld = 0;
+}
+
+static void pio_get_stats(blocks_stats_t *st) {
+  pthread_mutex_lock(&cache_lock);
+  *st = stats;
+  st->frames = nframes;
+  st->dirty = ndirty;
+  st->target = target;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void pio_free() {
+  pio_op_end();
+  pthread_mutex_lock(&cache_lock);
+  writeback_stop = 1;
+  pthread_cond_signal(&writeback_wake);
+  pthread_mutex_unlock(&cache_lock);
+  pthread_join(writeback_thread, 0);
+
+  // unmarked changes (e.g. access times) are written here at the latest
+  memset(meta_dirty, 1, meta_blocks);
+  int rv = pio_sync(0, BLOCK_COUNT, 1);
+  if (rv < 0) {
+    fprintf(stderr, "nufs: cannot write back the image: %s\n", strerror(-rv));
+  }
+  long lookups = stats.hits + stats.misses;
+  printf("+ block cache: %ld hits, %ld misses (%.1f%% hit rate), %ld read ahead, "
+         "%ld evictions\n", stats.hits, stats.misses,
+         lookups ? 100.0 * stats.hits / lookups : 0.0, stats.prefetched,
+         stats.evictions);
+  if (have_uring) {
+    uring_close();
+    have_uring = 0;
+  }
+
+  for (int c = 0; c < nchunks; c++) {
+    free(chunks[c].base);
+  }
+  free(chunks);
+  free(frames);
+  free(frame_links);
+  free(ghosts);
+  free(ghost_links);
+  free(buckets);
+  free(ghost_buckets);
+  free(meta);
+  free(meta_dirty);
+  chunks = 0;
+  frames = 0;
+  frame_links = 0;
+  ghosts = 0;
+  ghost_links = 0;
+  buckets = 0;
+  ghost_buckets = 0;
+  nchunks = nframes = nbuckets = 0;
+  use_direct = 0;
+  pio_fd = -1;
+}
+
+const block_backend_t pread_backend = {
+    .name = "pread",
+    .coherent = 0,
+    .init = pio_init,
+    .free = pio_free,
+    .get_block = pio_get_block,
+    .bnum = pio_bnum,
+    .prefetch = pio_prefetch,
+    .mark_dirty = pio_mark_dirty,
+    .sync = pio_sync,
+    .hold = pio_hold,
+    .release = pio_release,
+    .grow = pio_grow,
+    .op_end = pio_op_end,
+    .get_stats = pio_get_stats,
+};
+
+const block_backend_t direct_backend = {
+    .name = "direct",
+    .coherent = 0,
+    .init = direct_init,
+    .free = pio_free,
+    .get_block = pio_get_block,
+    .bnum = pio_bnum,
+    .prefetch = pio_prefetch,
+    .mark_dirty = pio_mark_dirty,
+    .sync = pio_sync,
+    .hold = pio_hold,
+    .release = pio_release,
+    .grow = pio_grow,
+    .op_end = pio_op_end,
+    .get_stats = pio_get_stats,
+};
@@ -1,3 +1,14 @@
+/**
+ * @file blocks_test.c
+ *
+ * Checks that block allocation is next fit: each search starts after the
+ * last block handed out rather than at the start of the data area, wraps
+ * around to the blocks freed behind the cursor once it reaches the end, and
+ * carries on from the same place after the image is mounted again.
+ *
+ * Build with the storage sources:
+ *   gcc -g -pthread -o blocks_test blocks_test.c $(SRCS) -lm
+ */
 #include <stdio.h>
 
 #include "bitmap.h"
@@ -5,32 +16,71 @@
 
 #define TEST_NAME "block_test.img"
 
-int main(int argc, char **argv) {
-  blocks_init(TEST_NAME);
-
-  printf("Block bitmap at the beginning:\n");
-  bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
-
-  int block_num = alloc_block();
+static int failures = 0;
 
-  printf("Allocated block no. %d\n", block_num);
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: " __VA_ARGS__);                                            \
+      putchar('\n');                                                           \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
 
-  printf("Block bitmap after allocating:\n");
-  bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
+int main(int argc, char **argv) {
+  blocks_format(TEST_NAME, 256, 256, 64, 64, 0);
+  blocks_init(TEST_NAME);
+  int first = get_superblock()->data_start;
 
-  long *block = blocks_get_block(block_num);
+  int a = alloc_block();
+  int b = alloc_block();
+  CHECK(a == first && b == first + 1, "first blocks are %d and %d, not %d and %d",
+        a, b, first, first + 1);
+  CHECK(bitmap_get(get_blocks_bitmap(), a) && bitmap_get(get_blocks_bitmap(), b),
+        "allocated blocks not marked in the bitmap");
 
+  long *block = blocks_get_block(b);
   for (int i = 0; i < 42; i++) {
     block[i] = i + 1;
   }
 
-  printf("Written to block %d:", block_num);
-  for (int i = 0; i < 42; i++) {
-    printf(" %ld", block[i]);
-  }
-  putchar('\n');
+  // a freed block behind the cursor waits until the search wraps around
+  free_block(a);
+  CHECK(!bitmap_get(get_blocks_bitmap(), a), "freed block %d still marked", a);
+  int c = alloc_block();
+  CHECK(c == b + 1, "allocated %d after freeing %d, not %d", c, a, b + 1);
 
+  // and the cursor survives a remount
   blocks_free();
+  blocks_init(TEST_NAME);
+  int d = alloc_block();
+  CHECK(d == c + 1, "allocated %d after remounting, not %d", d, c + 1);
+  block = blocks_get_block(b);
+  int i = 0;
+  while (i < 42 && block[i] == i + 1) {
+    i++;
+  }
+  CHECK(i == 42, "block %d differs at word %d after remounting", b, i);
+
+  // runs start at the cursor too, unless given a goal
+  int got;
+  int run = alloc_blocks(4, 0, &got);
+  CHECK(run == d + 1 && got == 4, "run of 4 at %d (%d blocks), not at %d", run, got, d + 1);
+  free_block(run + 1);
+  run = alloc_blocks(1, run + 1, &got);
+  CHECK(run == d + 2 && got == 1, "goal %d gave block %d", d + 2, run);
 
-  return 0;
+  // filling the rest of the image wraps around to the freed block
+  int last = -1;
+  for (int bnum = alloc_block(); bnum >= 0; bnum = alloc_block()) {
+    CHECK(bnum > last || bnum == a, "allocated %d after %d", bnum, last);
+    last = bnum;
+  }
+  CHECK(last == a, "the last free block was %d, not %d", last, a);
+  CHECK(bitmap_find_clear(get_blocks_bitmap(), first, BLOCK_COUNT) == -1,
+        "a free block left once alloc_block gave up");
+
+  blocks_free();
+  printf("blocks_test: %s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
 }
@@ -0,0 +1,188 @@
+/**
+ * @file blocks_uring.c
+ *
+ * An io_uring engine for the pread and direct block backends.
+ *
+ * Talks to the kernel with the raw system calls, so there is no dependency
+ * on liburing. The engine holds a lock of its own around every use of the
+ * ring, so the ring needs no locking here: a batch of runs is queued,
+ * submitted with io_uring_enter, and every completion is waited for and
+ * reaped.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// linux/fs.h (pulled in by io_uring.h) has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+#include "blocks_backend.h"
+
+static int ring_fd = -1;
+static unsigned ring_entries;
+static void *sq_ring = MAP_FAILED;
+static void *cq_ring = MAP_FAILED;
+static size_t sq_ring_size;
+static size_t cq_ring_size;
+static struct io_uring_sqe *sqes = MAP_FAILED;
+static size_t sqes_size;
+
+static unsigned *sq_tail;
+static unsigned *sq_mask;
+static unsigned *sq_array;
+static unsigned *cq_head;
+static unsigned *cq_tail;
+static unsigned *cq_mask;
+static struct io_uring_cqe *cqes;
+
+int uring_open(int entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    return -errno;
+  }
+  ring_entries = params.sq_entries;
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size > sq_ring_size) {
+      sq_ring_size = cq_ring_size;
+    }
+    cq_ring_size = sq_ring_size;
+  }
+  sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    goto fail;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      goto fail;
+    }
+  }
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  sq_tail = (unsigned *) ((char *) sq_ring + params.sq_off.tail);
+  sq_mask = (unsigned *) ((char *) sq_ring + params.sq_off.ring_mask);
+  sq_array = (unsigned *) ((char *) sq_ring + params.sq_off.array);
+  cq_head = (unsigned *) ((char *) cq_ring + params.cq_off.head);
+  cq_tail = (unsigned *) ((char *) cq_ring + params.cq_off.tail);
+  cq_mask = (unsigned *) ((char *) cq_ring + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) ((char *) cq_ring + params.cq_off.cqes);
+  return 0;
+
+fail:;
+  int rv = -errno;
+  uring_close();
+  return rv;
+}
+
+void uring_close() {
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  sqes = MAP_FAILED;
+  sq_ring = cq_ring = MAP_FAILED;
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+  ring_fd = -1;
+}
+
+// Wait for and reap n completions of a batch, keeping the first error.
+// Never returns while one of them is still in flight, since the kernel
+// would go on reading or writing the frames after the caller moved on.
+static int reap_batch(block_io_t *ios, int n) {
+  int result = 0;
+  for (int reaped = 0; reaped < n;) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      int rv = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+      if (rv < 0 && errno != EINTR) {
+        sched_yield(); // the completions still arrive; poll for them
+      }
+      continue;
+    }
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    block_io_t *io = &ios[cqe->user_data];
+    if (result == 0 && cqe->res < 0) {
+      result = cqe->res;
+    } else if (result == 0 && cqe->res != io->count * BLOCK_SIZE) {
+      result = -EIO;
+    }
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    reaped++;
+  }
+  return result;
+}
+
+// Submit up to ring_entries runs and wait for all of them. If the kernel
+// refuses the submission, the runs it did take are reaped, the rest are
+// taken back off the queue and the ring is closed.
+static int submit_batch(int fd, block_io_t *ios, int n, int write) {
+  unsigned tail = *sq_tail;
+  for (int i = 0; i < n; i++) {
+    unsigned slot = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) ios[i].iov;
+    sqe->len = ios[i].count;
+    sqe->off = (uint64_t) ios[i].bnum * BLOCK_SIZE;
+    sqe->user_data = i;
+    sq_array[slot] = slot;
+    tail++;
+  }
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+  int submitted = 0;
+  while (submitted < n) {
+    int rv = syscall(__NR_io_uring_enter, ring_fd, n - submitted, n - submitted,
+                     IORING_ENTER_GETEVENTS, 0, 0);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      // the kernel only takes entries off the queue in io_uring_enter, so
+      // the ones it has not taken can be withdrawn
+      __atomic_store_n(sq_tail, tail - (n - submitted), __ATOMIC_RELEASE);
+      reap_batch(ios, submitted);
+      uring_close();
+      return 1;
+    }
+    submitted += rv;
+  }
+  return reap_batch(ios, n);
+}
+
+int uring_rw(int fd, block_io_t *ios, int n, int write) {
+  int rv = 0;
+  for (int i = 0; i < n && rv == 0; i += ring_entries) {
+    int batch = n - i < ring_entries ? n - i : ring_entries;
+    rv = submit_batch(fd, ios + i, batch, write);
+  }
+  return rv;
+}
@@ -0,0 +1,137 @@
+/**
+ * @file dcache.c
+ *
+ * Implementation of the directory entry and path caches.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "directory.h"
+
+#define DENTRY_SLOTS 4096  // entries in the (parent, name) table
+#define PATH_SLOTS 4096    // entries in the full path table
+#define PATH_CACHE_MAX 256 // longest path worth caching
+
+typedef struct dentry {
+  long gen; // generation the entry was cached in
+  int parent;
+  int inum;
+  char name[DIR_NAME_LENGTH];
+} dentry_t;
+
+typedef struct pentry {
+  long gen; // generation the entry was cached in
+  int inum;
+  int len; // length of path (not NUL-terminated)
+  char path[PATH_CACHE_MAX];
+} pentry_t;
+
+static dentry_t dentries[DENTRY_SLOTS];
+static pentry_t pentries[PATH_SLOTS];
+static long dentry_gen = 1; // entries from older generations are stale
+static long path_gen = 1;
+static dcache_stats_t stats;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER; // guards all of the above
+
+// Hash len bytes (32-bit FNV-1a), starting from the given seed.
+static uint32_t hash_bytes(uint32_t hash, const char *data, int len) {
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t) data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static dentry_t *dentry_slot(int parent, const char *name) {
+  uint32_t hash = hash_bytes(2166136261u ^ (uint32_t) parent, name, strlen(name));
+  return &dentries[hash % DENTRY_SLOTS];
+}
+
+static pentry_t *path_slot(const char *path, int len) {
+  return &pentries[hash_bytes(2166136261u, path, len) % PATH_SLOTS];
+}
+
+int dcache_lookup(int parent, const char *name) {
+  dentry_t *de = dentry_slot(parent, name);
+  int inum = -1;
+  pthread_mutex_lock(&dcache_lock);
+  if (de->gen == dentry_gen && de->parent == parent && !strcmp(de->name, name)) {
+    stats.dentry_hits++;
+    inum = de->inum;
+  } else {
+    stats.dentry_misses++;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return inum;
+}
+
+void dcache_insert(int parent, const char *name, int inum) {
+  if (strlen(name) >= DIR_NAME_LENGTH) {
+    return;
+  }
+  dentry_t *de = dentry_slot(parent, name);
+  pthread_mutex_lock(&dcache_lock);
+  de->gen = dentry_gen;
+  de->parent = parent;
+  de->inum = inum;
+  strcpy(de->name, name);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_remove(int parent, const char *name) {
+  dentry_t *de = dentry_slot(parent, name);
+  pthread_mutex_lock(&dcache_lock);
+  if (de->parent == parent && !strcmp(de->name, name)) {
+    de->gen = 0;
+  }
+  path_gen++;
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_flush() {
+  pthread_mutex_lock(&dcache_lock);
+  dentry_gen++;
+  path_gen++;
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+int dcache_path_lookup(const char *path, int len) {
+  pentry_t *pe = path_slot(path, len);
+  int inum = -1;
+  pthread_mutex_lock(&dcache_lock);
+  if (pe->gen == path_gen && pe->len == len && !memcmp(pe->path, path, len)) {
+    stats.path_hits++;
+    inum = pe->inum;
+  } else {
+    stats.path_misses++;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return inum;
+}
+
+long dcache_path_gen() {
+  pthread_mutex_lock(&dcache_lock);
+  long gen = path_gen;
+  pthread_mutex_unlock(&dcache_lock);
+  return gen;
+}
+
+void dcache_path_insert(const char *path, int len, int inum, long gen) {
+  if (len > PATH_CACHE_MAX) {
+    return;
+  }
+  pentry_t *pe = path_slot(path, len);
+  pthread_mutex_lock(&dcache_lock);
+  pe->gen = gen;
+  pe->inum = inum;
+  pe->len = len;
+  memcpy(pe->path, path, len);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_get_stats(dcache_stats_t *out) {
+  pthread_mutex_lock(&dcache_lock);
+  *out = stats;
+  pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,97 @@
+/**
+ * @file dcache.h
+ *
+ * An in-memory cache of directory entries for path resolution.
+ *
+ * Two direct-mapped tables: one keyed on (parent inum, name), one keyed on
+ * the full path. Only positive results are cached. Removing a name bumps a
+ * generation counter that invalidates every cached path at once, since any
+ * of them may have passed through the removed name.
+ *
+ * All functions are safe to call from several threads. Callers insert a
+ * (parent, name) entry while holding the parent directory's lock, so a
+ * concurrent remove cannot be undone by a stale insert.
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+typedef struct dcache_stats {
+  long dentry_hits;   // (parent, name) lookups answered by the cache
+  long dentry_misses; // (parent, name) lookups that went to the directory
+  long path_hits;     // full paths answered by the cache
+  long path_misses;   // full paths resolved component by component
+} dcache_stats_t;
+
+/**
+ * Look up a name in a directory.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ *
+ * @return The cached inode number, or -1 on a miss.
+ */
+int dcache_lookup(int parent, const char *name);
+
+/**
+ * Remember that a directory entry exists.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ * @param inum Inode number the entry refers to.
+ */
+void dcache_insert(int parent, const char *name, int inum);
+
+/**
+ * Forget a directory entry, and every cached path.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ */
+void dcache_remove(int parent, const char *name);
+
+/**
+ * Forget every cached entry and path.
+ *
+ * Used when a directory goes away, since its inode number may be reused by
+ * a new directory before its old entries age out.
+ */
+void dcache_flush();
+
+/**
+ * Look up a full path.
+ *
+ * @param path Absolute path (need not be NUL-terminated).
+ * @param len Length of the path.
+ *
+ * @return The cached inode number, or -1 on a miss.
+ */
+int dcache_path_lookup(const char *path, int len);
+
+/**
+ * Get the current path generation.
+ *
+ * Taken before resolving a path and handed to dcache_path_insert, so that
+ * a result computed across a concurrent remove is cached as already stale.
+ *
+ * @return The current path generation.
+ */
+long dcache_path_gen();
+
+/**
+ * Remember the inode number a full path resolves to.
+ *
+ * @param path Absolute path (need not be NUL-terminated).
+ * @param len Length of the path.
+ * @param inum Inode number the path resolves to.
+ * @param gen Path generation from before the path was resolved.
+ */
+void dcache_path_insert(const char *path, int len, int inum, long gen);
+
+/**
+ * Copy out the hit and miss counters.
+ *
+ * @param stats Where to store the counters.
+ */
+void dcache_get_stats(dcache_stats_t *stats);
+
+#endif
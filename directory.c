@@ -1,17 +1,286 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 
+#include "dcache.h"
 #include "directory.h"
 #include "bitmap.h"
 #include "inode.h"
+#include "journal.h"
+#include "path.h"
 #include "slist.h"
+#include "stats.h"
 
 // Initializes the root directory.
 void directory_init()
 {
-    inode_t* root_node = get_inode(alloc_inode());
-    root_node->mode = 040755; // Set permissions to root node.
+    alloc_inode(040755); // The first inode allocated is the root.
+}
+
+// Hashes a name (32-bit FNV-1a).
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* p = name; *p; p++)
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    return hash;
+}
+
+// Reverses the bits of a hash, so that the low bits which pick its bucket
+// come first.
+static uint32_t bit_reverse(uint32_t x)
+{
+    x = (x >> 1 & 0x55555555u) | (x & 0x55555555u) << 1; // Swap neighbouring bits,
+    x = (x >> 2 & 0x33333333u) | (x & 0x33333333u) << 2; // then pairs, and so on.
+    x = (x >> 4 & 0x0f0f0f0fu) | (x & 0x0f0f0f0fu) << 4;
+    x = (x >> 8 & 0x00ff00ffu) | (x & 0x00ff00ffu) << 8;
+    return x >> 16 | x << 16;
+}
+
+// Gets the position of an entry in a listing: its reversed hash, then its
+// number among the names with the same hash.
+static off_t dir_cookie(const dirent_t* entry)
+{
+    return (off_t)bit_reverse(entry->hash) << 16 | entry->seq;
+}
+
+// Gets a directory block by its logical block number.
+static void* dir_block(inode_t* dd, int lblk)
+{
+    return blocks_get_block(inode_get_pnum(dd, lblk));
+}
+
+// Gets a directory block that is about to change, recording it in the journal.
+static void* dir_block_mut(inode_t* dd, int lblk)
+{
+    void* block = dir_block(dd, lblk);
+    journal_dirty(blocks_bnum(block));
+    return block;
+}
+
+// Drops the reference a directory entry held on its inode.
+static void dir_release_inode(int inum)
+{
+    inode_t* node = get_inode(inum); // Decrease the inode's reference count.
+    inode_dirty(node);
+    node->refs--;
+    if (node->refs <= 0 && !inode_is_open(inum)) // Open files are freed on their last close.
+        free_inode(inum);
+}
+
+// Maps a name hash to its bucket in a hashed directory.
+static int dir_bucket(dirhash_t* hdr, uint32_t hash)
+{
+    uint32_t bucket = hash & ((1u << hdr->level) - 1);
+    if (bucket < hdr->split) // Already split this round, use the next level.
+        bucket = hash & ((1u << (hdr->level + 1)) - 1);
+    return bucket;
+}
+
+// Gets the number of low hash bits that pick a bucket of a hashed directory.
+static int dir_bucket_bits(dirhash_t* hdr, int bucket)
+{
+    return bucket < hdr->split || bucket >= (1 << hdr->level) ? hdr->level + 1 : hdr->level;
+}
+
+// Appends a zeroed block to a hashed directory, returning its logical number.
+static int dir_add_block(inode_t* dd)
+{
+    dirhash_t* hdr = dir_block_mut(dd, 0);
+    int lblk = hdr->nblocks;
+    if (inode_alloc_blocks(dd, lblk, lblk + 1) < 0)
+        return -ENOSPC;
+    grow_inode(dd, (lblk + 1) * BLOCK_SIZE);
+    memset(dir_block_mut(dd, lblk), 0, BLOCK_SIZE);
+    hdr->nblocks++;
+    return lblk;
+}
+
+// Finds an entry in a hashed directory, along with the block holding it,
+// counting the entries it compares in *scanned if that is not NULL.
+static dirent_t* dir_hashed_find(inode_t* dd, const char* name, uint32_t hash, dirbucket_t** owner,
+                                 int* scanned)
+{
+    dirhash_t* hdr = dir_block(dd, 0);
+    int lblk = hdr->buckets[dir_bucket(hdr, hash)];
+    while (lblk) // Walk the bucket and its overflow chain.
+    {
+        dirent_t* ents = dir_block(dd, lblk);
+        dirbucket_t* bucket = (dirbucket_t*)ents;
+        for (int ii = 1; bucket->count > 0 && ii <= DIR_BUCKET_ENTRIES; ii++)
+        {
+            if (!ents[ii].name[0])
+                continue;
+            if (scanned)
+                (*scanned)++;
+            if (ents[ii].hash == hash && !strcmp(ents[ii].name, name))
+            {
+                *owner = bucket;
+                return &ents[ii];
+            }
+        }
+        lblk = bucket->next;
+    }
+    return NULL;
+}
+
+// Stores an entry in a bucket's chain, adding an overflow block if it is full.
+static int dir_bucket_insert(inode_t* dd, int bucket, const dirent_t* entry)
+{
+    dirhash_t* hdr = dir_block(dd, 0);
+    int lblk = hdr->buckets[bucket];
+    for (;;)
+    {
+        dirent_t* ents = dir_block(dd, lblk);
+        dirbucket_t* blk = (dirbucket_t*)ents;
+        if (blk->count < DIR_BUCKET_ENTRIES) // Room here, take the first free slot.
+        {
+            int ii = 1;
+            while (ents[ii].name[0])
+                ii++;
+            journal_dirty(blocks_bnum(ents));
+            ents[ii] = *entry;
+            blk->count++;
+            return 0;
+        }
+        if (!blk->next)
+        {
+            int next = dir_add_block(dd);
+            if (next < 0)
+                return next;
+            journal_dirty(blocks_bnum(blk));
+            blk->next = next;
+        }
+        lblk = blk->next;
+    }
+}
+
+// Splits the next bucket in linear-hashing order, growing the table by one.
+static void dir_split(inode_t* dd)
+{
+    dirhash_t* hdr = dir_block_mut(dd, 0);
+    int old = hdr->split;
+    int grown = old + (1 << hdr->level);
+    uint32_t mask = (1u << (hdr->level + 1)) - 1;
+
+    // Reserve every block the new bucket needs up front, so moving entries
+    // into it cannot fail halfway.
+    int moving = 0;
+    for (int lblk = hdr->buckets[old]; lblk; lblk = ((dirbucket_t*)dir_block(dd, lblk))->next)
+    {
+        dirent_t* ents = dir_block(dd, lblk);
+        for (int ii = 1; ii <= DIR_BUCKET_ENTRIES; ii++)
+            if (ents[ii].name[0] && (ents[ii].hash & mask) != old)
+                moving++;
+    }
+    int first = dir_add_block(dd);
+    if (first < 0)
+        return; // Stay overloaded; lookups still work.
+    int last = first;
+    for (int need = moving - DIR_BUCKET_ENTRIES; need > 0; need -= DIR_BUCKET_ENTRIES)
+    {
+        int next = dir_add_block(dd);
+        if (next < 0)
+            return; // The blocks added so far are empty and unreferenced.
+        ((dirbucket_t*)dir_block_mut(dd, last))->next = next;
+        last = next;
+    }
+
+    hdr->buckets[grown] = first;
+    hdr->split++;
+    if (hdr->split == (1 << hdr->level)) // Finished a round of splits.
+    {
+        hdr->level++;
+        hdr->split = 0;
+    }
+
+    // Move the entries that now hash to the new bucket.
+    for (int lblk = hdr->buckets[old]; lblk; lblk = ((dirbucket_t*)dir_block(dd, lblk))->next)
+    {
+        dirent_t* ents = dir_block_mut(dd, lblk);
+        dirbucket_t* blk = (dirbucket_t*)ents;
+        for (int ii = 1; ii <= DIR_BUCKET_ENTRIES; ii++)
+            if (ents[ii].name[0] && (ents[ii].hash & mask) != old)
+            {
+                dir_bucket_insert(dd, grown, &ents[ii]);
+                memset(&ents[ii], 0, sizeof(dirent_t));
+                blk->count--;
+            }
+    }
+}
+
+// Adds an entry to a hashed directory, splitting a bucket if it is too full.
+static int dir_hashed_put(inode_t* dd, const dirent_t* entry)
+{
+    dirhash_t* hdr = dir_block_mut(dd, 0);
+    int rv = dir_bucket_insert(dd, dir_bucket(hdr, entry->hash), entry);
+    if (rv < 0)
+        return rv;
+    hdr->entries++;
+
+    // Keep buckets at most three quarters full on average.
+    int buckets = (1 << hdr->level) + hdr->split;
+    if (hdr->entries * 4 > buckets * DIR_BUCKET_ENTRIES * 3 && buckets < DIR_MAX_BUCKETS)
+        dir_split(dd);
+    return 0;
+}
+
+// Converts a full single-block directory to the hashed format.
+static int dir_make_hashed(inode_t* dd)
+{
+    int entriesCount = dd->size / sizeof(dirent_t);
+    dirent_t* entries = malloc(BLOCK_SIZE); // Save the linear entries.
+    memcpy(entries, dir_block(dd, 0), BLOCK_SIZE);
+
+    // Header plus two buckets, so the old entries fit without splitting.
+    if (inode_alloc_blocks(dd, 1, 3) < 0)
+    {
+        free(entries);
+        return -ENOSPC;
+    }
+    grow_inode(dd, 3 * BLOCK_SIZE);
+    dirhash_t* hdr = dir_block_mut(dd, 0);
+    memset(hdr, 0, BLOCK_SIZE);
+    memset(dir_block_mut(dd, 1), 0, BLOCK_SIZE);
+    memset(dir_block_mut(dd, 2), 0, BLOCK_SIZE);
+    hdr->level = 1;
+    hdr->nblocks = 3;
+    hdr->buckets[0] = 1;
+    hdr->buckets[1] = 2;
+    dd->flags |= INODE_DIR_HASHED;
+
+    for (int entryIndex = 0; entryIndex < entriesCount; entryIndex++)
+        dir_hashed_put(dd, &entries[entryIndex]);
+    free(entries);
+    return 0;
+}
+
+// Numbers a new name after the names already in a directory with the same
+// hash, so that each has a position of its own in a listing.
+static int dir_next_seq(inode_t* dd, uint32_t hash)
+{
+    int seq = 0;
+    if (!(dd->flags & INODE_DIR_HASHED))
+    {
+        dirent_t* dirs = dir_block(dd, 0);
+        int entriesCount = dd->size / sizeof(dirent_t);
+        for (int ii = 0; ii < entriesCount; ii++)
+            if (dirs[ii].hash == hash && dirs[ii].seq >= seq)
+                seq = dirs[ii].seq + 1;
+        return seq;
+    }
+
+    // Names with the same hash share a bucket.
+    dirhash_t* hdr = dir_block(dd, 0);
+    for (int lblk = hdr->buckets[dir_bucket(hdr, hash)]; lblk; lblk = ((dirbucket_t*)dir_block(dd, lblk))->next)
+    {
+        dirent_t* ents = dir_block(dd, lblk);
+        for (int ii = 1; ii <= DIR_BUCKET_ENTRIES; ii++)
+            if (ents[ii].name[0] && ents[ii].hash == hash && ents[ii].seq >= seq)
+                seq = ents[ii].seq + 1;
+    }
+    return seq;
 }
 
 // Looks up a directory entry by name.
@@ -19,60 +288,133 @@ int directory_lookup(inode_t *dd, const char *name)
 {
     if (!strcmp(name, "")) // If the name is empty, return 0.
         return 0;
-    dirent_t* dirs = blocks_get_block(dd->block); // Get the block of directories.
-    for (int ii = 0; ii < 64; ii++) // Loop through directory entries.
-        if (!strcmp(name, dirs[ii].name)) // If the name matches, return inode number.
+    uint32_t hash = name_hash(name);
+    if (dd->flags & INODE_DIR_HASHED) // Hashed: only search one bucket chain.
+    {
+        dirbucket_t* owner;
+        int scanned = 0;
+        dirent_t* entry = dir_hashed_find(dd, name, hash, &owner, &scanned);
+        stats_record(STATS_DIR_SCAN, scanned);
+        return entry ? entry->inum : -ENOENT;
+    }
+
+    dirent_t* dirs = dir_block(dd, 0); // Get the block of directories.
+    int entriesCount = dd->size / sizeof(dirent_t); // Only live entries, not stale slots.
+    for (int ii = 0; ii < entriesCount; ii++) // Loop through directory entries.
+        if (dirs[ii].hash == hash && !strcmp(name, dirs[ii].name)) // If the name matches, return inode number.
+        {
+            stats_record(STATS_DIR_SCAN, ii + 1);
             return dirs[ii].inum;
+        }
+    stats_record(STATS_DIR_SCAN, entriesCount);
     return -ENOENT; // If not found, return an error.
 }
 
 // Looks up a file or directory in the tree structure.
 int tree_lookup(const char *path)
 {
-    slist_t* path_slist = slist_explode(path, '/'); // Break the path into parts.
-    slist_t* pt_slist = path_slist; // Temp variable for iteration.
-    int inum = 0;
-    while (pt_slist) // Loop through the path segments.
+    return tree_lookup_span(path, strlen(path));
+}
+
+// Looks up the first len characters of a path, without allocating.
+int tree_lookup_span(const char *path, int len)
+{
+    int cached = dcache_path_lookup(path, len); // Whole path seen before?
+    if (cached >= 0)
+    {
+        stats_count(STATS_PATH_CACHE_HITS, 1);
+        return cached;
+    }
+    long gen = dcache_path_gen(); // Results are stale if a name goes away meanwhile.
+
+    path_iter_t it;
+    path_iter_init(&it, path, len);
+    int inum = 0; // Start at the root.
+    int depth = 0;
+    while (path_next(&it)) // Loop through the path components.
     {
-        inum = directory_lookup(get_inode(inum), pt_slist->data); // Look up each segment.
-        if (inum < 0) // If lookup fails, clean up and return error.
+        depth++;
+        if (it.len >= DIR_NAME_LENGTH) // Too long to be in any directory.
+            return -ENOENT;
+        char name[DIR_NAME_LENGTH];
+        memcpy(name, it.name, it.len);
+        name[it.len] = '\0';
+
+        int parent = inum;
+        inum = dcache_lookup(parent, name); // Try the dentry cache first.
+        if (inum < 0)
         {
-            slist_free(path_slist);
-            return -ENOENT; 
+            inode_read_lock(parent); // Hold the directory still while reading it.
+            inum = directory_lookup(get_inode(parent), name); // Look up each component.
+            if (inum >= 0)
+                dcache_insert(parent, name, inum);
+            inode_unlock(parent);
+            if (inum < 0) // If lookup fails, return error.
+                return -ENOENT;
         }
-        pt_slist = pt_slist->next; // Move to the next segment.
     }
-    slist_free(path_slist); // Free the path list.
 
+    dcache_path_insert(path, len, inum, gen);
+    stats_record(STATS_LOOKUP_DEPTH, depth);
     return inum; // Return the inode number.
 }
 
 // Adds a new entry to a directory.
 int directory_put(inode_t *dd, const char *name, int inum)
 {
-    dirent_t newEntry; // Create a new directory entry.
+    if (strlen(name) >= DIR_NAME_LENGTH) // Names must fit with their terminator.
+        return -ENAMETOOLONG;
+    dirent_t newEntry = {0}; // Create a new directory entry.
     strncpy(newEntry.name, name, DIR_NAME_LENGTH); // Set the name of the directory.
     newEntry.inum = inum; // Set the inode number.
+    newEntry.hash = name_hash(name);
+    newEntry.seq = dir_next_seq(dd, newEntry.hash);
+
     int existingEntriesCount = dd->size / sizeof(dirent_t); // Calculate number of existing directories.
-    dirent_t* dirs = blocks_get_block(dd->block); // Get the block of directories.
-    dirs[existingEntriesCount] = newEntry; // Add the new directory to the end.
-    dd->size += sizeof(dirent_t); // Increase the size of the directory.
-    return 0; // Return success.
+    if (!(dd->flags & INODE_DIR_HASHED) && existingEntriesCount < DIR_LINEAR_MAX)
+    {
+        dirent_t* dirs = dir_block_mut(dd, 0); // Get the block of directories.
+        inode_dirty(dd);
+        dirs[existingEntriesCount] = newEntry; // Add the new directory to the end.
+        dd->size += sizeof(dirent_t); // Increase the size of the directory.
+        return 0; // Return success.
+    }
+
+    if (!(dd->flags & INODE_DIR_HASHED)) // The single block is full, switch formats.
+    {
+        int rv = dir_make_hashed(dd);
+        if (rv < 0)
+            return rv;
+    }
+    return dir_hashed_put(dd, &newEntry);
 }
 
 // Deletes an entry from a directory.
 int directory_delete(inode_t *dd, const char *name)
 {
+    if (dd->flags & INODE_DIR_HASHED) // Hashed: clear the slot in place.
+    {
+        dirbucket_t* owner;
+        dirent_t* entry = dir_hashed_find(dd, name, name_hash(name), &owner, NULL);
+        if (!entry)
+            return -ENOENT;
+        int inum = entry->inum;
+        journal_dirty(blocks_bnum(entry)); // The entry and its block's header.
+        memset(entry, 0, sizeof(dirent_t));
+        owner->count--;
+        ((dirhash_t*)dir_block_mut(dd, 0))->entries--;
+        dir_release_inode(inum);
+        return 0;
+    }
+
     int entriesCount = dd->size / sizeof(dirent_t); // Calculate number of directories.
-    dirent_t* dirs = blocks_get_block(dd->block); // Get the block of directories.
+    dirent_t* dirs = dir_block(dd, 0); // Get the block of directories.
     for (int entryIndex = 0; entryIndex < entriesCount; entryIndex++) // Loop through directories.
         if (!strcmp(dirs[entryIndex].name, name)) // If the name matches.
         {
-            // Decrease the inode's reference count.
-            inode_t* node = get_inode(dirs[entryIndex].inum);
-            node->refs--;
-            if (node->refs <= 0) // If no more references, free the inode.
-                free_inode(dirs[entryIndex].inum);
+            journal_dirty(blocks_bnum(dirs));
+            inode_dirty(dd);
+            dir_release_inode(dirs[entryIndex].inum);
             // Shift remaining directory entries.
             for (int shiftIndex = entryIndex; shiftIndex < entriesCount - 1; shiftIndex++)
                 dirs[shiftIndex] = dirs[shiftIndex + 1];
@@ -82,29 +424,97 @@ int directory_delete(inode_t *dd, const char *name)
     return -ENOENT; // If not found, return an error.
 }
 
+// Finds the entry with the lowest position at or after pos among count
+// entries, or NULL if there is none.
+static dirent_t* dir_first_from(dirent_t* ents, int count, off_t pos)
+{
+    dirent_t* first = NULL;
+    off_t firstCookie = 0;
+    for (int ii = 0; ii < count; ii++)
+    {
+        if (!ents[ii].name[0])
+            continue;
+        off_t cookie = dir_cookie(&ents[ii]);
+        if (cookie >= pos && (!first || cookie < firstCookie))
+        {
+            first = &ents[ii];
+            firstCookie = cookie;
+        }
+    }
+    return first;
+}
+
+// Returns the next live entry of a directory, or NULL at the end.
+// pos starts at 0 and is advanced past the returned entry. Entries come in
+// the order of dir_cookie, which neither deletes nor splits change, so a
+// listing resumed from pos returns every entry it has not yet returned that
+// is still there, and none twice.
+dirent_t *directory_next(inode_t *dd, off_t *pos)
+{
+    if (!(dd->flags & INODE_DIR_HASHED)) // Linear: one block to search.
+    {
+        dirent_t* next = dir_first_from(dir_block(dd, 0), dd->size / sizeof(dirent_t), *pos);
+        if (next)
+            *pos = dir_cookie(next) + 1;
+        return next;
+    }
+
+    // Hashed: the bucket holding pos covers a run of positions; search it,
+    // then the bucket covering the run after it, and so on.
+    dirhash_t* hdr = dir_block(dd, 0);
+    dirent_t* next = NULL;
+    while (!next && *pos < (off_t)1 << 48)
+    {
+        uint32_t key = *pos >> 16;
+        int bucket = dir_bucket(hdr, bit_reverse(key));
+        for (int lblk = hdr->buckets[bucket]; lblk; lblk = ((dirbucket_t*)dir_block(dd, lblk))->next)
+        {
+            dirent_t* ents = dir_block(dd, lblk);
+            if (((dirbucket_t*)ents)->count == 0) // Skip empty blocks.
+                continue;
+            dirent_t* found = dir_first_from(ents + 1, DIR_BUCKET_ENTRIES, *pos);
+            if (found && (!next || dir_cookie(found) < dir_cookie(next)))
+                next = found;
+        }
+        if (!next) // Move on to where the next bucket's run starts.
+        {
+            int shift = 32 - dir_bucket_bits(hdr, bucket);
+            *pos = (off_t)(((uint64_t)(key >> shift) + 1) << shift) << 16;
+        }
+    }
+    if (next)
+        *pos = dir_cookie(next) + 1;
+    return next;
+}
+
 // Lists all entries in a directory.
 slist_t *directory_list(const char *path)
 {
     int inum = tree_lookup(path); // Look up the inode number for the path.
+    if (inum < 0)
+        return NULL;
     inode_t* node = get_inode(inum); // Get the inode.
-    int entriesCount = node->size / sizeof(dirent_t); // Calculate number of directories.
-    dirent_t* dirs = blocks_get_block(node->block); // Get the block of directories.
 
     slist_t* ret = NULL; // Initialize return list.
-    for (int entryIndex = 0; entryIndex < entriesCount; entryIndex++) // Loop through directories.
-        ret = slist_cons(dirs[entryIndex].name, ret); // Add each directory name to the list.
+    off_t pos = 0;
+    dirent_t* entry;
+    inode_read_lock(inum);
+    while ((entry = directory_next(node, &pos))) // Loop through directories.
+        ret = slist_cons(entry->name, ret); // Add each directory name to the list.
+    inode_unlock(inum);
     return ret; // Return the list of directory names.
 }
 
 // Prints the contents of a directory.
 void print_directory(inode_t *dd)
 {
-    int entriesCount = dd->size / sizeof(dirent_t); // Calculate number of directories.
-    dirent_t* dirs = blocks_get_block(dd->block); // Get the block of directories.
-    for (int entryIndex = 0; entryIndex < entriesCount; entryIndex++) // Loop through directories.
+    off_t pos = 0;
+    int entryIndex = 0;
+    dirent_t* entry;
+    while ((entry = directory_next(dd, &pos))) // Loop through directories.
     {
-        printf("Dir %d:\n", entryIndex); // Print directory index.
-        printf("Name: %s\n", dirs[entryIndex].name); // Print directory name.
-        printf("Inum: %d\n", dirs[entryIndex].inum); // Print inode number.
+        printf("Dir %d:\n", entryIndex++); // Print directory index.
+        printf("Name: %s\n", entry->name); // Print directory name.
+        printf("Inum: %d\n", entry->inum); // Print inode number.
     }
 }
@@ -1,6 +1,16 @@
 // Directory manipulation functions.
 //
 // Feel free to use as inspiration. Provided as-is.
+//
+// Small directories are a single block of packed entries searched linearly.
+// Once that block fills up, the directory switches to a hashed format: block
+// 0 becomes a header holding a linear-hashing bucket table, and every other
+// block is a bucket (or an overflow block chained off one) of entries.
+//
+// Either way, directory_next lists entries in the order of their hashes with
+// the bits reversed. Each bucket then holds one run of that order, which a
+// split cuts in two, so a position in a listing stays valid however the
+// directory changes.
 
 // Based on cs3650 starter code
 #ifndef DIRECTORY_H
@@ -8,6 +18,9 @@
 
 #define DIR_NAME_LENGTH 48
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
@@ -15,15 +28,42 @@
 typedef struct my_dirent {
   char name[DIR_NAME_LENGTH];
   int inum;
-  char _reserved[12];
+  uint32_t hash; // hash of name, checked before comparing names
+  uint16_t seq;  // tells apart names with the same hash (see directory_next)
+  char _reserved[6];
 } dirent_t;
 
+#define DIR_LINEAR_MAX 64 // entries in a single-block linear directory
+#define DIR_BUCKET_ENTRIES 63 // entries per bucket block (slot 0 is the header)
+#define DIR_MAX_BUCKETS 1016 // buckets that fit in the header block
+
+// First slot of every bucket and overflow block in a hashed directory.
+typedef struct dirbucket {
+  int count; // live entries in this block
+  int next;  // logical block of the next overflow block (0 = none)
+  char _reserved[56];
+} dirbucket_t;
+
+// Block 0 of a hashed directory.
+typedef struct dirhash {
+  int level;   // the table has (1 << level) + split buckets
+  int split;   // next bucket to split
+  int entries; // live entries in the directory
+  int nblocks; // blocks used by the directory, including this one
+  int buckets[DIR_MAX_BUCKETS]; // logical block of each bucket
+} dirhash_t;
+
+// Callers of directory_lookup and directory_next hold the directory's inode
+// lock for reading, and callers of directory_put and directory_delete hold it
+// for writing (see inode.h); directory_list and tree_lookup lock for themselves.
 void directory_init();
 int directory_lookup(inode_t *dd, const char *name);
 int directory_put(inode_t *dd, const char *name, int inum);
 int directory_delete(inode_t *dd, const char *name);
+dirent_t *directory_next(inode_t *dd, off_t *pos);
 slist_t *directory_list(const char *path);
 void print_directory(inode_t *dd);
 int tree_lookup(const char *path);
+int tree_lookup_span(const char *path, int len);
 
 #endif
@@ -0,0 +1,240 @@
+/**
+ * @file directory_test.c
+ *
+ * Checks directories through the storage layer as they grow past the 64
+ * entries of a linear directory into the hashed format and split their
+ * buckets: every name must still look up to its own inode and be listed
+ * exactly once, through renames, through unlinking most of the entries and
+ * adding them back, and after the image is mounted again. Also checks that
+ * a directory cannot be moved into its own subtree, and that a listing
+ * resumed from its position survives unlinks and splits meanwhile.
+ *
+ * Build with the storage sources:
+ *   gcc -g -pthread -o directory_test directory_test.c $(SRCS) -lm
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "slist.h"
+#include "storage.h"
+
+#define TEST_NAME "directory_test.img"
+#define ENTRIES 2000 // enough for several rounds of bucket splits
+
+static int failures = 0;
+static int inums[ENTRIES]; // inode of each entry, -1 while it is unlinked
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: " __VA_ARGS__);                                            \
+      putchar('\n');                                                           \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void entry_path(char *path, size_t len, int i) {
+  snprintf(path, len, "/d/entry-%d", i);
+}
+
+static inode_t *dir_inode() {
+  int inum = tree_lookup("/d");
+  return inum >= 0 ? get_inode(inum) : 0;
+}
+
+// Check that the entries named in inums, and only they, are in /d.
+static void check_entries(const char *when) {
+  static char listed[ENTRIES];
+  char path[64];
+  int live = 0;
+  for (int i = 0; i < ENTRIES; i++) {
+    entry_path(path, sizeof(path), i);
+    int inum = tree_lookup(path);
+    if (inums[i] >= 0) {
+      CHECK(inum == inums[i], "%s: %s looks up to %d, not inode %d", when, path, inum, inums[i]);
+      live++;
+    } else {
+      CHECK(inum == -ENOENT, "%s: unlinked %s looks up to %d", when, path, inum);
+    }
+  }
+
+  memset(listed, 0, sizeof(listed));
+  int names = 0;
+  slist_t *list = storage_list("/d");
+  for (slist_t *item = list; item; item = item->next) {
+    int i;
+    if (sscanf(item->data, "entry-%d", &i) == 1 && i >= 0 && i < ENTRIES) {
+      CHECK(inums[i] >= 0, "%s: unlinked entry-%d is listed", when, i);
+      CHECK(!listed[i], "%s: entry-%d is listed twice", when, i);
+      listed[i] = 1;
+      names++;
+    }
+  }
+  slist_free(list);
+  CHECK(names == live, "%s: %d entries listed, not %d", when, names, live);
+}
+
+// A directory can move anywhere but into or below itself. The check follows
+// the parent pointers that renames keep up to date, so the tree is reshaped
+// first: /p/q/r becomes /r, and /p then moves below it.
+static void test_moves() {
+  CHECK(storage_mknod("/p", 040755) == 0, "cannot make /p");
+  CHECK(storage_mknod("/p/q", 040755) == 0, "cannot make /p/q");
+  CHECK(storage_mknod("/p/q/r", 040755) == 0, "cannot make /p/q/r");
+  int rv = storage_rename("/p", "/p/p");
+  CHECK(rv == -EINVAL, "moving /p into itself returned %d", rv);
+  rv = storage_rename("/p", "/p/q/r/p");
+  CHECK(rv == -EINVAL, "moving /p below itself returned %d", rv);
+  rv = storage_rename("/p/q", "/p/q/r/q");
+  CHECK(rv == -EINVAL, "moving /p/q below itself returned %d", rv);
+
+  CHECK(storage_rename("/p/q/r", "/r") == 0, "cannot move /p/q/r up to /r");
+  CHECK(storage_rename("/p", "/r/p") == 0, "cannot move /p below its old child /r");
+  rv = storage_rename("/r", "/r/p/q/r");
+  CHECK(rv == -EINVAL, "moving /r below itself, once it holds /p, returned %d", rv);
+  CHECK(tree_lookup("/r/p/q") >= 0 && tree_lookup("/p") == -ENOENT, "/p/q is not at /r/p/q");
+
+  rv = storage_link_at(tree_lookup("/r/p"), 0, "p-link");
+  CHECK(rv == -EPERM, "a second link to directory /r/p returned %d", rv);
+}
+
+// A listing resumed from where it stopped, as readdir resumes from an offset,
+// must return every entry that stays in the directory exactly once and none
+// unlinked before it got to them, while entries are unlinked from both
+// sides of its position and added until the directory turns hashed and
+// splits its buckets.
+#define LISTED 1500
+
+static int list_some(int inum, off_t *pos, int n, int *seen) {
+  dirent_t *entry = 0;
+  inode_read_lock(inum);
+  while (n-- > 0 && (entry = directory_next(get_inode(inum), pos))) {
+    int i;
+    if (sscanf(entry->name, "l-%d", &i) == 1 && i >= 0 && i < LISTED) {
+      seen[i]++;
+    }
+  }
+  inode_unlock(inum);
+  return entry != 0;
+}
+
+static void test_listing() {
+  static int seen[LISTED], early[LISTED];
+  static int gone[LISTED]; // 1 if unlinked after it was listed, 2 if before
+  char path[64];
+  CHECK(storage_mknod("/l", 040755) == 0, "cannot make /l");
+  int inum = tree_lookup("/l");
+  int made = 0;
+  for (; made < 40; made++) {
+    snprintf(path, sizeof(path), "/l/l-%d", made);
+    CHECK(storage_mknod(path, 0100644) == 0, "cannot make %s", path);
+    early[made] = 1;
+  }
+
+  off_t pos = 0;
+  int more = 1;
+  for (int round = 0; more; round++) {
+    more = list_some(inum, &pos, 10, seen);
+    // unlink one entry already listed and one not listed yet
+    for (int i = 0, done = 0; i < made && done < 2; i++) {
+      if (!gone[i] && (done == 0 ? seen[i] > 0 : seen[i] == 0)) {
+        snprintf(path, sizeof(path), "/l/l-%d", i);
+        CHECK(storage_unlink(path) == 0, "cannot unlink %s", path);
+        gone[i] = seen[i] > 0 ? 1 : 2;
+        done++;
+      }
+    }
+    for (int n = 0; n < 60 && made < LISTED; n++, made++) {
+      snprintf(path, sizeof(path), "/l/l-%d", made);
+      CHECK(storage_mknod(path, 0100644) == 0, "cannot make %s", path);
+    }
+    if (round == 0) {
+      CHECK(get_inode(inum)->flags & INODE_DIR_HASHED, "/l is not hashed after %d names", made);
+    }
+  }
+
+  for (int i = 0; i < LISTED; i++) {
+    CHECK(seen[i] <= 1, "l-%d was listed %d times", i, seen[i]);
+    CHECK(!early[i] || gone[i] || seen[i] == 1, "l-%d was there throughout but not listed", i);
+    CHECK(gone[i] != 2 || seen[i] == 0, "l-%d listed after it was unlinked", i);
+  }
+}
+
+int main(int argc, char **argv) {
+  char path[64], to[64];
+  setvbuf(stdout, 0, _IONBF, 0);
+  memset(inums, -1, sizeof(inums));
+  unlink(TEST_NAME);
+  if (storage_format(TEST_NAME, 4 << 20, 64 << 20, 4096, -1) != 0) {
+    return 1;
+  }
+  storage_init(TEST_NAME);
+  CHECK(storage_mknod("/d", 040755) == 0, "cannot make /d");
+
+  // a linear directory holds DIR_LINEAR_MAX entries; one more makes it hashed
+  for (int i = 0; i < ENTRIES; i++) {
+    entry_path(path, sizeof(path), i);
+    CHECK(storage_mknod(path, 0100644) == 0, "cannot make %s", path);
+    inums[i] = tree_lookup(path);
+    if (i == DIR_LINEAR_MAX - 1) {
+      CHECK(!(dir_inode()->flags & INODE_DIR_HASHED), "hashed at %d entries", i + 1);
+      check_entries("linear");
+    } else if (i == DIR_LINEAR_MAX) {
+      CHECK(dir_inode()->flags & INODE_DIR_HASHED, "not hashed at %d entries", i + 1);
+      check_entries("just hashed");
+    }
+  }
+
+  // the bucket table must have grown well past the two buckets it starts with
+  inode_t *dd = dir_inode();
+  dirhash_t *hdr = blocks_get_block(inode_get_pnum(dd, 0));
+  int buckets = (1 << hdr->level) + hdr->split;
+  CHECK(buckets > ENTRIES / DIR_BUCKET_ENTRIES, "only %d buckets for %d entries", buckets, ENTRIES);
+  CHECK(hdr->entries == ENTRIES, "the header counts %d entries, not %d", hdr->entries, ENTRIES);
+  check_entries("after splits");
+
+  // renames within the directory move entries between buckets
+  for (int i = 0; i < ENTRIES; i += 7) {
+    entry_path(path, sizeof(path), i);
+    snprintf(to, sizeof(to), "/d/renamed-%d", i);
+    CHECK(storage_rename(path, to) == 0, "cannot rename %s", path);
+    CHECK(storage_rename(to, path) == 0, "cannot rename %s back", to);
+  }
+  check_entries("after renames");
+
+  // unlink most entries, leaving chains with gaps, then add them back
+  for (int i = 0; i < ENTRIES; i++) {
+    if (i % 5 != 0) {
+      entry_path(path, sizeof(path), i);
+      CHECK(storage_unlink(path) == 0, "cannot unlink %s", path);
+      inums[i] = -1;
+    }
+  }
+  check_entries("after unlinking");
+  for (int i = 0; i < ENTRIES; i += 2) {
+    if (inums[i] < 0) {
+      entry_path(path, sizeof(path), i);
+      CHECK(storage_mknod(path, 0100644) == 0, "cannot make %s again", path);
+      inums[i] = tree_lookup(path);
+    }
+  }
+  check_entries("after adding back");
+  test_moves();
+  test_listing();
+
+  storage_shutdown();
+  storage_init(TEST_NAME);
+  check_entries("after remounting");
+  int rv = storage_rename("/r", "/r/p/x");
+  CHECK(rv == -EINVAL, "after remounting: moving /r below itself returned %d", rv);
+  storage_shutdown();
+
+  unlink(TEST_NAME);
+  printf("directory_test: %s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
@@ -0,0 +1,761 @@
+/**
+ * @file fs_bench.c
+ *
+ * Benchmark driver: mounts a fresh image with one of the front ends and runs
+ * a fixed matrix of workloads against it through ordinary system calls, then
+ * prints one JSON document with each workload's throughput, latency
+ * percentiles and CPU time, so runs on different commits can be compared.
+ *
+ * Usage: fs_bench [--fs=./nufs] [--mnt=bench_mnt] [--image=bench.nufs]
+ *                 [--scale=N] [--threads=N] [--label=TEXT] [--dir=PATH]
+ *                 [-- FS-OPTION...]
+ *
+ * Options after "--" (--backend=pread, --lazytime, ...) go to the front end.
+ * --dir runs the matrix in an existing directory instead of mounting
+ * anything, for a baseline on another filesystem. --scale multiplies the
+ * size of every workload. Offsets come from a fixed seed, so every run does
+ * the same requests in the same order.
+ *
+ * Each workload reports:
+ *   ops, bytes     - operations timed and bytes they moved
+ *   wall_s         - elapsed time
+ *   ops_per_s, mb_per_s
+ *   p50_us, p99_us - latency percentiles of one operation
+ *   fs_cpu_s       - CPU time (user + system) the front end used
+ *   client_cpu_s   - CPU time this driver used
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB (1024 * 1024)
+#define MAX_THREADS 64
+#define MAX_FS_OPTIONS 8
+#define DEEP_LEVELS 32
+#define SMALL_DIRS 16
+#define SMALL_FILE_SIZE 4096
+
+// what a run was asked to do
+static const char *fs_path = "./nufs";
+static const char *mnt = "bench_mnt";
+static const char *image = "bench.nufs";
+static const char *label = "";
+static const char *dir = 0; // --dir: where the workloads run
+static const char *fs_options[MAX_FS_OPTIONS];
+static int fs_option_count = 0;
+static int scale = 1;
+static int threads = 4;
+
+static pid_t fs_pid = -1; // the mounted front end
+static char root[4096];   // the directory the workloads run in
+static int results = 0;   // workloads printed so far
+
+// Latencies of one thread's operations, in seconds.
+typedef struct lat {
+  double *values;
+  long count;
+  long capacity;
+} lat_t;
+
+// A workload being measured.
+typedef struct run {
+  const char *name;
+  long ops;
+  long bytes;
+  lat_t lat;
+  double wall;       // start, then elapsed
+  double fs_cpu;     // likewise
+  double client_cpu; // likewise
+} run_t;
+
+static void unmount();
+
+static void die(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "fs_bench: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  va_end(ap);
+  unmount();
+  exit(1);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*: the same numbers on every run for a given seed
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void lat_add(lat_t *lat, double seconds) {
+  if (lat->count == lat->capacity) {
+    lat->capacity = lat->capacity ? lat->capacity * 2 : 4096;
+    lat->values = realloc(lat->values, lat->capacity * sizeof(double));
+    if (!lat->values) {
+      die("out of memory");
+    }
+  }
+  lat->values[lat->count++] = seconds;
+}
+
+static void lat_merge(lat_t *into, lat_t *from) {
+  for (long i = 0; i < from->count; i++) {
+    lat_add(into, from->values[i]);
+  }
+  free(from->values);
+  *from = (lat_t){0};
+}
+
+static int by_value(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// CPU time the front end has used, from /proc, or 0 if it is not ours.
+static double fs_cpu() {
+  if (fs_pid < 0) {
+    return 0;
+  }
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", fs_pid);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  buf[len] = 0;
+  // utime and stime are fields 14 and 15; the command name before them
+  // may hold spaces, so count from the ')' that ends it
+  char *p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) != 2) {
+    return 0;
+  }
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double client_cpu() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+         ru.ru_stime.tv_usec / 1e6;
+}
+
+static void begin(run_t *run, const char *name) {
+  *run = (run_t){.name = name};
+  fprintf(stderr, "fs_bench: %s\n", name);
+  sync();
+  run->fs_cpu = fs_cpu();
+  run->client_cpu = client_cpu();
+  run->wall = now();
+}
+
+// Stop the clock on a workload and print its results.
+static void end(run_t *run) {
+  run->wall = now() - run->wall;
+  run->fs_cpu = fs_cpu() - run->fs_cpu;
+  run->client_cpu = client_cpu() - run->client_cpu;
+
+  lat_t *lat = &run->lat;
+  qsort(lat->values, lat->count, sizeof(double), by_value);
+  double p50 = lat->count ? lat->values[(lat->count - 1) / 2] : 0;
+  double p99 = lat->count ? lat->values[(lat->count - 1) * 99 / 100] : 0;
+  printf("%s\n    {\"name\": \"%s\", \"ops\": %ld, \"bytes\": %ld, "
+         "\"wall_s\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f, "
+         "\"p50_us\": %.2f, \"p99_us\": %.2f, \"fs_cpu_s\": %.3f, "
+         "\"client_cpu_s\": %.3f}",
+         results++ ? "," : "", run->name, run->ops, run->bytes, run->wall,
+         run->ops / run->wall, run->bytes / run->wall / MB, p50 * 1e6, p99 * 1e6,
+         run->fs_cpu, run->client_cpu);
+  fflush(stdout);
+  free(lat->values);
+}
+
+// A path under the directory being benchmarked.
+static const char *at(char *buf, const char *fmt, ...) {
+  int len = snprintf(buf, 4096, "%s/", root);
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf + len, 4096 - len, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+static void make_dir(const char *path) {
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    die("mkdir %s", path);
+  }
+}
+
+// Mounting
+
+static int mounted() {
+  struct stat m, parent;
+  char up[4096];
+  snprintf(up, sizeof(up), "%s/..", mnt);
+  return stat(mnt, &m) == 0 && stat(up, &parent) == 0 && m.st_dev != parent.st_dev;
+}
+
+// Start the front end on a fresh image and wait until the kernel has it.
+static void mount_fs() {
+  make_dir(mnt);
+  if (mounted()) {
+    errno = EBUSY;
+    die("%s is already a mount point", mnt);
+  }
+  unlink(image);
+
+  const char *argv[MAX_FS_OPTIONS + 8];
+  int argc = 0;
+  argv[argc++] = fs_path;
+  for (int i = 0; i < fs_option_count; i++) {
+    argv[argc++] = fs_options[i];
+  }
+  argv[argc++] = "--size=256M"; // growing to 64 times that
+  argv[argc++] = "--inodes=131072";
+  argv[argc++] = "-f";
+  argv[argc++] = mnt;
+  argv[argc++] = image;
+  argv[argc] = 0;
+
+  fs_pid = fork();
+  if (fs_pid < 0) {
+    die("fork");
+  }
+  if (fs_pid == 0) {
+    dup2(2, 1); // keep its messages out of the JSON
+    execv(fs_path, (char **) argv);
+    perror(fs_path);
+    _exit(127);
+  }
+
+  for (int waited = 0; !mounted(); waited += 10) {
+    int status;
+    if (waitpid(fs_pid, &status, WNOHANG) == fs_pid) {
+      fs_pid = -1;
+      errno = ECHILD;
+      die("%s exited before mounting", fs_path);
+    }
+    if (waited > 10000) {
+      errno = ETIMEDOUT;
+      die("%s did not mount %s", fs_path, mnt);
+    }
+    usleep(10000);
+  }
+  if (!realpath(mnt, root)) {
+    die("%s", mnt);
+  }
+}
+
+// Unmount the front end, if there is one, and wait for it to exit.
+static void unmount() {
+  if (fs_pid < 0) {
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("fusermount", "fusermount", "-u", mnt, (char *) 0);
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    kill(fs_pid, SIGTERM);
+  }
+  waitpid(fs_pid, &status, 0);
+  fs_pid = -1;
+}
+
+// File workloads
+
+// Fill a file with size bytes written size bytes at a time.
+static void fill_file(const char *path, long size, int chunk) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    die("create %s", path);
+  }
+  char *buf = malloc(chunk);
+  memset(buf, 'n', chunk);
+  for (long off = 0; off < size; off += chunk) {
+    if (write(fd, buf, chunk) != chunk) {
+      die("write %s", path);
+    }
+  }
+  free(buf);
+  close(fd);
+}
+
+static void seq_write(const char *name, const char *path, long size, int chunk) {
+  run_t run;
+  char *buf = malloc(chunk);
+  memset(buf, 's', chunk);
+  unlink(path);
+  begin(&run, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    die("create %s", path);
+  }
+  for (long off = 0; off < size; off += chunk) {
+    double start = now();
+    if (write(fd, buf, chunk) != chunk) {
+      die("write %s", path);
+    }
+    lat_add(&run.lat, now() - start);
+    run.ops++;
+    run.bytes += chunk;
+  }
+  if (fsync(fd) != 0) {
+    die("fsync %s", path);
+  }
+  close(fd);
+  end(&run);
+  free(buf);
+}
+
+static void seq_read(const char *name, const char *path, int chunk) {
+  run_t run;
+  char *buf = malloc(chunk);
+  begin(&run, name);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    die("open %s", path);
+  }
+  for (;;) {
+    double start = now();
+    ssize_t got = read(fd, buf, chunk);
+    if (got < 0) {
+      die("read %s", path);
+    }
+    if (got == 0) {
+      break;
+    }
+    lat_add(&run.lat, now() - start);
+    run.ops++;
+    run.bytes += got;
+  }
+  close(fd);
+  end(&run);
+  free(buf);
+}
+
+// count reads or writes of chunk bytes at random chunk-aligned offsets in
+// the first size bytes of a file
+static void random_io(const char *path, long size, int chunk, long count,
+                      int writing, uint64_t seed, run_t *run, lat_t *lat) {
+  char *buf = malloc(chunk);
+  memset(buf, 'r', chunk);
+  int fd = open(path, writing ? O_WRONLY : O_RDONLY);
+  if (fd < 0) {
+    die("open %s", path);
+  }
+  long slots = size / chunk;
+  for (long i = 0; i < count; i++) {
+    off_t off = (off_t) (next_random(&seed) % slots) * chunk;
+    double start = now();
+    ssize_t done = writing ? pwrite(fd, buf, chunk, off) : pread(fd, buf, chunk, off);
+    if (done != chunk) {
+      die("%s %s", writing ? "pwrite" : "pread", path);
+    }
+    lat_add(lat, now() - start);
+  }
+  if (writing && fsync(fd) != 0) {
+    die("fsync %s", path);
+  }
+  close(fd);
+  free(buf);
+  __atomic_add_fetch(&run->ops, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&run->bytes, count * chunk, __ATOMIC_RELAXED);
+}
+
+static void rand_io(const char *name, const char *path, long size, int chunk,
+                    int writing) {
+  run_t run;
+  long count = size / 4 / chunk; // a quarter of the file's worth
+  begin(&run, name);
+  random_io(path, size, chunk, count, writing, 42, &run, &run.lat);
+  end(&run);
+}
+
+// Metadata workloads
+
+static void create_storm(run_t *run, const char *dirname, int count) {
+  char path[4096];
+  for (int i = 0; i < count; i++) {
+    at(path, "%s/f%06d", dirname, i);
+    double start = now();
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      die("create %s", path);
+    }
+    close(fd);
+    lat_add(&run->lat, now() - start);
+    run->ops++;
+  }
+}
+
+static void stat_storm(run_t *run, const char *dirname, int count) {
+  char path[4096];
+  struct stat st;
+  for (int i = 0; i < count; i++) {
+    at(path, "%s/f%06d", dirname, i);
+    double start = now();
+    if (stat(path, &st) != 0) {
+      die("stat %s", path);
+    }
+    lat_add(&run->lat, now() - start);
+    run->ops++;
+  }
+}
+
+static void unlink_storm(run_t *run, const char *dirname, int count) {
+  char path[4096];
+  for (int i = 0; i < count; i++) {
+    at(path, "%s/f%06d", dirname, i);
+    double start = now();
+    if (unlink(path) != 0) {
+      die("unlink %s", path);
+    }
+    lat_add(&run->lat, now() - start);
+    run->ops++;
+  }
+}
+
+static void storms() {
+  char path[4096];
+  int count = 5000 * scale;
+  make_dir(at(path, "storm"));
+  run_t run;
+  begin(&run, "create_storm");
+  create_storm(&run, "storm", count);
+  end(&run);
+  begin(&run, "stat_storm");
+  stat_storm(&run, "storm", count);
+  end(&run);
+  begin(&run, "unlink_storm");
+  unlink_storm(&run, "storm", count);
+  end(&run);
+}
+
+// stat a file DEEP_LEVELS directories down, over and over
+static void deep_lookup() {
+  char path[4096], name[4096];
+  int len = snprintf(path, sizeof(path), "%s", at(name, "deep"));
+  make_dir(path);
+  for (int i = 0; i < DEEP_LEVELS; i++) {
+    len += snprintf(path + len, sizeof(path) - len, "/level%02d", i);
+    make_dir(path);
+  }
+  snprintf(path + len, sizeof(path) - len, "/leaf");
+  fill_file(path, 0, 1);
+
+  run_t run;
+  struct stat st;
+  begin(&run, "deep_lookup");
+  for (int i = 0; i < 20000 * scale; i++) {
+    double start = now();
+    if (stat(path, &st) != 0) {
+      die("stat %s", path);
+    }
+    lat_add(&run.lat, now() - start);
+    run.ops++;
+  }
+  end(&run);
+}
+
+// list a big directory from start to end, several times
+static void big_readdir() {
+  char path[4096];
+  int count = 10000 * scale;
+  make_dir(at(path, "big"));
+  run_t setup = {0};
+  create_storm(&setup, "big", count);
+  free(setup.lat.values);
+
+  run_t run;
+  begin(&run, "big_readdir");
+  for (int i = 0; i < 10; i++) {
+    double start = now();
+    DIR *d = opendir(path);
+    if (!d) {
+      die("opendir %s", path);
+    }
+    int seen = 0;
+    while (readdir(d)) {
+      seen++;
+    }
+    closedir(d);
+    if (seen != count + 2) {
+      errno = EIO;
+      die("listed %d of %d entries in %s", seen, count + 2, path);
+    }
+    lat_add(&run.lat, now() - start);
+    run.ops++;
+  }
+  end(&run);
+}
+
+// many small files spread over a few directories, written then read whole
+static void small_files() {
+  char path[4096];
+  char buf[SMALL_FILE_SIZE];
+  int per_dir = 256 * scale;
+  memset(buf, 'f', sizeof(buf));
+  make_dir(at(path, "small"));
+  for (int d = 0; d < SMALL_DIRS; d++) {
+    make_dir(at(path, "small/d%02d", d));
+  }
+
+  run_t run;
+  begin(&run, "small_files_write");
+  for (int d = 0; d < SMALL_DIRS; d++) {
+    for (int i = 0; i < per_dir; i++) {
+      at(path, "small/d%02d/f%05d", d, i);
+      double start = now();
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+        die("write %s", path);
+      }
+      close(fd);
+      lat_add(&run.lat, now() - start);
+      run.ops++;
+      run.bytes += sizeof(buf);
+    }
+  }
+  end(&run);
+
+  begin(&run, "small_files_read");
+  for (int d = 0; d < SMALL_DIRS; d++) {
+    for (int i = 0; i < per_dir; i++) {
+      at(path, "small/d%02d/f%05d", d, i);
+      double start = now();
+      int fd = open(path, O_RDONLY);
+      if (fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+        die("read %s", path);
+      }
+      close(fd);
+      lat_add(&run.lat, now() - start);
+      run.ops++;
+      run.bytes += sizeof(buf);
+    }
+  }
+  end(&run);
+}
+
+// Multi-threaded workloads
+
+typedef struct worker {
+  pthread_t thread;
+  int id;
+  const char *kind;
+  run_t *run;
+  lat_t lat;
+} worker_t;
+
+#define MT_FILE_SIZE (16L * MB * scale)
+#define MT_OPS (5000L * scale)
+
+// Each thread's share of a multi-threaded workload:
+//   read  - random 4K reads of one shared file
+//   write - random 4K writes of a file of its own
+//   mix   - on files and a directory of its own, 70% random 4K reads,
+//           20% random 4K writes and 10% create, stat and unlink
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  char path[4096];
+  uint64_t seed = 1000 + w->id;
+  if (!strcmp(w->kind, "read")) {
+    random_io(at(path, "seq"), 64L * MB * scale, 4096, MT_OPS, 0, seed, w->run,
+              &w->lat);
+    return 0;
+  }
+  at(path, "mt/t%02d", w->id);
+  if (!strcmp(w->kind, "write")) {
+    random_io(path, MT_FILE_SIZE, 4096, MT_OPS, 1, seed, w->run, &w->lat);
+    return 0;
+  }
+
+  char buf[4096], name[4096];
+  memset(buf, 'm', sizeof(buf));
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    die("open %s", path);
+  }
+  long bytes = 0;
+  for (long i = 0; i < MT_OPS; i++) {
+    uint64_t r = next_random(&seed);
+    off_t off = (off_t) ((r >> 8) % (MT_FILE_SIZE / sizeof(buf))) * sizeof(buf);
+    double start = now();
+    if (r % 10 < 7) {
+      if (pread(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+        die("pread %s", path);
+      }
+      bytes += sizeof(buf);
+    } else if (r % 10 < 9) {
+      if (pwrite(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+        die("pwrite %s", path);
+      }
+      bytes += sizeof(buf);
+    } else {
+      struct stat st;
+      at(name, "mt/d%02d/f%ld", w->id, i);
+      int nfd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      if (nfd < 0 || close(nfd) != 0 || stat(name, &st) != 0 || unlink(name) != 0) {
+        die("create/stat/unlink %s", name);
+      }
+    }
+    lat_add(&w->lat, now() - start);
+  }
+  close(fd);
+  __atomic_add_fetch(&w->run->ops, MT_OPS, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&w->run->bytes, bytes, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void multi_threaded(const char *name, const char *kind) {
+  worker_t workers[MAX_THREADS];
+  run_t run;
+  begin(&run, name);
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (worker_t){.id = i, .kind = kind, .run = &run};
+    if (pthread_create(&workers[i].thread, 0, worker_main, &workers[i]) != 0) {
+      die("pthread_create");
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, 0);
+  }
+  double stop = now();
+  for (int i = 0; i < threads; i++) {
+    lat_merge(&run.lat, &workers[i].lat);
+  }
+  run.wall += now() - stop; // merging is not part of the workload
+  end(&run);
+}
+
+static void multi_threaded_all() {
+  char path[4096];
+  make_dir(at(path, "mt"));
+  for (int i = 0; i < threads; i++) {
+    fill_file(at(path, "mt/t%02d", i), MT_FILE_SIZE, MB);
+    make_dir(at(path, "mt/d%02d", i));
+  }
+  multi_threaded("mt_rand_read_4k", "read");
+  multi_threaded("mt_rand_write_4k", "write");
+  multi_threaded("mt_mix", "mix");
+}
+
+static void usage() {
+  fprintf(stderr, "usage: fs_bench [--fs=./nufs] [--mnt=bench_mnt] "
+                  "[--image=bench.nufs] [--scale=N] [--threads=N] "
+                  "[--label=TEXT] [--dir=PATH] [-- FS-OPTION...]\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  int i = 1;
+  for (; i < argc; i++) {
+    if (!strncmp(argv[i], "--fs=", 5)) {
+      fs_path = argv[i] + 5;
+    } else if (!strncmp(argv[i], "--mnt=", 6)) {
+      mnt = argv[i] + 6;
+    } else if (!strncmp(argv[i], "--image=", 8)) {
+      image = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--scale=", 8)) {
+      scale = atoi(argv[i] + 8);
+    } else if (!strncmp(argv[i], "--threads=", 10)) {
+      threads = atoi(argv[i] + 10);
+    } else if (!strncmp(argv[i], "--label=", 8)) {
+      label = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--dir=", 6)) {
+      dir = argv[i] + 6;
+    } else if (!strcmp(argv[i], "--")) {
+      i++;
+      break;
+    } else {
+      usage();
+    }
+  }
+  for (; i < argc; i++) {
+    if (fs_option_count == MAX_FS_OPTIONS) {
+      usage();
+    }
+    fs_options[fs_option_count++] = argv[i];
+  }
+  if (scale < 1 || threads < 1 || threads > MAX_THREADS) {
+    usage();
+  }
+
+  if (dir) {
+    if (!realpath(dir, root)) {
+      die("%s", dir);
+    }
+  } else {
+    mount_fs();
+  }
+
+  char date[32];
+  time_t t = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+  printf("{\n  \"label\": \"%s\",\n  \"fs\": \"%s\",\n  \"options\": [", label,
+         dir ? dir : fs_path);
+  for (int j = 0; j < fs_option_count; j++) {
+    printf("%s\"%s\"", j ? ", " : "", fs_options[j]);
+  }
+  printf("],\n  \"date\": \"%s\",\n  \"scale\": %d,\n  \"threads\": %d,\n"
+         "  \"results\": [",
+         date, scale, threads);
+
+  char path[4096];
+  long size = 64L * MB * scale;
+  static const struct {
+    const char *write, *read;
+    int chunk;
+  } seq[] = {
+      {"seq_write_4k", "seq_read_4k", 4096},
+      {"seq_write_64k", "seq_read_64k", 64 * 1024},
+      {"seq_write_1m", "seq_read_1m", MB},
+  };
+  for (int j = 0; j < 3; j++) {
+    seq_write(seq[j].write, at(path, "seq"), size, seq[j].chunk);
+    seq_read(seq[j].read, path, seq[j].chunk);
+  }
+  rand_io("rand_write_4k", path, size, 4096, 1);
+  rand_io("rand_read_4k", path, size, 4096, 0);
+  rand_io("rand_write_64k", path, size, 64 * 1024, 1);
+  rand_io("rand_read_64k", path, size, 64 * 1024, 0);
+  storms();
+  deep_lookup();
+  big_readdir();
+  small_files();
+  multi_threaded_all();
+  printf("\n  ]\n}\n");
+
+  unmount();
+  return 0;
+}
@@ -1,10 +1,55 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+static void inode_trim_blocks(inode_t* node, int keep);
+static int inode_insert_run(inode_t* node, int lblk, int pnum, int count);
+static inode_times_t* inode_take_times(int inum);
+
+// inodes pack evenly into the inode table blocks
+_Static_assert(sizeof(inode_t) == 256, "inode record is 256 bytes");
+
+static pthread_mutex_t inodeBitmapLock = PTHREAD_MUTEX_INITIALIZER; // guards the inode bitmap and cursor
+static pthread_rwlock_t* inodeLocks = 0; // one lock per inode in the table
+static int* inodeOpens = 0; // open file handles per inode, kept in memory only
+static inode_dirty_t** inodeDirty = 0; // unsynced writes per inode, NULL if none
+static inode_wbuf_t** inodeWbuf = 0; // buffered appends per inode, NULL if none
+static long wbufBytes = 0; // bytes buffered across all inodes
+static inode_times_t** inodeTimes = 0; // pending lazytime updates per inode, NULL if none
+static pthread_mutex_t timesLock = PTHREAD_MUTEX_INITIALIZER; // guards inodeTimes
+static int inodeLockCount = 0;
+
+// returns a pointer to the i-th extent of an inode's block map
+static extent_t* inode_extent(inode_t* node, int i)
+{
+    if (i < INODE_EXTENTS) // the first extents live in the inode itself
+        return &node->extents[i];
+
+    // the rest live in extent blocks listed by the indirect block
+    int perBlock = BLOCK_SIZE / sizeof(extent_t);
+    int* extentBlocks = blocks_get_block(node->indirect);
+    extent_t* overflow = blocks_get_block(extentBlocks[(i - INODE_EXTENTS) / perBlock]);
+    return &overflow[(i - INODE_EXTENTS) % perBlock];
+}
+
+// maximum number of extents an inode can map
+static int inode_max_extents()
+{
+    int perBlock = BLOCK_SIZE / sizeof(extent_t);
+    return INODE_EXTENTS + (BLOCK_SIZE / sizeof(int)) * perBlock;
+}
 
 // prints the details of an inode
 void print_inode(inode_t* node)
@@ -12,76 +57,479 @@ void print_inode(inode_t* node)
     printf("inode.refs = %d\n", node->refs); // print refrence count
     printf("inode.mode = %d\n", node->mode); // print mode
     printf("inode.size = %d\n", node->size); // print size
-    printf("inode.block = %d\n", node->block); // print starting block
-    int curr_block = node->block;
-    while (curr_block != block_list[curr_block]) { // loop through the block list
-        curr_block = block_list[curr_block];
-        printf("\tblock_list = %d\n", curr_block); // print each block in the list
+    printf("inode.indirect = %d\n", node->indirect); // print overflow extent index
+    printf("inode.flags = %d\n", node->flags); // print format flags
+    for (int i = 0; i < node->nextents; i++) { // loop through the extents
+        extent_t* ext = inode_extent(node, i);
+        printf("\textent = [%d, +%d) -> %d\n", ext->lblk, ext->len, ext->pblk); // print each run
     }
 
     // print access, modification, and change times
-    printf("inode.atime = %d\n", node->atime);
-    printf("inode.mtime = %d\n", node->mtime);
-    printf("inode.ctime = %d\n", node->ctime);
+    printf("inode.atime = %ld.%09ld\n", node->atime.tv_sec, node->atime.tv_nsec);
+    printf("inode.mtime = %ld.%09ld\n", node->mtime.tv_sec, node->mtime.tv_nsec);
+    printf("inode.ctime = %ld.%09ld\n", node->ctime.tv_sec, node->ctime.tv_nsec);
 }
 
 // gets an inode given its number
 inode_t* get_inode(int inum)
 {
-    inode_t* inodeArray = get_inode_bitmap() + BLOCK_BITMAP_SIZE; // get inode array
+    inode_t* inodeArray = blocks_get_block(get_superblock()->inode_table_start); // get inode array
     return &inodeArray[inum]; // return the inode
 }
 
-// alloctes an inode and initialzes it
-int alloc_inode()
+// alloctes an inode and initialzes it; regular files start out inline, with
+// no block, and everything else with its first block
+int alloc_inode(int mode)
 {
+    superblock_t* sb = get_superblock();
     void *inodeBitmap = get_inode_bitmap(); // get inode bitmap   
-    int allocatedInode = 0;
-    for (int inodeIndex = 0; inodeIndex < BLOCK_COUNT; ++inodeIndex) { // find a free inode
-        if (!bitmap_get(inodeBitmap, inodeIndex)) {
-            bitmap_put(inodeBitmap, inodeIndex, 1); // mark the inode as used
-            printf("+ alloc_inode() -> %d\n", inodeIndex);
-            allocatedInode = inodeIndex;
-            break;
-        }
+
+    pthread_mutex_lock(&inodeBitmapLock);
+    // next fit: search from the cursor to the end, then wrap around
+    int start = sb->inode_cursor < sb->inode_count ? sb->inode_cursor : 0;
+    int allocatedInode = bitmap_find_clear(inodeBitmap, start, sb->inode_count);
+    if (allocatedInode < 0)
+        allocatedInode = bitmap_find_clear(inodeBitmap, 0, start);
+    if (allocatedInode < 0) // inode table is full
+    {
+        pthread_mutex_unlock(&inodeBitmapLock);
+        return -ENOSPC;
     }
+    bitmap_put(inodeBitmap, allocatedInode, 1); // mark the inode as used
+    journal_dirty(sb->inode_bitmap_start + allocatedInode / (BLOCK_SIZE * 8));
+    sb->inode_cursor = allocatedInode + 1;
+    pthread_mutex_unlock(&inodeBitmapLock);
+    TRACE(ALLOC_INODE, allocatedInode);
+    stats_count(STATS_INODES_ALLOCATED, 1);
+    stats_record(STATS_INODE_SCAN, allocatedInode >= start ? allocatedInode - start + 1
+                                                           : sb->inode_count - start + allocatedInode + 1);
+
     inode_t* new_node = get_inode(allocatedInode); // get the new inode
+    inode_dirty(new_node);
     new_node->refs = 1; // set reference count
-    new_node->mode = 0; // set mode
+    new_node->mode = mode; // set mode
     new_node->size = 0; // set size
-    new_node->block = alloc_block(); // allocate a block
-    new_node->atime = 
-        new_node->ctime = 
-        new_node->mtime = time(NULL); // set access, modifiction, and change times
+    new_node->nextents = 0; // start with an empty block map
+    new_node->indirect = 0;
+    new_node->flags = 0;
+    new_node->parent = 0;
+    memset(new_node->inline_data, 0, INODE_INLINE_SIZE);
+    if (S_ISREG(mode))
+        new_node->flags = INODE_INLINE;
+    if (S_ISDIR(mode) && inode_alloc_blocks(new_node, 0, 1) < 0) // a directory starts with a block
+    {
+        free_inode(allocatedInode); // no room for it, give the inode back
+        return -ENOSPC;
+    }
+    free(inode_take_times(allocatedInode)); // a late update of the inode's last user
+    clock_gettime(CLOCK_REALTIME, &new_node->atime); // set access, modifiction, and change times
+    new_node->ctime = new_node->mtime = new_node->atime;
     return allocatedInode; // return inode number
 }
 
 // frees an inode
 void free_inode(int inum)
 {
-    printf("+ free_inode(%d)\n", inum);
+    TRACE(FREE_INODE, inum);
+    stats_count(STATS_INODES_FREED, 1);
 
     inode_t* node = get_inode(inum);
-    shrink_inode(node, 0); // shrink the inode size to 0
-    free_block(node->block); // free the block
+    inode_dirty(node);
+    inode_clear_dirty(inum); // nothing left to sync
+    free(inode_take_wbuf(inum)); // or to give blocks
+    free(inode_take_times(inum)); // or times to write
+    inode_trim_blocks(node, 0); // free every block, including the first
+    node->size = 0;
 
     void *inodeBitmap = get_inode_bitmap();
+    pthread_mutex_lock(&inodeBitmapLock);
     bitmap_put(inodeBitmap, inum, 0); // mark inode as free in bitmap
+    journal_dirty(get_superblock()->inode_bitmap_start + inum / (BLOCK_SIZE * 8));
+    pthread_mutex_unlock(&inodeBitmapLock);
 }
 
-// grows an inode to a specfied size
-int grow_inode(inode_t* node, int size)
+// records in the journal that an inode is about to change
+void inode_dirty(inode_t* node)
+{
+    journal_dirty_range(node, sizeof(inode_t));
+}
+
+// sets up one reader/writer lock per inode in the table
+void inode_locks_init(int count)
+{
+    for (int i = 0; i < inodeLockCount; i++) // drop the locks of a previous image
+        pthread_rwlock_destroy(&inodeLocks[i]);
+    free(inodeLocks);
+    free(inodeOpens);
+    for (int i = 0; i < inodeLockCount; i++)
+    {
+        free(inodeDirty[i]);
+        free(inodeWbuf[i]);
+        free(inodeTimes[i]);
+    }
+    free(inodeDirty);
+    free(inodeWbuf);
+    free(inodeTimes);
+    wbufBytes = 0;
+
+    inodeLocks = malloc(count * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < count; i++)
+        pthread_rwlock_init(&inodeLocks[i], 0);
+    inodeOpens = calloc(count, sizeof(int));
+    inodeDirty = calloc(count, sizeof(inode_dirty_t*));
+    inodeWbuf = calloc(count, sizeof(inode_wbuf_t*));
+    inodeTimes = calloc(count, sizeof(inode_times_t*));
+    inodeLockCount = count;
+}
+
+// locks an inode for reading its data, block map or directory entries
+void inode_read_lock(int inum)
+{
+    blocks_op_begin(); // blocks got under the lock stay cached until it's released
+    pthread_rwlock_rdlock(&inodeLocks[inum]);
+}
+
+// locks an inode for changing it
+void inode_write_lock(int inum)
+{
+    blocks_op_begin();
+    pthread_rwlock_wrlock(&inodeLocks[inum]);
+}
+
+// tries to lock an inode for writing without blocking, returns 0 on success
+int inode_try_write_lock(int inum)
+{
+    if (pthread_rwlock_trywrlock(&inodeLocks[inum]) != 0)
+        return -EBUSY;
+    blocks_op_begin();
+    return 0;
+}
+
+// releases either kind of inode lock
+void inode_unlock(int inum)
+{
+    pthread_rwlock_unlock(&inodeLocks[inum]);
+    blocks_op_end();
+}
+
+// counts a new open handle on an inode, with its write lock held
+void inode_open(int inum)
+{
+    inodeOpens[inum]++;
+}
+
+// drops an open handle, with the write lock held, and returns how many are left
+int inode_close(int inum)
+{
+    return --inodeOpens[inum];
+}
+
+// checks whether an inode has open handles
+int inode_is_open(int inum)
+{
+    return inodeOpens[inum] > 0;
+}
+
+// remembers that file blocks [first, end) of an inode were written since the
+// last sync, and whether its size or block map changed; caller holds the lock
+void inode_dirty_data(int inum, int first, int end, int meta)
+{
+    inode_dirty_t* dirty = inodeDirty[inum];
+    if (!dirty)
+        dirty = inodeDirty[inum] = calloc(1, sizeof(inode_dirty_t));
+    dirty->meta |= meta;
+    if (first >= end) // nothing but metadata
+        return;
+
+    int nearest = 0; // range with the smallest gap to the new one
+    int nearestGap = -1;
+    for (int i = 0; i < dirty->nranges; i++)
+    {
+        int gap = first > dirty->end[i] ? first - dirty->end[i]
+            : dirty->first[i] > end ? dirty->first[i] - end : 0;
+        if (nearestGap < 0 || gap < nearestGap)
+        {
+            nearest = i;
+            nearestGap = gap;
+        }
+    }
+
+    if (nearestGap == 0 || dirty->nranges == INODE_DIRTY_RANGES) // touches one, or out of room
+    {
+        if (first < dirty->first[nearest])
+            dirty->first[nearest] = first;
+        if (end > dirty->end[nearest])
+            dirty->end[nearest] = end;
+        return;
+    }
+    dirty->first[dirty->nranges] = first;
+    dirty->end[dirty->nranges] = end;
+    dirty->nranges++;
+}
+
+// gets what an inode has written since its last sync, or NULL if nothing
+inode_dirty_t* inode_get_dirty(int inum)
+{
+    return inodeDirty[inum];
+}
+
+// forgets an inode's unsynced writes
+void inode_clear_dirty(int inum)
+{
+    free(inodeDirty[inum]);
+    inodeDirty[inum] = 0;
+}
+
+// checks whether an inode keeps its data in the inode itself
+int inode_is_inline(inode_t* node)
 {
-    int end_block = node->block; // find the last block
-    while (end_block != block_list[end_block])
-        end_block = block_list[end_block];
+    return (node->flags & INODE_INLINE) != 0;
+}
 
-    int requiredBlocks = (size - 1) / BLOCK_SIZE - (node->size - 1) / BLOCK_SIZE; // clacualte needed blocks
-    for (int i = 0; i < requiredBlocks; i++) // allocate new blocks
+// moves the data of an inline inode out into a block of its own
+static int inode_unline(inode_t* node)
+{
+    if (node->size == 0) // nothing to move, the file starts out as a hole
     {
-        int inum = alloc_block();
-        block_list[end_block] = inum; // link the new block
-        end_block = inum;
+        node->flags &= ~INODE_INLINE;
+        return 0;
+    }
+    int bnum = alloc_block(); // the data stays inline if this fails
+    if (bnum < 0)
+        return -ENOSPC;
+    char* block = blocks_get_block(bnum);
+    if (!block)
+    {
+        free_block(bnum);
+        return -EIO;
+    }
+    memcpy(block, node->inline_data, node->size);
+    memset(block + node->size, 0, BLOCK_SIZE - node->size);
+    blocks_mark_dirty(bnum);
+    node->flags &= ~INODE_INLINE;
+    memset(node->inline_data, 0, INODE_INLINE_SIZE);
+    return inode_insert_run(node, 0, bnum, 1);
+}
+
+// gets the number of blocks allocated to an inode (holes take none)
+int inode_block_count(inode_t* node)
+{
+    int count = 0;
+    for (int i = 0; i < node->nextents; i++)
+        count += inode_extent(node, i)->len;
+    return count;
+}
+
+// gets the index of the last extent starting at or before file block fpn,
+// or -1 if there is none
+static int inode_find_extent(inode_t* node, int fpn)
+{
+    int lo = 0;
+    int hi = node->nextents - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (inode_extent(node, mid)->lblk <= fpn)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if (node->nextents == 0 || inode_extent(node, lo)->lblk > fpn)
+        return -1;
+    return lo;
+}
+
+// makes room for one more extent at the end of an inode's block map,
+// spilling into the indirect block and extent blocks as needed
+static int inode_reserve_extent(inode_t* node)
+{
+    if (node->nextents == inode_max_extents()) // block map is full
+        return -EFBIG;
+    if (node->nextents == INODE_EXTENTS && node->indirect == 0) // spill into an indirect block
+    {
+        int indirect = alloc_block();
+        if (indirect < 0)
+            return -ENOSPC;
+        void* block = blocks_get_block(indirect);
+        journal_dirty(indirect);
+        memset(block, 0, BLOCK_SIZE);
+        node->indirect = indirect;
+    }
+    int perBlock = BLOCK_SIZE / sizeof(extent_t);
+    if (node->nextents >= INODE_EXTENTS && (node->nextents - INODE_EXTENTS) % perBlock == 0)
+    {
+        int extentBlock = alloc_block(); // the current extent block is full, start another
+        if (extentBlock < 0)
+            return -ENOSPC;
+        int* extentBlocks = blocks_get_block(node->indirect);
+        journal_dirty(node->indirect);
+        extentBlocks[(node->nextents - INODE_EXTENTS) / perBlock] = extentBlock;
+    }
+    return 0;
+}
+
+// maps file blocks [lblk, lblk + count), a hole in an inode's block map, to
+// the physical run starting at pnum, keeping the extents sorted by lblk
+static int inode_insert_run(inode_t* node, int lblk, int pnum, int count)
+{
+    int pos = inode_find_extent(node, lblk) + 1; // where the new extent goes
+    if (pos > 0) // extend the extent before the hole if the run continues it
+    {
+        extent_t* prev = inode_extent(node, pos - 1);
+        if (prev->lblk + prev->len == lblk && prev->pblk + prev->len == pnum)
+        {
+            journal_dirty_range(prev, sizeof(extent_t));
+            prev->len += count;
+            return 0;
+        }
+    }
+    if (pos < node->nextents) // or the one after it, if the run leads into it
+    {
+        extent_t* next = inode_extent(node, pos);
+        if (lblk + count == next->lblk && pnum + count == next->pblk)
+        {
+            journal_dirty_range(next, sizeof(extent_t));
+            next->lblk = lblk;
+            next->pblk = pnum;
+            next->len += count;
+            return 0;
+        }
+    }
+
+    int rv = inode_reserve_extent(node);
+    if (rv < 0)
+        return rv;
+    for (int i = node->nextents; i > pos; i--) // shift the later extents up one
+    {
+        extent_t* ext = inode_extent(node, i);
+        journal_dirty_range(ext, sizeof(extent_t));
+        *ext = *inode_extent(node, i - 1);
+    }
+    extent_t* ext = inode_extent(node, pos);
+    journal_dirty_range(ext, sizeof(extent_t));
+    ext->lblk = lblk;
+    ext->pblk = pnum;
+    ext->len = count;
+    node->nextents++;
+    return 0;
+}
+
+// backs every hole in file blocks [first, end) of an inode with physical
+// blocks, a whole run at a time
+int inode_alloc_blocks(inode_t* node, int first, int end)
+{
+    inode_dirty(node);
+    int fpn = first;
+    while (fpn < end)
+    {
+        int i = inode_find_extent(node, fpn);
+        extent_t* prev = i >= 0 ? inode_extent(node, i) : NULL;
+        if (prev && fpn < prev->lblk + prev->len) // already mapped, skip the extent
+        {
+            fpn = prev->lblk + prev->len;
+            continue;
+        }
+        int holeEnd = end;
+        if (i + 1 < node->nextents && inode_extent(node, i + 1)->lblk < end)
+            holeEnd = inode_extent(node, i + 1)->lblk;
+
+        // aim where the previous extent would have put fpn, so the file stays contiguous
+        int goal = prev ? prev->pblk + (fpn - prev->lblk) : 0;
+        int runLength;
+        int bnum = alloc_blocks(holeEnd - fpn, goal, &runLength);
+        if (bnum < 0)
+            return -ENOSPC;
+        int rv = inode_insert_run(node, fpn, bnum, runLength); // link the new blocks
+        if (rv < 0)
+        {
+            free_blocks(bnum, runLength);
+            return rv;
+        }
+        fpn += runLength;
+    }
+    return 0;
+}
+
+// gets the first file block at or after fpn that has a physical block, or
+// -1 if there is none
+int inode_next_data(inode_t* node, int fpn)
+{
+    int i = inode_find_extent(node, fpn);
+    if (i >= 0 && fpn < inode_extent(node, i)->lblk + inode_extent(node, i)->len)
+        return fpn;
+    return i + 1 < node->nextents ? inode_extent(node, i + 1)->lblk : -1;
+}
+
+// gets the first file block at or after fpn that is a hole
+int inode_next_hole(inode_t* node, int fpn)
+{
+    int i = inode_find_extent(node, fpn);
+    while (i >= 0 && i < node->nextents)
+    {
+        extent_t* ext = inode_extent(node, i);
+        if (fpn >= ext->lblk + ext->len) // fpn is past this extent
+            break;
+        fpn = ext->lblk + ext->len;
+        i++;
+        if (i < node->nextents && inode_extent(node, i)->lblk != fpn)
+            break;
+    }
+    return fpn;
+}
+
+// frees every block past the first keep blocks of an inode
+static void inode_trim_blocks(inode_t* node, int keep)
+{
+    while (node->nextents > 0)
+    {
+        extent_t* last = inode_extent(node, node->nextents - 1);
+        int firstFreed = keep > last->lblk ? keep - last->lblk : 0; // first run index to free
+        if (firstFreed >= last->len) // ends before keep, maybe in a hole
+            break;
+        free_blocks(last->pblk + firstFreed, last->len - firstFreed);
+        if (firstFreed > 0) // part of the run survives
+        {
+            journal_dirty_range(last, sizeof(extent_t));
+            last->len = firstFreed;
+            break;
+        }
+        node->nextents--; // the whole run is gone
+    }
+
+    if (node->indirect != 0) // free the extent blocks no longer in use
+    {
+        int perBlock = BLOCK_SIZE / sizeof(extent_t);
+        int* extentBlocks = blocks_get_block(node->indirect);
+        int inUse = node->nextents > INODE_EXTENTS ? (node->nextents - INODE_EXTENTS + perBlock - 1) / perBlock : 0;
+        for (int i = inUse; i < BLOCK_SIZE / sizeof(int) && extentBlocks[i] != 0; i++)
+        {
+            journal_dirty(node->indirect);
+            free_block(extentBlocks[i]);
+            extentBlocks[i] = 0;
+        }
+    }
+    if (node->nextents <= INODE_EXTENTS && node->indirect != 0) // overflow no longer needed
+    {
+        free_block(node->indirect);
+        node->indirect = 0;
+    }
+}
+
+// grows an inode to a specfied size; the new part is a hole, which reads as
+// zeros and takes no blocks until it is written (see inode_alloc_blocks)
+int grow_inode(inode_t* node, int size)
+{
+    inode_dirty(node);
+    if (node->flags & INODE_INLINE)
+    {
+        if (size <= INODE_INLINE_SIZE) // still fits, and the tail is already zero
+        {
+            node->size = size;
+            return 0;
+        }
+        int rv = inode_unline(node);
+        if (rv < 0)
+            return rv;
     }
 
     node->size = size; // update size
@@ -91,31 +539,206 @@ int grow_inode(inode_t* node, int size)
 // shrinks an inode to a specified size
 int shrink_inode(inode_t* node, int size)
 {
-    int targetBlockCount = size / BLOCK_SIZE; // calculate the number of blocks after shrinking
+    inode_dirty(node);
+    if (node->flags & INODE_INLINE) // clear the cut bytes, so growing reads zeros
+    {
+        memset(node->inline_data + size, 0, node->size - size);
+        node->size = size;
+        return 0;
+    }
+    if (S_ISREG(node->mode) && size <= INODE_INLINE_SIZE) // fits back in the inode
+    {
+        int first = inode_get_pnum(node, 0);
+        char* block = first >= 0 ? blocks_get_block(first) : NULL;
+        if (first >= 0 && !block)
+            return -EIO;
+        memset(node->inline_data, 0, INODE_INLINE_SIZE);
+        if (block) // a hole is zeros already
+            memcpy(node->inline_data, block, size);
+        inode_trim_blocks(node, 0);
+        node->flags |= INODE_INLINE;
+        node->size = size;
+        return 0;
+    }
 
-    int i = 0;
-    int currentBlock = node->block;
-    while (currentBlock != block_list[currentBlock]) // loop through blocks
+    int targetBlockCount = bytes_to_blocks(size); // calculate the number of blocks after shrinking
+    if (targetBlockCount == 0)
+        targetBlockCount = 1; // the first block stays until the inode is freed
+    inode_trim_blocks(node, targetBlockCount);
+
+    // clear the cut part of the last block, so growing the file reads zeros
+    int last = size % BLOCK_SIZE ? inode_get_pnum(node, size / BLOCK_SIZE) : -1;
+    char* lastBlock = last >= 0 && S_ISREG(node->mode) ? blocks_get_block(last) : NULL;
+    if (lastBlock) // an unreadable one fails whatever reads it next
     {
-        if (i > targetBlockCount) // if beynd new size
-        {
-            free_block(currentBlock); // free the block
-            int nextBlock = block_list[currentBlock]; // move to next block
-            currentBlock = nextBlock;
-        }
-        i++;
+        memset(lastBlock + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        blocks_mark_dirty(last);
     }
 
     node->size = size; // set new size
     return 0; // return success
 }
 
-// gets the phyiscal block number for a file pointer number in an inode
+// gets the phyiscal block number for a file page number in an inode
 int inode_get_pnum(inode_t* node, int fpn)
 {
-    int targetBlockIndex = fpn / BLOCK_COUNT; // calculate block number
-    int block = node->block;
-    for (int i = 0; i < targetBlockIndex; i++) // traverse to the corresponding block
-        block = block_list[block];
-    return block; // return the block number
+    int hint = 0;
+    return inode_get_pnum_hint(node, fpn, &hint);
+}
+
+// like inode_get_pnum, but tries the extent at *hint (and the one after it)
+// before searching, and leaves the extent it used in *hint; sequential
+// access through the same hint never searches the map
+int inode_get_pnum_hint(inode_t* node, int fpn, int* hint)
+{
+    for (int i = *hint; i < *hint + 2 && i < node->nextents; i++)
+    {
+        extent_t* ext = inode_extent(node, i);
+        if (fpn >= ext->lblk && fpn < ext->lblk + ext->len)
+        {
+            *hint = i;
+            return ext->pblk + (fpn - ext->lblk);
+        }
+    }
+
+    int i = inode_find_extent(node, fpn);
+    if (i < 0)
+        return -1;
+    extent_t* ext = inode_extent(node, i);
+    if (fpn >= ext->lblk + ext->len) // in a hole, or past the end of the map
+        return -1;
+    *hint = i;
+    return ext->pblk + (fpn - ext->lblk); // return the block number
+}
+
+// gets an inode's buffered appends, or NULL if it has none
+inode_wbuf_t* inode_get_wbuf(int inum)
+{
+    return __atomic_load_n(&inodeWbuf[inum], __ATOMIC_ACQUIRE);
+}
+
+// buffers an append of size bytes at offset, which must be the end of the
+// inode's buffer (if it has one) and fit in it
+void inode_wbuf_append(int inum, int offset, const char* buf, int size)
+{
+    inode_wbuf_t* wbuf = inodeWbuf[inum];
+    if (!wbuf)
+    {
+        wbuf = malloc(sizeof(inode_wbuf_t));
+        wbuf->start = offset;
+        wbuf->len = 0;
+        __atomic_store_n(&inodeWbuf[inum], wbuf, __ATOMIC_RELEASE);
+    }
+    memcpy(wbuf->data + wbuf->len, buf, size);
+    wbuf->len += size;
+    __atomic_add_fetch(&wbufBytes, size, __ATOMIC_RELAXED);
+}
+
+// detaches an inode's buffered appends, returning them (NULL if none)
+inode_wbuf_t* inode_take_wbuf(int inum)
+{
+    inode_wbuf_t* wbuf = inodeWbuf[inum];
+    if (wbuf)
+    {
+        __atomic_store_n(&inodeWbuf[inum], NULL, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&wbufBytes, wbuf->len, __ATOMIC_RELAXED);
+    }
+    return wbuf;
+}
+
+// finds the first inode at or after inum with buffered appends, or -1
+int inode_wbuf_next(int inum)
+{
+    for (; inum < inodeLockCount; inum++)
+        if (__atomic_load_n(&inodeWbuf[inum], __ATOMIC_RELAXED))
+            return inum;
+    return -1;
+}
+
+// gets the number of bytes buffered across all inodes
+long inode_wbuf_bytes()
+{
+    return __atomic_load_n(&wbufBytes, __ATOMIC_RELAXED);
+}
+
+// gets a pointer to one of an inode's timestamps, indexed like inode_times_t's
+static struct timespec* inode_time(inode_t* node, int i)
+{
+    return i == 0 ? &node->atime : i == 1 ? &node->mtime : &node->ctime;
+}
+
+// detaches an inode's pending times, returning them (NULL if none)
+static inode_times_t* inode_take_times(int inum)
+{
+    pthread_mutex_lock(&timesLock);
+    inode_times_t* pending = inodeTimes[inum];
+    __atomic_store_n(&inodeTimes[inum], NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&timesLock);
+    return pending;
+}
+
+// sets the times picked by which (INODE_*TIME bits) in an inode, writing
+// back its pending times too since it is being changed anyway
+void inode_set_times(int inum, int which, const struct timespec times[3])
+{
+    inode_t* node = get_inode(inum);
+    inode_times_t* pending = inode_take_times(inum);
+    inode_dirty(node);
+    for (int i = 0; i < 3; i++)
+        if (which & (1 << i))
+            *inode_time(node, i) = times[i];
+        else if (pending && (pending->which & (1 << i)))
+            *inode_time(node, i) = pending->times[i];
+    free(pending);
+}
+
+// records new times for an inode in memory only
+void inode_lazy_times(int inum, int which, const struct timespec times[3])
+{
+    pthread_mutex_lock(&timesLock);
+    inode_times_t* pending = inodeTimes[inum];
+    if (!pending)
+    {
+        pending = calloc(1, sizeof(inode_times_t));
+        __atomic_store_n(&inodeTimes[inum], pending, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < 3; i++)
+        if (which & (1 << i))
+            pending->times[i] = times[i];
+    pending->which |= which;
+    pthread_mutex_unlock(&timesLock);
+}
+
+// writes an inode's pending times into it, returning 1 if it had any
+int inode_write_times(int inum)
+{
+    if (!__atomic_load_n(&inodeTimes[inum], __ATOMIC_RELAXED))
+        return 0;
+    inode_set_times(inum, 0, NULL);
+    return 1;
+}
+
+// gets an inode's times, pending ones included
+void inode_get_times(int inum, struct timespec times[3])
+{
+    inode_t* node = get_inode(inum);
+    for (int i = 0; i < 3; i++)
+        times[i] = *inode_time(node, i);
+    if (!__atomic_load_n(&inodeTimes[inum], __ATOMIC_RELAXED)) // the usual case, no lock needed
+        return;
+    pthread_mutex_lock(&timesLock);
+    inode_times_t* pending = inodeTimes[inum];
+    for (int i = 0; pending && i < 3; i++)
+        if (pending->which & (1 << i))
+            times[i] = pending->times[i];
+    pthread_mutex_unlock(&timesLock);
+}
+
+// finds the first inode at or after inum with pending times, or -1
+int inode_times_next(int inum)
+{
+    for (; inum < inodeLockCount; inum++)
+        if (__atomic_load_n(&inodeTimes[inum], __ATOMIC_RELAXED))
+            return inum;
+    return -1;
 }
@@ -9,23 +9,122 @@
 #include "blocks.h"
 #include "time.h"
 
+// A run of physically contiguous blocks backing part of a file.
+typedef struct extent {
+  int lblk; // first file block covered by the run
+  int pblk; // first physical block of the run
+  int len;  // number of blocks in the run
+} extent_t;
+
+#define INODE_EXTENTS 4 // extents stored directly in the inode
+
+#define INODE_DIR_HASHED 0x1 // directory uses the hashed (multi-block) format
+#define INODE_INLINE 0x2     // file data lives in the inode, with no blocks
+
+#define INODE_INLINE_SIZE 132 // bytes of file data an inode can hold itself
+
 typedef struct inode {
   int refs;  // reference count
   int mode;  // permission & type
   int size;  // bytes
-  int block; // single block pointer (if max file size <= 4K)
+  int nextents; // number of extents in the block map
+  extent_t extents[INODE_EXTENTS]; // first extents, sorted by lblk
+  int indirect; // block listing the blocks of overflow extents (0 if none)
+  int flags; // INODE_* flags
 
-  time_t atime; // access time
-  time_t mtime; // modify time
-  time_t ctime; // change time
+  struct timespec atime; // access time
+  struct timespec mtime; // modify time
+  struct timespec ctime; // change time
+  int parent; // directories: the directory holding this one (the root's is 0)
+
+  char inline_data[INODE_INLINE_SIZE]; // file data, if INODE_INLINE is set
 } inode_t;
 
+#define INODE_DIRTY_RANGES 8 // separate dirty ranges tracked per inode
+
+// What an inode has written since it was last synced, kept in memory only.
+typedef struct inode_dirty {
+  int nranges;
+  int meta; // size or block map changed
+  int first[INODE_DIRTY_RANGES]; // first file block of each range
+  int end[INODE_DIRTY_RANGES];   // one past the last file block of each range
+} inode_dirty_t;
+
+#define INODE_WBUF_SIZE (64 * 1024) // most bytes of appends an inode buffers
+
+// Small appends that have no blocks yet, kept in memory only. The buffered
+// bytes always run to the end of the file.
+typedef struct inode_wbuf {
+  int start; // file offset of the first buffered byte
+  int len;   // bytes buffered
+  char data[INODE_WBUF_SIZE];
+} inode_wbuf_t;
+
+#define INODE_ATIME 0x1 // timestamps, in the order of inode_times_t's times
+#define INODE_MTIME 0x2
+#define INODE_CTIME 0x4
+
+// Timestamp updates kept in memory only, under lazytime.
+typedef struct inode_times {
+  int which; // INODE_*TIME bits of the times that are pending
+  struct timespec times[3]; // atime, mtime and ctime
+} inode_times_t;
+
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
-int alloc_inode();
+int alloc_inode(int mode);
 void free_inode(int inum);
 int grow_inode(inode_t *node, int size);
 int shrink_inode(inode_t *node, int size);
 int inode_get_pnum(inode_t *node, int fpn);
+int inode_get_pnum_hint(inode_t *node, int fpn, int *hint);
+int inode_block_count(inode_t *node);
+int inode_alloc_blocks(inode_t *node, int first, int end);
+int inode_next_data(inode_t *node, int fpn);
+int inode_next_hole(inode_t *node, int fpn);
+int inode_is_inline(inode_t *node);
+void inode_dirty(inode_t *node);
+
+// Per-inode reader/writer locks. Readers and writers of an inode's data,
+// block map or directory entries hold its lock; when holding two, a
+// directory is always locked before the entries it contains. Each lock is
+// also a blocks operation, so blocks got under it stay valid until it's released.
+void inode_locks_init(int count);
+void inode_read_lock(int inum);
+void inode_write_lock(int inum);
+int inode_try_write_lock(int inum);
+void inode_unlock(int inum);
+
+// In-memory counts of open file handles. An inode whose last link goes away
+// while it is open is only freed when its last handle is closed.
+void inode_open(int inum);
+int inode_close(int inum);
+int inode_is_open(int inum);
+
+// Unsynced writes, tracked with the inode's write lock held. Ranges merge
+// when they touch; once all are in use, new writes widen the nearest one.
+void inode_dirty_data(int inum, int first, int end, int meta);
+inode_dirty_t *inode_get_dirty(int inum);
+void inode_clear_dirty(int inum);
+
+// Buffered appends, changed with the inode's write lock held and read with
+// either lock. inode_take_wbuf hands the buffer over to the caller to free.
+inode_wbuf_t *inode_get_wbuf(int inum);
+void inode_wbuf_append(int inum, int offset, const char *buf, int size);
+inode_wbuf_t *inode_take_wbuf(int inum);
+int inode_wbuf_next(int inum);
+long inode_wbuf_bytes();
+
+// Timestamps. inode_set_times writes the chosen times (indexed like
+// inode_times_t's) into the inode along with any pending ones, with its
+// write lock held; inode_lazy_times only records them in memory, with
+// either lock, and inode_write_times writes back what is pending, returning
+// whether there was anything. inode_get_times reads the current times,
+// pending ones included.
+void inode_set_times(int inum, int which, const struct timespec times[3]);
+void inode_lazy_times(int inum, int which, const struct timespec times[3]);
+int inode_write_times(int inum);
+void inode_get_times(int inum, struct timespec times[3]);
+int inode_times_next(int inum);
 
 #endif
@@ -0,0 +1,476 @@
+/**
+ * @file journal.c
+ *
+ * Implementation of the metadata journal.
+ *
+ * The journal region holds a single commit: a header block listing the home
+ * block of every image, followed by the images themselves. Once a commit is
+ * durable its images are written home with blocks_write_copy and the header
+ * is cleared, so the region never needs to hold more than one, and a commit
+ * is never replayed over changes made after it.
+ *
+ * The blocks of a commit stay held until the next commit, which releases
+ * those it does not change again; the blocks freed in a batch are handed
+ * back to the allocators then too.
+ */
+#define _GNU_SOURCE // for PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "journal.h"
+#include "trace.h"
+
+#define JOURNAL_MAX_TAGS 1020 // home block numbers that fit in the header
+#define DIRTY_SLOTS 4096      // hash set of dirty blocks, kept under half full
+
+typedef struct journal_header {
+  uint32_t magic;                  // JOURNAL_MAGIC if the region holds a commit
+  uint32_t seq;                    // sequence number of the commit
+  uint32_t count;                  // blocks in the commit
+  uint32_t checksum;               // over this header and every image
+  uint32_t tags[JOURNAL_MAX_TAGS]; // home block of each image, in order
+} journal_header_t;
+
+static int enabled = 0;
+static int capacity;     // blocks one commit can hold
+static int journal_start;
+
+// Operations hold this shared; a commit takes it exclusively while copying
+// images, so it never sees a half-done operation. Writers are preferred so
+// a steady stream of operations cannot hold off a commit.
+static pthread_rwlock_t txn_lock;
+
+// Guards everything below.
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_committer = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static int dirty[JOURNAL_MAX_TAGS]; // blocks changed since the last commit
+static int ndirty = 0;
+static int dirty_slots[DIRTY_SLOTS]; // bnum + 1 of each dirty block, 0 = empty
+static int overflow = 0;             // more blocks changed than fit in a commit
+static int committed[JOURNAL_MAX_TAGS]; // blocks of the last commit, still held
+static int ncommitted = 0;
+static int committed_slots[DIRTY_SLOTS];
+static int unwritten = 0; // the last commit may not be home
+
+// A run of blocks freed in batch seq, kept from the allocators until the
+// commit of that batch is home.
+typedef struct freed_run {
+  int bnum;
+  int count;
+  long seq;
+} freed_run_t;
+
+static freed_run_t *freed = 0;
+static int nfreed = 0;
+static int freed_capacity = 0;
+static long running_seq = 1;         // commit the current changes will go in
+static long done_seq = 0;            // last commit that is durable
+static int last_error = 0;           // result of the last commit
+static int commit_requested = 0;
+static int stopping = 0;
+static pthread_t committer;
+
+// Checksum 32-bit words (FNV-1a over words), continuing from hash.
+static uint32_t checksum_words(uint32_t hash, const void *data, int len) {
+  const uint32_t *words = data;
+  for (int i = 0; i < len / 4; i++) {
+    hash = (hash ^ words[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Checksum a commit as laid out in the journal region.
+static uint32_t commit_checksum(journal_header_t *hdr) {
+  uint32_t saved = hdr->checksum;
+  hdr->checksum = 0;
+  uint32_t hash = checksum_words(2166136261u, hdr, 16 + 4 * hdr->count);
+  hdr->checksum = saved;
+  for (int i = 0; i < hdr->count; i++) {
+    hash = checksum_words(hash, blocks_get_block(journal_start + 1 + i), BLOCK_SIZE);
+  }
+  return hash;
+}
+
+// The slot of bnum in a hash set of bnum + 1, or the empty slot it would
+// take.
+static int find_slot(const int *slots, int bnum) {
+  uint32_t slot = ((uint32_t) bnum * 2654435761u) % DIRTY_SLOTS;
+  while (slots[slot] != 0 && slots[slot] != bnum + 1) {
+    slot = (slot + 1) % DIRTY_SLOTS;
+  }
+  return slot;
+}
+
+// Write the commit in the journal region home and mark the region empty.
+static int checkpoint(journal_header_t *hdr) {
+  if (hdr->magic != JOURNAL_MAGIC) {
+    return 0;
+  }
+  int rv = 0;
+  for (int i = 0; i < hdr->count && rv == 0; i++) {
+    rv = blocks_write_copy(hdr->tags[i], blocks_get_block(journal_start + 1 + i));
+  }
+  if (rv == 0) {
+    rv = blocks_flush();
+  }
+  if (rv == 0) {
+    hdr->magic = 0;
+    rv = blocks_sync(journal_start, 1);
+  }
+  return rv;
+}
+
+// Let go of a held block. Unless its last commit is known to be home, what
+// is in memory is written there first (it has not changed since).
+static void release_block(int bnum, int write) {
+  if (write && blocks_write_copy(bnum, blocks_get_block(bnum)) != 0) {
+    blocks_mark_dirty(bnum); // leave it to whatever writes back next
+  }
+  blocks_release(bnum);
+}
+
+// Take the runs freed before batch seq off the list; state_lock held. The
+// caller frees what comes back.
+static freed_run_t *take_freed(long seq, int *n) {
+  int k = 0;
+  while (k < nfreed && freed[k].seq < seq) {
+    k++;
+  }
+  freed_run_t *runs = malloc((k + 1) * sizeof(freed_run_t));
+  memcpy(runs, freed, k * sizeof(freed_run_t));
+  memmove(freed, freed + k, (nfreed - k) * sizeof(freed_run_t));
+  nfreed -= k;
+  *n = k;
+  return runs;
+}
+
+// Hand runs taken with take_freed back to the allocators; state_lock not
+// held, since the allocators call journal_dirty with their lock taken.
+static void reuse_freed(freed_run_t *runs, int n) {
+  for (int i = 0; i < n; i++) {
+    blocks_reuse(runs[i].bnum, runs[i].count);
+  }
+  free(runs);
+}
+
+// Write a batch too big for the journal in place, with every operation
+// still stopped: clear the journal so the older commit in it is not
+// replayed over what follows, then write back every held block and
+// everything marked. Not atomic.
+static int spill(journal_header_t *hdr, int *held, int nheld) {
+  hdr->magic = 0;
+  int rv = blocks_sync(journal_start, 1);
+  for (int i = 0; i < nheld; i++) {
+    release_block(held[i], 1);
+  }
+  blocks_op_end(); // a sync waits for blocks to be let go, ours included
+  int r = blocks_sync(0, BLOCK_COUNT);
+  return rv ? rv : r;
+}
+
+// Write one commit: copy the images while no operation is running, make the
+// journal durable, then write the blocks home and clear the journal.
+static void do_commit() {
+  static int held[2 * JOURNAL_MAX_TAGS]; // blocks a spill lets go of
+  journal_header_t *hdr = blocks_get_block(journal_start);
+  if (unwritten && checkpoint(hdr) == 0) {
+    unwritten = 0; // the last commit made it after all
+  }
+
+  blocks_op_begin();
+  pthread_rwlock_wrlock(&txn_lock);
+  pthread_mutex_lock(&state_lock);
+  long seq = running_seq++;
+  int count = ndirty;
+  int spilled = overflow;
+  int nheld = 0;
+  int nruns;
+  freed_run_t *runs = take_freed(seq, &nruns); // the last commit is home
+  if (spilled) {
+    memcpy(held, committed, ncommitted * sizeof(int));
+    nheld = ncommitted;
+    for (int i = 0; i < count; i++) {
+      if (committed_slots[find_slot(committed_slots, dirty[i])] == 0) {
+        held[nheld++] = dirty[i];
+      }
+    }
+    ncommitted = 0;
+    memset(committed_slots, 0, sizeof(committed_slots));
+  } else {
+    // let go of the last commit's blocks this batch did not change again
+    for (int i = 0; i < ncommitted; i++) {
+      if (dirty_slots[find_slot(dirty_slots, committed[i])] == 0) {
+        release_block(committed[i], unwritten);
+      }
+    }
+    if (count > 0) {
+      for (int i = 0; i < count; i++) {
+        memcpy(blocks_get_block(journal_start + 1 + i), blocks_get_block(dirty[i]), BLOCK_SIZE);
+        blocks_mark_dirty(journal_start + 1 + i);
+        hdr->tags[i] = dirty[i];
+      }
+      hdr->magic = JOURNAL_MAGIC;
+      hdr->seq = seq;
+      hdr->count = count;
+      hdr->checksum = commit_checksum(hdr);
+      blocks_mark_dirty(journal_start);
+    }
+    memcpy(committed, dirty, count * sizeof(int));
+    memcpy(committed_slots, dirty_slots, sizeof(dirty_slots));
+    ncommitted = count;
+  }
+  ndirty = 0;
+  overflow = 0;
+  memset(dirty_slots, 0, sizeof(dirty_slots));
+  pthread_mutex_unlock(&state_lock);
+
+  int rv = 0;
+  if (spilled) {
+    rv = spill(hdr, held, nheld);
+    pthread_rwlock_unlock(&txn_lock);
+    reuse_freed(runs, nruns);
+    pthread_mutex_lock(&state_lock);
+    runs = take_freed(seq + 1, &nruns); // this batch's are in place too
+    pthread_mutex_unlock(&state_lock);
+    unwritten = 0; // nothing is held any more
+  } else {
+    pthread_rwlock_unlock(&txn_lock);
+    blocks_op_end();
+    if (count > 0) {
+      rv = blocks_sync(journal_start, count + 1); // the commit point
+      if (rv == 0) {
+        rv = checkpoint(hdr);
+      }
+      unwritten = rv != 0;
+    }
+  }
+  reuse_freed(runs, nruns);
+  TRACE(JOURNAL_COMMIT, seq, count, spilled, rv);
+
+  pthread_mutex_lock(&state_lock);
+  done_seq = seq;
+  last_error = rv;
+  pthread_cond_broadcast(&commit_done);
+  pthread_mutex_unlock(&state_lock);
+}
+
+// Commit thread: commits when asked to, or periodically while dirty.
+static void *committer_main(void *arg) {
+  pthread_mutex_lock(&state_lock);
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += JOURNAL_COMMIT_MS / 1000;
+    deadline.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!commit_requested && !stopping) {
+      if (pthread_cond_timedwait(&wake_committer, &state_lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    int pending = ndirty > 0 || overflow;
+    if (stopping && !pending) {
+      break;
+    }
+    if (pending || commit_requested) {
+      commit_requested = 0;
+      pthread_mutex_unlock(&state_lock);
+      do_commit();
+      pthread_mutex_lock(&state_lock);
+    }
+  }
+  pthread_mutex_unlock(&state_lock);
+  return 0;
+}
+
+// Ask for a commit of everything up to seq and wait for it; state_lock held.
+static int wait_for_commit(long seq) {
+  if (done_seq < seq) {
+    commit_requested = 1;
+    pthread_cond_signal(&wake_committer);
+  }
+  while (done_seq < seq) {
+    pthread_cond_wait(&commit_done, &state_lock);
+  }
+  return last_error;
+}
+
+// Copy the last commit back home, if the journal holds an intact one.
+static void replay() {
+  journal_header_t *hdr = blocks_get_block(journal_start);
+  if (hdr->magic != JOURNAL_MAGIC || hdr->count > capacity ||
+      hdr->checksum != commit_checksum(hdr)) {
+    return;
+  }
+
+  printf("+ journal replay %u: %u blocks\n", hdr->seq, hdr->count);
+  blocks_op_begin();
+  for (int i = 0; i < hdr->count; i++) {
+    // the commit may cover blocks the image grew to before the crash, and
+    // its copy of the superblock records how far it grew
+    superblock_t *sb = blocks_get_block(journal_start + 1 + i);
+    int want = hdr->tags[i] == 0 ? (int) sb->block_count : hdr->tags[i] + 1;
+    while (BLOCK_COUNT < want && blocks_grow() == 0) {
+    }
+    memcpy(blocks_get_block(hdr->tags[i]), blocks_get_block(journal_start + 1 + i), BLOCK_SIZE);
+    blocks_mark_dirty(hdr->tags[i]);
+  }
+  blocks_op_end();
+  blocks_sync(0, BLOCK_COUNT);
+  hdr->magic = 0;
+  blocks_sync(journal_start, 1);
+}
+
+void journal_init() {
+  superblock_t *sb = get_superblock();
+  enabled = sb->journal_blocks > 1;
+  if (!enabled) {
+    return;
+  }
+  journal_start = sb->journal_start;
+  capacity = sb->journal_blocks - 1;
+  if (capacity > JOURNAL_MAX_TAGS) {
+    capacity = JOURNAL_MAX_TAGS;
+  }
+
+  replay();
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&txn_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  ndirty = 0;
+  overflow = 0;
+  memset(dirty_slots, 0, sizeof(dirty_slots));
+  ncommitted = 0;
+  memset(committed_slots, 0, sizeof(committed_slots));
+  unwritten = 0;
+  nfreed = 0;
+  commit_requested = 0;
+  stopping = 0;
+  pthread_create(&committer, 0, committer_main, 0);
+}
+
+void journal_shutdown() {
+  if (!enabled) {
+    return;
+  }
+  pthread_mutex_lock(&state_lock);
+  stopping = 1;
+  pthread_cond_signal(&wake_committer);
+  pthread_mutex_unlock(&state_lock);
+  pthread_join(committer, 0);
+  pthread_rwlock_destroy(&txn_lock);
+
+  // everything is home, so there is nothing to replay
+  journal_header_t *hdr = blocks_get_block(journal_start);
+  if (unwritten && checkpoint(hdr) == 0) {
+    unwritten = 0;
+  }
+  blocks_op_begin();
+  for (int i = 0; i < ncommitted; i++) {
+    release_block(committed[i], unwritten);
+  }
+  blocks_op_end();
+  ncommitted = 0;
+  free(freed);
+  freed = 0;
+  nfreed = freed_capacity = 0;
+  hdr->magic = 0;
+  blocks_sync(journal_start, 1);
+  enabled = 0;
+}
+
+void journal_begin() {
+  if (!enabled) {
+    return;
+  }
+  for (;;) {
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&state_lock);
+    // leave room for this operation's blocks in the batch
+    if (ndirty < capacity / 2) {
+      pthread_mutex_unlock(&state_lock);
+      return;
+    }
+    long seq = running_seq;
+    pthread_rwlock_unlock(&txn_lock);
+    wait_for_commit(seq);
+    pthread_mutex_unlock(&state_lock);
+  }
+}
+
+void journal_end() {
+  if (enabled) {
+    pthread_rwlock_unlock(&txn_lock);
+  }
+}
+
+void journal_dirty(int bnum) {
+  if (!enabled) {
+    blocks_mark_dirty(bnum);
+    return;
+  }
+  pthread_mutex_lock(&state_lock);
+  int slot = find_slot(dirty_slots, bnum);
+  if (dirty_slots[slot] == 0) {
+    if (ndirty < capacity) {
+      dirty_slots[slot] = bnum + 1;
+      dirty[ndirty++] = bnum;
+      if (committed_slots[find_slot(committed_slots, bnum)] == 0) {
+        blocks_hold(bnum); // (the last commit's blocks are held already)
+      }
+    } else {
+      overflow = 1;
+      blocks_mark_dirty(bnum); // the spill writes it in place
+    }
+  }
+  pthread_mutex_unlock(&state_lock);
+}
+
+int journal_free(int bnum, int count) {
+  if (!enabled) {
+    return 0;
+  }
+  pthread_mutex_lock(&state_lock);
+  if (nfreed == freed_capacity) {
+    freed_capacity = freed_capacity ? 2 * freed_capacity : 64;
+    freed = realloc(freed, freed_capacity * sizeof(freed_run_t));
+  }
+  freed[nfreed++] = (freed_run_t){bnum, count, running_seq};
+  pthread_mutex_unlock(&state_lock);
+  return 1;
+}
+
+void journal_dirty_range(const void *ptr, int len) {
+  int first = blocks_bnum(ptr);
+  int last = blocks_bnum((const char *) ptr + len - 1);
+  for (int bnum = first; bnum <= last; bnum++) {
+    journal_dirty(bnum);
+  }
+}
+
+int journal_commit() {
+  if (!enabled) {
+    return blocks_sync(0, BLOCK_COUNT);
+  }
+  pthread_mutex_lock(&state_lock);
+  // with nothing dirty, waiting for the commit already under way is enough
+  long seq = ndirty > 0 || overflow ? running_seq : running_seq - 1;
+  int rv = wait_for_commit(seq);
+  pthread_mutex_unlock(&state_lock);
+  return rv;
+}
@@ -0,0 +1,97 @@
+/**
+ * @file journal.h
+ *
+ * A redo journal for metadata blocks.
+ *
+ * Operations that change metadata (bitmaps, inodes, extent blocks and
+ * directory blocks) run between journal_begin and journal_end and report
+ * every block they touch with journal_dirty, before they change it. The
+ * changes of many operations are grouped into one commit: a background
+ * thread copies the after-images of every dirtied block into the journal
+ * region, makes that durable with a single sync, writes the images back
+ * home and then marks the journal empty. If the image is mounted again
+ * after a crash, the commit found intact in the journal, if any, is
+ * replayed.
+ *
+ * Commits happen when the running batch reaches half the journal, when
+ * journal_commit is called (e.g. by fsync; concurrent callers share one
+ * commit), or at least every JOURNAL_COMMIT_MS while anything is dirty.
+ *
+ * Every journaled block is held (see blocks_hold) from its first change
+ * until a commit covering it is home, so neither the kernel nor the block
+ * cache writes a change before it is committed, and a crash leaves the
+ * metadata exactly as of the last commit. Blocks freed in a batch are not
+ * reused until its commit is home either, so file data written in place
+ * never lands in a block that a replayed commit still gives to another
+ * file. Only a batch too big for the journal is written in place without
+ * a commit, which a crash can leave half done.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_COMMIT_MS 1000   // longest a change waits before it is committed
+
+/**
+ * Replay the journal of the loaded image, if it holds a commit, and start
+ * the commit thread. Does nothing if the image has no journal.
+ */
+void journal_init();
+
+/**
+ * Commit everything still pending, mark the journal empty and stop the
+ * commit thread.
+ */
+void journal_shutdown();
+
+/**
+ * Start an operation that changes metadata.
+ *
+ * Must be called before taking any inode lock, since a commit waits for
+ * every operation in progress to end.
+ */
+void journal_begin();
+
+/**
+ * End an operation started with journal_begin.
+ */
+void journal_end();
+
+/**
+ * Record that a metadata block is about to change (or has, if nothing could
+ * have written it back since).
+ *
+ * @param bnum Block number.
+ */
+void journal_dirty(int bnum);
+
+/**
+ * Record that a run of blocks was freed, so that it is kept from the
+ * allocators until the commit freeing it is home (see blocks_reuse).
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return 1 if the journal keeps the run back, 0 if it may be reused now.
+ */
+int journal_free(int bnum, int count);
+
+/**
+ * Record that the metadata blocks holding a range of the image have changed.
+ *
+ * @param ptr Start of the range, a pointer into the mapped image.
+ * @param len Length of the range in bytes.
+ */
+void journal_dirty_range(const void *ptr, int len);
+
+/**
+ * Commit every operation that has ended so far and wait until the commit
+ * is durable.
+ *
+ * Must not be called between journal_begin and journal_end.
+ *
+ * @return 0 on success, -errno if writing the commit failed.
+ */
+int journal_commit();
+
+#endif
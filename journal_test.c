@@ -0,0 +1,371 @@
+/**
+ * @file journal_test.c
+ *
+ * Crash test for the metadata journal.
+ *
+ * For each backend, a child process runs a workload of creates, writes,
+ * appends, truncates, renames, unlinks and large directories on an image,
+ * and every so often writes a file under /keep, fsyncs it and reports it
+ * down a pipe. The parent kills the child at a random moment (or, in half
+ * the rounds, the child dies right after its N-th fdatasync, in the middle
+ * of a commit more often than not), then mounts the image again in another
+ * child (replaying the journal if it holds a commit) and checks that every
+ * file the workload reported is there with its contents, and that the image
+ * is consistent: the block and inode bitmaps match exactly what is reachable
+ * from the root, no block belongs to two inodes, and every inode's reference
+ * count matches the directory entries naming it.
+ *
+ * Build with the storage sources:
+ *   gcc -g -pthread -o journal_test journal_test.c $(SRCS) -lm
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "storage.h"
+
+#define TEST_NAME "journal_test.img"
+#define ROUNDS 20      // crashes per backend
+#define MAX_KILL_MS 300 // longest the workload runs before it is killed
+#define MAX_SYNCS 12    // most fdatasync calls it lives through, when counted
+#define MAX_FILES 64    // files the workload keeps in its directory
+
+static int failures = 0;
+static int syncs_left = -1; // fdatasync calls the workload lives through, -1 for any number
+
+// The storage code's fdatasync calls come here rather than to libc.
+int fdatasync(int fd) {
+  int rv = syscall(SYS_fdatasync, fd);
+  if (__atomic_load_n(&syncs_left, __ATOMIC_RELAXED) > 0 &&
+      __atomic_sub_fetch(&syncs_left, 1, __ATOMIC_RELAXED) == 0) {
+    kill(getpid(), SIGKILL);
+  }
+  return rv;
+}
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: " __VA_ARGS__);                                            \
+      putchar('\n');                                                           \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// Size and contents of the M-th kept file of round r.
+static int kept_size(int r, int m) {
+  return m % 4 == 0 ? m % 120 + 1 : (m * 7919 + r * 131) % 70000 + 1;
+}
+
+static char kept_byte(int r, int m, int i) {
+  return (char) (r * 31 + m * 17 + i);
+}
+
+static void fill_random(char *buf, int len) {
+  for (int i = 0; i < len; i++) {
+    buf[i] = (char) rand();
+  }
+}
+
+// The workload: runs until killed (or until it has lived through syncs
+// fdatasync calls, if that is positive), writing the number of each kept
+// file to out once it is durable.
+static void workload(int round, int out, int syncs) {
+  static char buf[100000];
+  char dir[32], path[64], to[80];
+  int files[MAX_FILES]; // suffixes of the files in dir, -1 if none
+  int next_name = 0, kept = 0, subdirs = 0;
+
+  srand(round * 7777 + getpid());
+  storage_init(TEST_NAME);
+  syncs_left = syncs;
+  snprintf(dir, sizeof(dir), "/r%d", round);
+  storage_mknod(dir, 040755);
+  for (int i = 0; i < MAX_FILES; i++) {
+    files[i] = -1;
+  }
+
+  for (;;) {
+    int slot = rand() % MAX_FILES;
+    snprintf(path, sizeof(path), "%s/f%d", dir, files[slot]);
+    int len = rand() % 3 == 0 ? rand() % 200 : rand() % sizeof(buf);
+    switch (rand() % 8) {
+    case 0: // create, replacing what was in the slot
+      if (files[slot] >= 0) {
+        storage_unlink(path);
+      }
+      files[slot] = next_name++;
+      snprintf(path, sizeof(path), "%s/f%d", dir, files[slot]);
+      storage_mknod(path, 0100644);
+      fill_random(buf, len);
+      storage_write(path, buf, len, 0);
+      break;
+    case 1: // append
+      if (files[slot] >= 0) {
+        struct stat st;
+        if (storage_stat(path, &st) == 0 && st.st_size < 1000000) {
+          fill_random(buf, len % 20000);
+          storage_write(path, buf, len % 20000, st.st_size);
+        }
+      }
+      break;
+    case 2: // truncate, shrinking to inline or growing a hole
+      if (files[slot] >= 0) {
+        storage_truncate(path, rand() % 3 == 0 ? rand() % 100 : rand() % 300000);
+      }
+      break;
+    case 3: // unlink
+      if (files[slot] >= 0) {
+        storage_unlink(path);
+        files[slot] = -1;
+      }
+      break;
+    case 4: // rename
+      if (files[slot] >= 0) {
+        int name = next_name++;
+        snprintf(to, sizeof(to), "%s/f%d", dir, name);
+        if (storage_rename(path, to) == 0) {
+          files[slot] = name;
+        }
+      }
+      break;
+    case 5: // a directory big enough to be hashed and split
+      if (rand() % 8 == 0) {
+        snprintf(path, sizeof(path), "%s/d%d", dir, subdirs++);
+        storage_mknod(path, 040755);
+        for (int i = 0; i < 100; i++) {
+          snprintf(to, sizeof(to), "%s/e%d", path, i);
+          storage_mknod(to, 0100644);
+        }
+      }
+      break;
+    default: // a kept file, reported once it is durable
+      snprintf(path, sizeof(path), "/keep/%d-%d", round, kept);
+      if (storage_mknod(path, 0100644) != 0) {
+        break; // out of space; the image may have room again later
+      }
+      len = kept_size(round, kept);
+      for (int i = 0; i < len; i++) {
+        buf[i] = kept_byte(round, kept, i);
+      }
+      if (storage_write(path, buf, len, 0) != len || storage_fsync(path, 0) != 0) {
+        storage_unlink(path);
+        break;
+      }
+      if (write(out, &kept, sizeof(kept)) != sizeof(kept)) {
+        _exit(1);
+      }
+      kept++;
+      break;
+    }
+  }
+}
+
+// Claim a block for an inode, checking it is in use and nobody else's.
+static void claim_block(char *seen, int bnum, int inum) {
+  superblock_t *sb = get_superblock();
+  if (bnum < (int) sb->data_start || bnum >= BLOCK_COUNT) {
+    CHECK(0, "inode %d uses block %d, outside the data region", inum, bnum);
+    return;
+  }
+  CHECK(!seen[bnum], "block %d belongs to two inodes (one is %d)", bnum, inum);
+  CHECK(bitmap_get(get_blocks_bitmap(), bnum), "inode %d uses free block %d", inum, bnum);
+  seen[bnum] = 1;
+}
+
+// Check the bitmaps and reference counts against what is reachable from the
+// root.
+static void check_image() {
+  superblock_t *sb = get_superblock();
+  char *seen = calloc(BLOCK_COUNT, 1);
+  int *links = calloc(sb->inode_count, sizeof(int));
+  char *reached = calloc(sb->inode_count, 1);
+  int *stack = malloc(sb->inode_count * sizeof(int));
+  int depth = 0;
+  CHECK(sb->block_count == BLOCK_COUNT, "the superblock counts %u blocks, the image %d",
+        sb->block_count, BLOCK_COUNT);
+
+  blocks_op_begin();
+  reached[0] = 1;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    int inum = stack[--depth];
+    inode_t *node = get_inode(inum);
+    for (int fpn = inode_next_data(node, 0); fpn >= 0; fpn = inode_next_data(node, fpn + 1)) {
+      claim_block(seen, inode_get_pnum(node, fpn), inum);
+    }
+    if (node->indirect) {
+      claim_block(seen, node->indirect, inum);
+      int *extent_blocks = blocks_get_block(node->indirect);
+      for (int i = 0; i < BLOCK_SIZE / sizeof(int) && extent_blocks[i]; i++) {
+        claim_block(seen, extent_blocks[i], inum);
+      }
+    }
+    if (!S_ISDIR(node->mode)) {
+      continue;
+    }
+    off_t pos = 0;
+    dirent_t *entry;
+    while ((entry = directory_next(node, &pos))) {
+      if (entry->inum <= 0 || entry->inum >= (int) sb->inode_count) {
+        CHECK(0, "%s in directory %d names inode %d", entry->name, inum, entry->inum);
+        continue;
+      }
+      links[entry->inum]++;
+      inode_t *child = get_inode(entry->inum);
+      CHECK(!S_ISDIR(child->mode) || child->parent == inum, "directory %d in %d has parent %d",
+            entry->inum, inum, child->parent);
+      if (!reached[entry->inum]) {
+        reached[entry->inum] = 1;
+        stack[depth++] = entry->inum;
+      }
+    }
+  }
+
+  for (int b = sb->data_start; b < BLOCK_COUNT; b++) {
+    CHECK(seen[b] || !bitmap_get(get_blocks_bitmap(), b), "block %d is used by nothing", b);
+  }
+  for (int i = 0; i < (int) sb->inode_count; i++) {
+    CHECK(reached[i] == bitmap_get(get_inode_bitmap(), i), "inode %d is %s but %s", i,
+          reached[i] ? "reachable" : "unreachable", reached[i] ? "free" : "in use");
+    CHECK(i == 0 || !reached[i] || get_inode(i)->refs == links[i],
+          "inode %d has %d references but %d links", i, get_inode(i)->refs, links[i]);
+  }
+  blocks_op_end();
+
+  free(seen);
+  free(links);
+  free(reached);
+  free(stack);
+}
+
+// Mount the image after a crash and check it; acked[r] is the number of
+// kept files round r reported.
+static void check_after_crash(int rounds, const int *acked) {
+  static char buf[100000];
+  storage_init(TEST_NAME);
+  for (int r = 0; r < rounds; r++) {
+    for (int m = 0; m < acked[r]; m++) {
+      char path[64];
+      snprintf(path, sizeof(path), "/keep/%d-%d", r, m);
+      int len = kept_size(r, m);
+      struct stat st;
+      int rv = storage_stat(path, &st);
+      CHECK(rv == 0 && st.st_size == len, "%s lost after fsync (stat %d, size %ld, want %d)",
+            path, rv, rv == 0 ? (long) st.st_size : -1L, len);
+      if (rv == 0 && storage_read(path, buf, len, 0) == len) {
+        int i = 0;
+        while (i < len && buf[i] == kept_byte(r, m, i)) {
+          i++;
+        }
+        CHECK(i == len, "%s differs at byte %d", path, i);
+      }
+    }
+  }
+  check_image();
+  storage_shutdown();
+}
+
+// Whether the journal of the image holds a commit to replay.
+static int journal_full() {
+  superblock_t sb;
+  uint32_t magic = 0;
+  int fd = open(TEST_NAME, O_RDONLY);
+  if (pread(fd, &sb, sizeof(sb), 0) == sizeof(sb)) {
+    pread(fd, &magic, sizeof(magic), (off_t) sb.journal_start * BLOCK_SIZE);
+  }
+  close(fd);
+  return magic == JOURNAL_MAGIC;
+}
+
+static int run_backend(const char *backend) {
+  int acked[ROUNDS] = {0};
+  int replays = 0;
+  int failed = 0;
+
+  unlink(TEST_NAME);
+  if (storage_format(TEST_NAME, 4 << 20, 256 << 20, 8192, -1) != 0) {
+    return 1;
+  }
+  if (fork() == 0) {
+    storage_init(TEST_NAME);
+    storage_mknod("/keep", 040755);
+    storage_shutdown();
+    _exit(0);
+  }
+  wait(0);
+
+  for (int r = 0; r < ROUNDS && !failed; r++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      return 1;
+    }
+    int syncs = r % 2 ? rand() % MAX_SYNCS + 1 : -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      workload(r, fds[1], syncs);
+    }
+    close(fds[1]);
+    // a workload that dies by itself gets ten times as long to get there
+    int ms = syncs > 0 ? 10 * MAX_KILL_MS : rand() % MAX_KILL_MS + 1;
+    struct timespec tick = {0, 1000000L};
+    int gone = 0;
+    while (ms-- > 0 && !(gone = waitpid(pid, 0, WNOHANG) == pid)) {
+      nanosleep(&tick, 0);
+    }
+    if (!gone) {
+      kill(pid, SIGKILL);
+      waitpid(pid, 0, 0);
+    }
+    int m;
+    while (read(fds[0], &m, sizeof(m)) == sizeof(m)) {
+      acked[r] = m + 1;
+    }
+    close(fds[0]);
+
+    replays += journal_full();
+    pid = fork();
+    if (pid == 0) {
+      check_after_crash(r + 1, acked);
+      _exit(failures > 0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+
+  int kept = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    kept += acked[r];
+  }
+  printf("%s: %s, %d crashes, %d replays, %d kept files\n", backend,
+         failed ? "FAILED" : "ok", ROUNDS, replays, kept);
+  unlink(TEST_NAME);
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  const char *backends[] = {"mmap", "pread", "direct"};
+  int failed = 0;
+  setvbuf(stdout, 0, _IONBF, 0);
+  srand(time(0));
+  for (int i = 0; i < 3; i++) {
+    if (blocks_set_backend(backends[i], 0) == 0) {
+      failed |= run_backend(backends[i]);
+    }
+  }
+  return failed;
+}
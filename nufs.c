@@ -1,9 +1,9 @@
 // based on cs3650 starter code
 
-#include <assert.h>
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +17,8 @@
 #include "inode.h"
 #include "storage.h"
 #include "directory.h"
+#include "stats.h"
+#include "trace.h"
 
 
 // implementation for: man 2 access
@@ -25,15 +27,13 @@ int nufs_access(const char *path, int mask) {
   int access_result = tree_lookup(path); // look up the file in the tree
 
   // Only the root directory and our simulated file are accessible for now...
-  if (access_result >= 0) {
-    inode_t* node = get_inode(access_result); // get inode if file exists
-    node->atime = time(NULL);
+  if (access_result >= 0) { // checking access is not an access, atime stays
     access_result = 0;
   } else { // ...others do not exist
     access_result = -ENOENT;
   }
 
-  printf("access(%s, %04o) -> %d\n", path, mask, access_result);
+  TRACE_S(ACCESS, path, mask, access_result);
   return access_result;
 }
 
@@ -53,55 +53,50 @@ int nufs_getattr(const char *path, struct stat *st) {
     attr_result = storage_stat(path, st); // get stats for non-root paths
     st->st_uid = getuid(); // get user id
   }
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, attr_result, st->st_mode,
-         st->st_size);
+  TRACE_S(GETATTR, path, attr_result, st->st_mode, st->st_size);
   return attr_result;
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, walking its entries once and filling
+// in each child's attributes straight from its inode. Offsets work like the
+// low-level readdir's: 1 follows ".", 2 follows "..", and 2 + pos follows the
+// entry that left directory_next at position pos, so a big directory can be
+// listed a buffer at a time.
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
-  struct stat st;
-  int dir_read_result;
-
-  dir_read_result = nufs_getattr(path, &st); // get attributes of the directory
-  assert(dir_read_result == 0);
-
-  filler(buf, ".", &st, 0); // add current directory to the buffer
-
-  slist_t* path_slist = storage_list(path); // list paths in the directory
-  if (!path_slist)
-  {
-    printf("readdir(%s) -> %d\n", path, dir_read_result);
-    return 0;
+  int inum = tree_lookup(path);
+  if (inum < 0) {
+    TRACE_S(READDIR, path, offset, inum);
+    return inum;
   }
-  slist_t* pt_slist = path_slist;
-
-  int path_len = strlen(path);
-  while (pt_slist)
-  { // loop through each path in the directory
-    char* temp_path = (char*)malloc(path_len + 50);
-    strncpy(temp_path, path, path_len);
-    // handle directory slash
-    if (path[path_len - 1]  == '/')
-      temp_path[path_len] = '\0';
-    else
-    {
-      temp_path[path_len] = '/';
-      temp_path[path_len + 1] = '\0';
+
+  struct stat st;
+  storage_stat_inum(inum, &st); // "." and ".." both get the directory's attributes
+  st.st_uid = getuid();
+  const char *dots[] = {".", ".."};
+  for (int i = offset; i < 2; i++) {
+    if (filler(buf, dots[i], &st, i + 1)) {
+      goto done;
     }
-    strncat(temp_path, pt_slist->data, DIR_NAME_LENGTH); // concatenate the directory name
-    nufs_getattr(temp_path, &st); // get attributes for each item
-    filler(buf, pt_slist->data, &st, 0); // add each item to the buffer
+  }
 
-    free(temp_path);
-    pt_slist = pt_slist->next; // go to next item
+  inode_t *dd = get_inode(inum);
+  off_t pos = offset > 2 ? offset - 2 : 0;
+  dirent_t *entry;
+  inode_read_lock(inum);
+  while ((entry = directory_next(dd, &pos))) {
+    storage_stat_inum(entry->inum, &st);
+    st.st_uid = getuid();
+    if (filler(buf, entry->name, &st, pos + 2)) {
+      break; // the kernel asks again from the last offset it got
+    }
   }
+  inode_unlock(inum);
 
-  printf("readdir(%s) -> %d\n", path, dir_read_result);
-  slist_free(path_slist);
-  return dir_read_result;
+done:
+  TRACE_S(READDIR, path, offset, 0);
+  return 0;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -110,7 +105,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
   int mknod_result = storage_mknod(path, mode); // create a new node
-  printf("mknod(%s, %04o) -> %d\n", path, mode, mknod_result);
+  TRACE_S(MKNOD, path, mode, mknod_result);
   return mknod_result;
 }
 
@@ -118,25 +113,25 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
   int mkdir_result = nufs_mknod(path, mode | 040000, 0); // create a directory
-  printf("mkdir(%s) -> %d\n", path, mkdir_result);
+  TRACE_S(MKDIR, path, mkdir_result);
   return mkdir_result;
 }
 
 int nufs_unlink(const char *path) {
   int unlink_result = storage_unlink(path); // unlink a file
-  printf("unlink(%s) -> %d\n", path, unlink_result);
+  TRACE_S(UNLINK, path, unlink_result);
   return unlink_result;
 }
 
 int nufs_link(const char *from, const char *to) {
   int link_result = storage_link(from, to); // create a hard link
-  printf("link(%s => %s) -> %d\n", from, to, link_result);
+  TRACE_S2(LINK, from, to, link_result);
   return link_result;
 }
 
 int nufs_rmdir(const char *path) {
-  int rmdir_result = -1; // rmdir not implemented yet
-  printf("rmdir(%s) -> %d\n", path, rmdir_result);
+  int rmdir_result = storage_rmdir(path);
+  TRACE_S(RMDIR, path, rmdir_result);
   return rmdir_result;
 }
 
@@ -144,57 +139,150 @@ int nufs_rmdir(const char *path) {
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
   int rename_result = storage_rename(from, to); // rename or move a file
-  storage_ctime(to); // update change time
-  printf("rename(%s => %s) -> %d\n", from, to, rename_result);
+  TRACE_S2(RENAME, from, to, rename_result);
   return rename_result;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
   int chmod_result = storage_chmod(path, mode); // change file mode
-  storage_ctime(path); // update time
-  printf("chmod(%s, %04o) -> %d\n", path, mode, chmod_result);
+  TRACE_S(CHMOD, path, mode, chmod_result);
   return chmod_result;
 }
 
 int nufs_truncate(const char *path, off_t size) {
   int truncate_result = storage_truncate(path, size); // truncate a file to a specific size
-  storage_ctime(path); // update change time
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, truncate_result);
+  TRACE_S(TRUNCATE, path, size, truncate_result);
   return truncate_result;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Resolves the file once and keeps the handle in fi->fh, so reads and
+// writes through it never look the path up again.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int open_result = 0; // check access
-  printf("open(%s) -> %d\n", path, open_result);
+  int open_result = storage_open(path);
+  if (open_result >= 0) {
+    fi->fh = open_result;
+    open_result = 0;
+  }
+  TRACE_S(OPEN, path, open_result);
   return open_result;
 }
 
-// Actually read data
+// Creates and opens a file in one step.
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  int create_result = storage_mknod(path, mode);
+  if (create_result == 0) {
+    create_result = nufs_open(path, fi);
+  }
+  TRACE_S(CREATE, path, mode, create_result);
+  return create_result;
+}
+
+// Called on every close() of a descriptor for the file.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  int flush_result = storage_flush(fi->fh);
+  TRACE_S(FLUSH, path, flush_result);
+  return flush_result;
+}
+
+// Called once the last descriptor for the file is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  int release_result = storage_release(fi->fh);
+  TRACE_S(RELEASE, path, release_result);
+  return release_result;
+}
+
+// Actually read data. This API replies after the file is unlocked, so the
+// data is copied here rather than spliced from the image as nufs_ll does.
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int read_result = storage_read(path, buf, size, offset); // read data from a file
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, read_result);
+  int read_result = storage_read_fh(fi->fh, buf, size, offset); // read data from a file
+  TRACE_S(READ, path, size, offset, read_result);
   return read_result;
 }
 
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int write_result = storage_write(path, buf, size, offset); // write data to file
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, write_result);
+  int write_result = storage_write_fh(fi->fh, buf, size, offset); // write data to file
+  TRACE_S(WRITE, path, size, offset, write_result);
   return write_result;
 }
 
+// Write data straight from FUSE's buffers (a pipe, if the kernel spliced the
+// request) to where it goes in the image file, or through a copy if the image
+// may be out of date.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(buf);
+  int fd, count;
+  off_t old_size;
+  storage_segment_t *segs;
+  int write_result =
+      storage_write_map(fi->fh, size, offset, &fd, &segs, &count, &old_size);
+  if (write_result > 0) {
+    struct fuse_bufvec *dst =
+        malloc(sizeof(*dst) + count * sizeof(struct fuse_buf));
+    *dst = FUSE_BUFVEC_INIT(0);
+    for (int i = 0; i < count; i++) {
+      dst->buf[i] = (struct fuse_buf){.size = segs[i].size,
+                                      .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                                      .fd = fd,
+                                      .pos = segs[i].pos};
+    }
+    dst->count = count;
+    ssize_t copied = fuse_buf_copy(dst, buf, 0);
+    storage_write_unmap(fi->fh, segs, old_size, offset + (copied > 0 ? copied : 0));
+    free(dst);
+    write_result = copied == 0 ? -EIO : copied;
+  } else if (write_result == 0) {
+    storage_write_unmap(fi->fh, segs, old_size, offset);
+  } else if (write_result == -EOPNOTSUPP) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = malloc(size);
+    ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+    write_result = copied < 0 ? copied
+                              : storage_write_fh(fi->fh, dst.buf[0].mem, copied, offset);
+    free(dst.buf[0].mem);
+  }
+  TRACE_S(WRITE_BUF, path, size, offset, write_result);
+  return write_result;
+}
+
+// Makes the file's data (and, unless datasync is set, metadata) durable.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  int inum = storage_fh_inum(fi->fh);
+  int fsync_result = inum < 0 ? inum : storage_fsync_inum(inum, datasync);
+  TRACE_S(FSYNC, path, datasync, fsync_result);
+  return fsync_result;
+}
+
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  int fsync_result = storage_fsync(path, datasync);
+  TRACE_S(FSYNCDIR, path, datasync, fsync_result);
+  return fsync_result;
+}
+
+// Gets the attributes of an open file, which may no longer have a name.
+int nufs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+  int inum = storage_fh_inum(fi->fh);
+  int attr_result = inum < 0 ? inum : storage_stat_inum(inum, st);
+  st->st_uid = getuid();
+  TRACE_S(FGETATTR, path, attr_result);
+  return attr_result;
+}
+
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  int inum = storage_fh_inum(fi->fh);
+  int truncate_result = inum < 0 ? inum : storage_truncate_inum(inum, size);
+  TRACE_S(FTRUNCATE, path, size, truncate_result);
+  return truncate_result;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
   int utimens_result = storage_set_time(path, ts); // set time property for file
-  storage_ctime(path); // update change time
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, utimens_result);
+  TRACE_S(UTIMENS, path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec,
+          utimens_result);
   return utimens_result;
 }
 
@@ -202,17 +290,31 @@ int nufs_utimens(const char *path, const struct timespec ts[2]) {
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
   int ioctl_result = -1; // ioctl not implemented
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, ioctl_result);
+  TRACE_S(IOCTL, path, cmd, ioctl_result);
   return ioctl_result;
 }
 
+// Asks the kernel to move data to and from the image file with splice.
+void *nufs_init(struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE |
+                                 FUSE_CAP_SPLICE_READ);
+  TRACE(INIT, conn->want);
+  return NULL;
+}
+
+// Called on unmount: commits outstanding metadata and closes the image.
+void nufs_destroy(void *private_data) {
+  storage_shutdown();
+  TRACE(DESTROY);
+}
+
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alt to mknod
+  ops->create = nufs_create;
   ops->mkdir = nufs_mkdir;
   ops->link = nufs_link;
   ops->unlink = nufs_unlink;
@@ -221,18 +323,342 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->flush = nufs_flush;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
+  ops->fsyncdir = nufs_fsyncdir;
+  ops->fgetattr = nufs_fgetattr;
+  ops->ftruncate = nufs_ftruncate;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->write_buf = nufs_write_buf;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
+// Statistics
+//
+// nufs_stats_ops wraps each operation nufs_init_ops installed in one that
+// times it (see stats.h), and serves STATS_PATH, a file in no directory:
+// reading it gives the statistics as Prometheus text, as they were when it
+// was opened, and writing "reset" to it sets them back to zero. Requests
+// for the file itself are not counted.
+
+#define STATS_PATH "/.nufs_stats"
+
+static struct fuse_operations inner; // the operations being timed
+
+// The text an open of STATS_PATH reads, kept in fi->fh.
+typedef struct stats_text {
+  char *text;
+  size_t len;
+} stats_text_t;
+
+static int is_stats(const char *path) {
+  return path && strcmp(path, STATS_PATH) == 0;
+}
+
+static void stats_file_attr(struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_mode = 0100644; // size 0: it is read with direct_io to its end
+  st->st_nlink = 1;
+  st->st_uid = getuid();
+  st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+}
+
+static int stats_file_open(struct fuse_file_info *fi) {
+  fi->direct_io = 1;
+  fi->fh = 0;
+  if ((fi->flags & O_ACCMODE) == O_WRONLY) {
+    return 0;
+  }
+  stats_text_t *snap = malloc(sizeof(stats_text_t));
+  if (!snap || !(snap->text = stats_format(&snap->len))) {
+    free(snap);
+    return -ENOMEM;
+  }
+  fi->fh = (uintptr_t) snap;
+  return 0;
+}
+
+static int stats_file_read(struct fuse_file_info *fi, char *buf, size_t size,
+                           off_t offset) {
+  stats_text_t *snap = (stats_text_t *) (uintptr_t) fi->fh;
+  if (!snap) {
+    return -EBADF;
+  }
+  if ((size_t) offset >= snap->len) {
+    return 0;
+  }
+  if (size > snap->len - offset) {
+    size = snap->len - offset;
+  }
+  memcpy(buf, snap->text + offset, size);
+  return size;
+}
+
+// "reset", with or without a newline, is the only thing it takes.
+static int stats_file_write(const char *buf, size_t size) {
+  size_t len = size > 0 && buf[size - 1] == '\n' ? size - 1 : size;
+  if (len != 5 || memcmp(buf, "reset", 5) != 0) {
+    return -EINVAL;
+  }
+  stats_reset();
+  return size;
+}
+
+static int stats_file_release(struct fuse_file_info *fi) {
+  stats_text_t *snap = (stats_text_t *) (uintptr_t) fi->fh;
+  if (snap) {
+    free(snap->text);
+    free(snap);
+  }
+  return 0;
+}
+
+// Time a call of an inner operation and return its result.
+#define TIMED(op, call, bytes)                                                 \
+  uint64_t start = stats_now();                                                \
+  int rv = (call);                                                             \
+  stats_op(STATS_##op, start, rv, rv > 0 ? (bytes) : 0);                       \
+  return rv
+
+static int timed_access(const char *path, int mask) {
+  if (is_stats(path)) {
+    return 0;
+  }
+  TIMED(ACCESS, inner.access(path, mask), 0);
+}
+
+static int timed_getattr(const char *path, struct stat *st) {
+  if (is_stats(path)) {
+    stats_file_attr(st);
+    return 0;
+  }
+  TIMED(GETATTR, inner.getattr(path, st), 0);
+}
+
+static int timed_fgetattr(const char *path, struct stat *st,
+                          struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    stats_file_attr(st);
+    return 0;
+  }
+  TIMED(FGETATTR, inner.fgetattr(path, st, fi), 0);
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi) {
+  TIMED(READDIR, inner.readdir(path, buf, filler, offset, fi), 0);
+}
+
+static int timed_mknod(const char *path, mode_t mode, dev_t rdev) {
+  if (is_stats(path)) {
+    return -EEXIST;
+  }
+  TIMED(MKNOD, inner.mknod(path, mode, rdev), 0);
+}
+
+static int timed_mkdir(const char *path, mode_t mode) {
+  if (is_stats(path)) {
+    return -EEXIST;
+  }
+  TIMED(MKDIR, inner.mkdir(path, mode), 0);
+}
+
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return -EEXIST;
+  }
+  TIMED(CREATE, inner.create(path, mode, fi), 0);
+}
+
+static int timed_unlink(const char *path) {
+  if (is_stats(path)) {
+    return -EPERM;
+  }
+  TIMED(UNLINK, inner.unlink(path), 0);
+}
+
+static int timed_rmdir(const char *path) {
+  if (is_stats(path)) {
+    return -ENOTDIR;
+  }
+  TIMED(RMDIR, inner.rmdir(path), 0);
+}
+
+static int timed_link(const char *from, const char *to) {
+  if (is_stats(from) || is_stats(to)) {
+    return -EPERM;
+  }
+  TIMED(LINK, inner.link(from, to), 0);
+}
+
+static int timed_rename(const char *from, const char *to) {
+  if (is_stats(from) || is_stats(to)) {
+    return -EPERM;
+  }
+  TIMED(RENAME, inner.rename(from, to), 0);
+}
+
+static int timed_chmod(const char *path, mode_t mode) {
+  if (is_stats(path)) {
+    return -EPERM;
+  }
+  TIMED(CHMOD, inner.chmod(path, mode), 0);
+}
+
+// Truncating the stats file (as `echo reset >` does) changes nothing.
+static int timed_truncate(const char *path, off_t size) {
+  if (is_stats(path)) {
+    return 0;
+  }
+  TIMED(TRUNCATE, inner.truncate(path, size), 0);
+}
+
+static int timed_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return 0;
+  }
+  TIMED(FTRUNCATE, inner.ftruncate(path, size, fi), 0);
+}
+
+static int timed_utimens(const char *path, const struct timespec ts[2]) {
+  if (is_stats(path)) {
+    return -EPERM;
+  }
+  TIMED(UTIMENS, inner.utimens(path, ts), 0);
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return stats_file_open(fi);
+  }
+  TIMED(OPEN, inner.open(path, fi), 0);
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return 0;
+  }
+  TIMED(FLUSH, inner.flush(path, fi), 0);
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return stats_file_release(fi);
+  }
+  TIMED(RELEASE, inner.release(path, fi), 0);
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return 0;
+  }
+  TIMED(FSYNC, inner.fsync(path, datasync, fi), 0);
+}
+
+static int timed_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  TIMED(FSYNCDIR, inner.fsyncdir(path, datasync, fi), 0);
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return stats_file_read(fi, buf, size, offset);
+  }
+  TIMED(READ, inner.read(path, buf, size, offset, fi), rv);
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    return stats_file_write(buf, size);
+  }
+  TIMED(WRITE, inner.write(path, buf, size, offset, fi), rv);
+}
+
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                           struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    char cmd[16];
+    size_t size = fuse_buf_size(buf);
+    if (size > sizeof(cmd)) {
+      return -EINVAL;
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = cmd;
+    ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+    return copied < 0 ? copied : stats_file_write(cmd, copied);
+  }
+  TIMED(WRITE_BUF, inner.write_buf(path, buf, offset, fi), rv);
+}
+
+static int timed_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                       unsigned int flags, void *data) {
+  TIMED(IOCTL, inner.ioctl(path, cmd, arg, fi, flags, data), 0);
+}
+
+static void *timed_init(struct fuse_conn_info *conn) {
+  uint64_t start = stats_now();
+  void *rv = inner.init(conn);
+  stats_op(STATS_INIT, start, 0, 0);
+  return rv;
+}
+
+static void timed_destroy(void *private_data) {
+  uint64_t start = stats_now();
+  inner.destroy(private_data);
+  stats_op(STATS_DESTROY, start, 0, 0);
+}
+
+#undef TIMED
+
+// Wrap each installed operation in one that times it.
+void nufs_stats_ops(struct fuse_operations *ops) {
+  inner = *ops;
+#define WRAP(name)                                                             \
+  if (ops->name) {                                                             \
+    ops->name = timed_##name;                                                  \
+  }
+  WRAP(access);
+  WRAP(getattr);
+  WRAP(fgetattr);
+  WRAP(readdir);
+  WRAP(mknod);
+  WRAP(mkdir);
+  WRAP(create);
+  WRAP(unlink);
+  WRAP(rmdir);
+  WRAP(link);
+  WRAP(rename);
+  WRAP(chmod);
+  WRAP(truncate);
+  WRAP(ftruncate);
+  WRAP(utimens);
+  WRAP(open);
+  WRAP(flush);
+  WRAP(release);
+  WRAP(fsync);
+  WRAP(fsyncdir);
+  WRAP(read);
+  WRAP(write);
+  WRAP(write_buf);
+  WRAP(ioctl);
+  WRAP(init);
+  WRAP(destroy);
+#undef WRAP
+}
+
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
-  printf("TODO: mount %s as data file\n", argv[argc - 1]);
-  storage_init(argv[--argc]);
+  if (!storage_setup(&argc, argv)) {
+    return 1;
+  }
   nufs_init_ops(&nufs_ops);
+  nufs_stats_ops(&nufs_ops);
   return fuse_main(argc, argv, &nufs_ops, NULL);
 }
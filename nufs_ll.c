@@ -0,0 +1,423 @@
+// based on cs3650 starter code
+//
+// Low-level (inode-based) front end. The kernel addresses files by the inode
+// numbers handed out by lookup, so no request here resolves a path; the
+// kernel caches dentries and attributes for ENTRY_TIMEOUT/ATTR_TIMEOUT.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "storage.h"
+#include "trace.h"
+
+#define ENTRY_TIMEOUT 1.0 // seconds the kernel may cache a name
+#define ATTR_TIMEOUT 1.0  // seconds the kernel may cache attributes
+
+// Our inode numbers start at 0 for the root, FUSE's root is FUSE_ROOT_ID.
+#define TO_INUM(ino) ((int) (ino) - FUSE_ROOT_ID)
+#define TO_INO(inum) ((fuse_ino_t) (inum) + FUSE_ROOT_ID)
+
+// Fills in the attributes of an inode as the kernel sees them.
+static void fill_attr(int inum, struct stat *st) {
+  storage_stat_inum(inum, st);
+  st->st_ino = TO_INO(inum);
+  st->st_uid = getuid(); // get user id
+}
+
+// Fills in a directory entry reply for an inode.
+static void fill_entry(int inum, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = TO_INO(inum);
+  e->attr_timeout = ATTR_TIMEOUT;
+  e->entry_timeout = ENTRY_TIMEOUT;
+  fill_attr(inum, &e->attr);
+}
+
+// Replies with the entry for a new inode, or with the error it carries.
+static void reply_new_entry(fuse_req_t req, int inum) {
+  if (inum < 0) {
+    fuse_reply_err(req, -inum);
+    return;
+  }
+  struct fuse_entry_param e;
+  fill_entry(inum, &e);
+  fuse_reply_entry(req, &e);
+}
+
+// Looks up a name in a directory.
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int inum = storage_lookup_at(TO_INUM(parent), name);
+  TRACE_S(LL_LOOKUP, name, parent, inum);
+  reply_new_entry(req, inum);
+}
+
+// Inodes live until their last link goes away, so lookups need no counting.
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct stat st;
+  fill_attr(TO_INUM(ino), &st);
+  TRACE(LL_GETATTR, ino, st.st_mode, st.st_size);
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+// Implements chmod, truncate and utimens in one request.
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  int inum = TO_INUM(ino);
+  int rv = 0;
+
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    rv = storage_chmod_inum(inum, attr->st_mode);
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    rv = storage_truncate_inum(inum, attr->st_size);
+  }
+  if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    struct timespec ts[2] = {attr->st_atim, attr->st_mtim};
+    if (!(to_set & FUSE_SET_ATTR_ATIME)) {
+      ts[0].tv_nsec = UTIME_OMIT;
+    } else if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+      ts[0].tv_nsec = UTIME_NOW;
+    }
+    if (!(to_set & FUSE_SET_ATTR_MTIME)) {
+      ts[1].tv_nsec = UTIME_OMIT;
+    } else if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+      ts[1].tv_nsec = UTIME_NOW;
+    }
+    rv = storage_set_time_inum(inum, ts);
+  }
+
+  TRACE(LL_SETATTR, ino, to_set, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  struct stat st;
+  fill_attr(inum, &st);
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  int inum = storage_mknod_at(TO_INUM(parent), name, mode);
+  TRACE_S(LL_MKNOD, name, parent, mode, inum);
+  reply_new_entry(req, inum);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+  int inum = storage_mknod_at(TO_INUM(parent), name, mode | 040000);
+  TRACE_S(LL_MKDIR, name, parent, inum);
+  reply_new_entry(req, inum);
+}
+
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi) {
+  int inum = storage_mknod_at(TO_INUM(parent), name, mode);
+  int fh = inum < 0 ? inum : storage_open_inum(inum);
+  TRACE_S(LL_CREATE, name, parent, mode, inum);
+  if (fh < 0) {
+    fuse_reply_err(req, -fh);
+    return;
+  }
+  fi->fh = fh;
+  struct fuse_entry_param e;
+  fill_entry(inum, &e);
+  fuse_reply_create(req, &e, fi);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_unlink_at(TO_INUM(parent), name);
+  TRACE_S(LL_UNLINK, name, parent, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_rmdir_at(TO_INUM(parent), name);
+  TRACE_S(LL_RMDIR, name, parent, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+  int rv = storage_rename_at(TO_INUM(parent), name, TO_INUM(newparent), newname);
+  TRACE_S2(LL_RENAME, name, newname, parent, newparent, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+  int rv = storage_link_at(TO_INUM(ino), TO_INUM(newparent), newname);
+  TRACE_S(LL_LINK, newname, ino, newparent, rv);
+  reply_new_entry(req, rv < 0 ? rv : TO_INUM(ino));
+}
+
+// Opens keep the inode alive, even if it is unlinked, until release.
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  int fh = storage_open_inum(TO_INUM(ino));
+  TRACE(LL_OPEN, ino, fh);
+  if (fh < 0) {
+    fuse_reply_err(req, -fh);
+    return;
+  }
+  fi->fh = fh;
+  fuse_reply_open(req, fi);
+}
+
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  int rv = storage_flush(fi->fh);
+  TRACE(LL_FLUSH, ino, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// fsync and fsyncdir only need the inode: dirty blocks and metadata are
+// tracked per inode, not per handle.
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  int rv = storage_fsync_inum(TO_INUM(ino), datasync);
+  TRACE(LL_FSYNC, ino, datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  int rv = storage_release(fi->fh);
+  TRACE(LL_RELEASE, ino, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Replies with ranges of the image file, which FUSE splices to the kernel
+// with the file still locked, or with a copy if the image may be out of date.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi) {
+  int fd, count;
+  storage_segment_t *segs;
+  int rv = storage_read_map(fi->fh, size, off, &fd, &segs, &count);
+  if (rv >= 0) {
+    TRACE(LL_READ_SPLICE, ino, size, off, rv, count);
+    struct fuse_bufvec *bufv =
+        malloc(sizeof(*bufv) + count * sizeof(struct fuse_buf));
+    *bufv = FUSE_BUFVEC_INIT(0);
+    for (int i = 0; i < count; i++) {
+      bufv->buf[i] = (struct fuse_buf){.size = segs[i].size,
+                                       .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                                       .fd = fd,
+                                       .pos = segs[i].pos};
+    }
+    bufv->count = count > 0 ? count : 1;
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    storage_read_unmap(fi->fh, segs);
+    free(bufv);
+    return;
+  }
+
+  char *buf = malloc(size);
+  if (rv == -EOPNOTSUPP) {
+    rv = storage_read_fh(fi->fh, buf, size, off);
+  }
+  TRACE(LL_READ, ino, size, off, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_buf(req, buf, rv);
+  }
+  free(buf);
+}
+
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi) {
+  int rv = storage_write_fh(fi->fh, buf, size, off);
+  TRACE(LL_WRITE, ino, size, off, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// Writes data straight from FUSE's buffers (a pipe, if the kernel spliced
+// the request) to where it goes in the image file, or through a copy if the
+// image may be out of date.
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec *bufv, off_t off,
+                              struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(bufv);
+  int fd, count;
+  off_t old_size;
+  storage_segment_t *segs;
+  int rv = storage_write_map(fi->fh, size, off, &fd, &segs, &count, &old_size);
+  if (rv > 0) {
+    struct fuse_bufvec *dst =
+        malloc(sizeof(*dst) + count * sizeof(struct fuse_buf));
+    *dst = FUSE_BUFVEC_INIT(0);
+    for (int i = 0; i < count; i++) {
+      dst->buf[i] = (struct fuse_buf){.size = segs[i].size,
+                                      .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                                      .fd = fd,
+                                      .pos = segs[i].pos};
+    }
+    dst->count = count;
+    ssize_t copied = fuse_buf_copy(dst, bufv, 0);
+    storage_write_unmap(fi->fh, segs, old_size, off + (copied > 0 ? copied : 0));
+    free(dst);
+    rv = copied == 0 ? -EIO : copied;
+  } else if (rv == 0) {
+    storage_write_unmap(fi->fh, segs, old_size, off);
+  } else if (rv == -EOPNOTSUPP) {
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    mem.buf[0].mem = malloc(size);
+    ssize_t copied = fuse_buf_copy(&mem, bufv, 0);
+    rv = copied < 0 ? copied : storage_write_fh(fi->fh, mem.buf[0].mem, copied, off);
+    free(mem.buf[0].mem);
+  }
+  TRACE(LL_WRITE_BUF, ino, size, off, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// Lists a directory, with attributes for every entry if plus is set.
+// Offset 1 follows ".", offset 2 follows "..", and offset 2 + pos follows the
+// entry that left directory_next at position pos.
+static void readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, int plus) {
+  inode_t *dd = get_inode(TO_INUM(ino));
+  char *buf = malloc(size);
+  size_t used = 0;
+
+  struct fuse_entry_param e;
+  fill_entry(TO_INUM(ino), &e);
+  const char *dots[] = {".", ".."};
+  for (int i = off; i < 2; i++) {
+    size_t need = plus ? fuse_add_direntry_plus(req, buf + used, size - used, dots[i], &e, i + 1)
+                       : fuse_add_direntry(req, buf + used, size - used, dots[i], &e.attr, i + 1);
+    if (need > size - used) {
+      goto reply;
+    }
+    used += need;
+  }
+
+  off_t pos = off > 2 ? off - 2 : 0;
+  dirent_t *entry;
+  inode_read_lock(TO_INUM(ino));
+  while ((entry = directory_next(dd, &pos))) {
+    fill_entry(entry->inum, &e);
+    size_t need = plus ? fuse_add_direntry_plus(req, buf + used, size - used, entry->name, &e, pos + 2)
+                       : fuse_add_direntry(req, buf + used, size - used, entry->name, &e.attr, pos + 2);
+    if (need > size - used) {
+      break;
+    }
+    used += need;
+  }
+  inode_unlock(TO_INUM(ino));
+
+reply:
+  if (plus) {
+    TRACE(LL_READDIRPLUS, ino, off, used);
+  } else {
+    TRACE(LL_READDIR, ino, off, used);
+  }
+  fuse_reply_buf(req, buf, used);
+  free(buf);
+}
+
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+  readdir_common(req, ino, size, off, 0);
+}
+
+static void nufs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t off, struct fuse_file_info *fi) {
+  readdir_common(req, ino, size, off, 1);
+}
+
+// Asks the kernel to move data to and from the image file with splice.
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE |
+                                 FUSE_CAP_SPLICE_READ);
+  TRACE(INIT, conn->want);
+}
+
+// Commits outstanding metadata and closes the image on unmount.
+static void nufs_ll_destroy(void *userdata) {
+  storage_shutdown();
+  TRACE(DESTROY);
+}
+
+static struct fuse_lowlevel_ops nufs_ll_ops = {
+    .lookup = nufs_ll_lookup,
+    .forget = nufs_ll_forget,
+    .getattr = nufs_ll_getattr,
+    .setattr = nufs_ll_setattr,
+    .mknod = nufs_ll_mknod,
+    .mkdir = nufs_ll_mkdir,
+    .create = nufs_ll_create,
+    .unlink = nufs_ll_unlink,
+    .rmdir = nufs_ll_rmdir,
+    .rename = nufs_ll_rename,
+    .link = nufs_ll_link,
+    .open = nufs_ll_open,
+    .flush = nufs_ll_flush,
+    .release = nufs_ll_release,
+    .fsync = nufs_ll_fsync,
+    .fsyncdir = nufs_ll_fsync,
+    .read = nufs_ll_read,
+    .write = nufs_ll_write,
+    .write_buf = nufs_ll_write_buf,
+    .readdir = nufs_ll_readdir,
+    .readdirplus = nufs_ll_readdirplus,
+    .init = nufs_ll_init,
+    .destroy = nufs_ll_destroy,
+};
+
+int main(int argc, char *argv[]) {
+  if (!storage_setup(&argc, argv)) {
+    return 1;
+  }
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint;
+  int multithreaded;
+  int foreground;
+  int err = -1;
+
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch) {
+      struct fuse_session *se =
+          fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+      if (se) {
+        if (fuse_set_signal_handlers(se) != -1) {
+          fuse_session_add_chan(se, ch);
+          fuse_daemonize(foreground);
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+          fuse_remove_signal_handlers(se);
+          fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se);
+      }
+      fuse_unmount(mountpoint, ch);
+    }
+  }
+
+  fuse_opt_free_args(&args);
+  return err ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file openfile.c
+ *
+ * Implementation of the open file table.
+ */
+#include <errno.h>
+#include <pthread.h>
+
+#include "openfile.h"
+
+static open_file_t files[OPEN_FILES_MAX];
+static char in_use[OPEN_FILES_MAX];
+static int free_slots[OPEN_FILES_MAX]; // stack of released slots
+static int nfree = 0;
+static int high = 0; // slots at or past this index have never been used
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int openfile_alloc(int inum) {
+  pthread_mutex_lock(&table_lock);
+  int fh = -ENFILE;
+  if (nfree > 0) {
+    fh = free_slots[--nfree];
+  } else if (high < OPEN_FILES_MAX) {
+    fh = high++;
+  }
+  if (fh >= 0) {
+    files[fh].inum = inum;
+    files[fh].cursor = 0;
+    files[fh].ra_next = 0;
+    files[fh].ra_window = 0;
+    in_use[fh] = 1;
+  }
+  pthread_mutex_unlock(&table_lock);
+  return fh;
+}
+
+open_file_t *openfile_get(uint64_t fh) {
+  // the kernel only hands back handles we gave it, so no lock is needed to
+  // read a slot that is in use
+  if (fh >= OPEN_FILES_MAX || !in_use[fh]) {
+    return 0;
+  }
+  return &files[fh];
+}
+
+void openfile_free(uint64_t fh) {
+  pthread_mutex_lock(&table_lock);
+  if (fh < OPEN_FILES_MAX && in_use[fh]) {
+    in_use[fh] = 0;
+    free_slots[nfree++] = fh;
+  }
+  pthread_mutex_unlock(&table_lock);
+}
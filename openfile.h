@@ -0,0 +1,51 @@
+/**
+ * @file openfile.h
+ *
+ * The table of open files.
+ *
+ * A file is resolved once when it is opened, and the index of its slot in
+ * this table becomes the FUSE file handle. Reads and writes through the
+ * handle go straight to the inode, starting their block map search from the
+ * extent the previous access on the handle ended in. The slot also tracks
+ * whether the handle is being read sequentially, to size its readahead.
+ */
+#ifndef OPENFILE_H
+#define OPENFILE_H
+
+#include <stdint.h>
+
+#define OPEN_FILES_MAX 16384 // handles that can be open at once
+
+typedef struct open_file {
+  int inum;      // inode the handle refers to
+  int cursor;    // extent the last access ended in, where the next one looks first
+  long ra_next;  // offset a sequential read through the handle starts at next
+  int ra_window; // blocks the last read fetched beyond what it asked for
+} open_file_t;
+
+/**
+ * Take a free slot for a newly opened inode.
+ *
+ * @param inum Inode number being opened.
+ *
+ * @return The new handle, or -ENFILE if every slot is taken.
+ */
+int openfile_alloc(int inum);
+
+/**
+ * Get the slot behind a handle.
+ *
+ * @param fh Handle returned by openfile_alloc.
+ *
+ * @return The slot, or NULL if the handle is not open.
+ */
+open_file_t *openfile_get(uint64_t fh);
+
+/**
+ * Give a slot back.
+ *
+ * @param fh Handle returned by openfile_alloc.
+ */
+void openfile_free(uint64_t fh);
+
+#endif
@@ -0,0 +1,53 @@
+/**
+ * @file path.c
+ *
+ * Allocation-free path parsing.
+ */
+#include <string.h>
+
+#include "path.h"
+
+void path_iter_init(path_iter_t *it, const char *path, int len) {
+  it->next = path;
+  it->end = path + len;
+  it->name = path;
+  it->len = 0;
+}
+
+int path_next(path_iter_t *it) {
+  const char *p = it->next;
+  while (p < it->end && *p == '/') {
+    p++;
+  }
+  if (p == it->end) {
+    return 0;
+  }
+
+  const char *slash = memchr(p, '/', it->end - p);
+  const char *stop = slash ? slash : it->end;
+  it->name = p;
+  it->len = stop - p;
+  it->next = stop;
+  return 1;
+}
+
+int path_split(const char *path, const char **name, int *len) {
+  int end = strlen(path);
+  while (end > 0 && path[end - 1] == '/') {
+    end--;
+  }
+
+  int start = end;
+  while (start > 0 && path[start - 1] != '/') {
+    start--;
+  }
+
+  *name = path + start;
+  *len = end - start;
+
+  // the parent prefix does not include the slashes before the name
+  while (start > 0 && path[start - 1] == '/') {
+    start--;
+  }
+  return start;
+}
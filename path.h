@@ -0,0 +1,52 @@
+/**
+ * @file path.h
+ *
+ * Allocation-free path parsing.
+ *
+ * Components are returned as (pointer, length) spans into the original path
+ * string, so walking a path never touches the heap. Empty components (from
+ * leading, trailing or repeated slashes) are skipped.
+ */
+#ifndef PATH_H
+#define PATH_H
+
+typedef struct path_iter {
+  const char *next; // where the search for the next component starts
+  const char *end;  // one past the last character of the path
+  const char *name; // current component (not NUL-terminated)
+  int len;          // length of the current component
+} path_iter_t;
+
+/**
+ * Start iterating over the first len characters of a path.
+ *
+ * @param it Iterator to initialize.
+ * @param path Path to walk.
+ * @param len Number of characters of path to consider.
+ */
+void path_iter_init(path_iter_t *it, const char *path, int len);
+
+/**
+ * Advance to the next component.
+ *
+ * @param it Iterator.
+ *
+ * @return 1 if it->name/it->len now hold a component, 0 at the end.
+ */
+int path_next(path_iter_t *it);
+
+/**
+ * Split a path into its parent directory and final component.
+ *
+ * For "/a/b/c" the parent is the first 4 characters ("/a/b") and the name
+ * is "c". Trailing slashes are ignored.
+ *
+ * @param path Path to split.
+ * @param name Set to the start of the final component.
+ * @param len Set to the length of the final component (0 for the root).
+ *
+ * @return The length of the parent prefix of path.
+ */
+int path_split(const char *path, const char **name, int *len);
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * @file path_bench.c
+ *
+ * Microbenchmark: walking path components with slist_explode versus the
+ * allocation-free path iterator.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "path.h"
+#include "slist.h"
+
+#define ROUNDS 1000000
+
+static const char *paths[] = {
+    "/",
+    "/one.txt",
+    "/foo/bar/baz",
+    "/build/obj/src/fs/storage/blocks/bitmap.o",
+    "/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p",
+};
+#define NPATHS (sizeof(paths) / sizeof(paths[0]))
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Walk every component with slist_explode, summing their lengths.
+static long walk_slist(const char *path) {
+  long total = 0;
+  slist_t *parts = slist_explode(path, '/');
+  for (slist_t *xs = parts; xs; xs = xs->next) {
+    total += strlen(xs->data);
+  }
+  slist_free(parts);
+  return total;
+}
+
+// Walk every component with the path iterator, summing their lengths.
+static long walk_iter(const char *path) {
+  long total = 0;
+  path_iter_t it;
+  path_iter_init(&it, path, strlen(path));
+  while (path_next(&it)) {
+    total += it.len;
+  }
+  return total;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : ROUNDS;
+
+  for (int p = 0; p < NPATHS; p++) {
+    long check_slist = 0, check_iter = 0;
+
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+      check_slist += walk_slist(paths[p]);
+    }
+    double slist_ns = (now() - start) * 1e9 / rounds;
+
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+      check_iter += walk_iter(paths[p]);
+    }
+    double iter_ns = (now() - start) * 1e9 / rounds;
+
+    printf("%-45s slist %8.1f ns  iter %6.1f ns  (%.1fx)%s\n", paths[p],
+           slist_ns, iter_ns, slist_ns / iter_ns,
+           check_slist == check_iter ? "" : "  MISMATCH");
+  }
+
+  return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file stats.c
+ *
+ * Counters and log-bucketed histograms (see stats.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define SUB_COUNT (1 << STATS_SUB_BITS)
+
+typedef struct stats_hist {
+  uint64_t count; // only in snapshots, where it is the sum of the buckets
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+// one per operation, on cache lines of its own so that threads running
+// different operations do not fight over them
+typedef struct op_stats {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  stats_hist_t latency; // nanoseconds
+} __attribute__((aligned(64))) op_stats_t;
+
+static op_stats_t ops[STATS_OP_COUNT];
+static uint64_t counters[STATS_COUNTER_COUNT];
+static stats_hist_t dists[STATS_DIST_COUNT];
+
+#define STATS_LABEL(name, label) label,
+static const char *op_labels[] = {STATS_OPS(STATS_LABEL)};
+#undef STATS_LABEL
+#define STATS_METRIC(name, metric, help) {metric, help},
+static const char *counter_names[][2] = {STATS_COUNTERS(STATS_METRIC)};
+static const char *dist_names[][2] = {STATS_DISTS(STATS_METRIC)};
+#undef STATS_METRIC
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define QUANTILE_COUNT (sizeof(quantiles) / sizeof(quantiles[0]))
+
+// Values below 2 * SUB_COUNT get a bucket each; above, a value whose top
+// bit is b goes in one of the SUB_COUNT buckets of [2^b, 2^(b+1)), picked
+// by the STATS_SUB_BITS bits below the top one.
+static int bucket_of(uint64_t value) {
+  if (value < 2 * SUB_COUNT) {
+    return value;
+  }
+  int top = 63 - __builtin_clzll(value);
+  int shift = top - STATS_SUB_BITS;
+  return ((shift + 1) << STATS_SUB_BITS) + (int) ((value >> shift) & (SUB_COUNT - 1));
+}
+
+// The largest value that lands in a bucket.
+static uint64_t bucket_high(int bucket) {
+  if (bucket < 2 * SUB_COUNT) {
+    return bucket;
+  }
+  int shift = (bucket >> STATS_SUB_BITS) - 1;
+  uint64_t low = (uint64_t) (SUB_COUNT + (bucket & (SUB_COUNT - 1))) << shift;
+  return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static void hist_add(stats_hist_t *hist, uint64_t value) {
+  __atomic_add_fetch(&hist->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->sum, value, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, 1,
+                                                     __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED)) {
+  }
+}
+
+// Copy a histogram that may be changing.
+static void hist_snapshot(stats_hist_t *hist, stats_hist_t *copy) {
+  copy->count = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    copy->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    copy->count += copy->buckets[i];
+  }
+  copy->sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+  copy->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+// The value at or below which a fraction q of a snapshot's values lie, to
+// within its bucket (and never above the largest value seen).
+static uint64_t hist_quantile(const stats_hist_t *hist, double q) {
+  uint64_t rank = (uint64_t) (q * hist->count);
+  if (rank < hist->count) {
+    rank++;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t high = bucket_high(i);
+      return high < hist->max ? high : hist->max;
+    }
+  }
+  return 0;
+}
+
+static void hist_clear(stats_hist_t *hist) {
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    __atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&hist->sum, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_op(stats_op_t op, uint64_t start, int result, uint64_t bytes) {
+  op_stats_t *s = &ops[op];
+  __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+  if (result < 0) {
+    __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+  }
+  if (bytes > 0) {
+    __atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+  }
+  hist_add(&s->latency, stats_now() - start);
+}
+
+void stats_count(stats_counter_t counter, uint64_t n) {
+  __atomic_add_fetch(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_record(stats_dist_t dist, uint64_t value) {
+  hist_add(&dists[dist], value);
+}
+
+// Print a snapshot as the lines of a summary; scale converts its values to
+// the metric's unit and labels, if any, go before the quantile.
+static void print_summary(FILE *out, const char *metric, const char *labels,
+                          const stats_hist_t *hist, double scale) {
+  const char *sep = *labels ? "," : "";
+  for (size_t i = 0; i < QUANTILE_COUNT; i++) {
+    fprintf(out, "%s{%s%squantile=\"%g\"} %.9g\n", metric, labels, sep,
+            quantiles[i], hist_quantile(hist, quantiles[i]) * scale);
+  }
+  const char *open = *labels ? "{" : "";
+  const char *close = *labels ? "}" : "";
+  fprintf(out, "%s_sum%s%s%s %.9g\n", metric, open, labels, close,
+          hist->sum * scale);
+  fprintf(out, "%s_count%s%s%s %lu\n", metric, open, labels, close,
+          (unsigned long) hist->count);
+}
+
+char *stats_format(size_t *len) {
+  char *text = 0;
+  FILE *out = open_memstream(&text, len);
+  if (!out) {
+    return 0;
+  }
+
+  // calls, errors and bytes of each operation
+  static const char *op_counters[][2] = {
+      {"nufs_op_calls_total", "FUSE operations handled."},
+      {"nufs_op_errors_total", "FUSE operations that returned an error."},
+      {"nufs_op_bytes_total", "Bytes read or written by FUSE operations."},
+  };
+  for (int c = 0; c < 3; c++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", op_counters[c][0],
+            op_counters[c][1], op_counters[c][0]);
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+      uint64_t *values[] = {&ops[op].calls, &ops[op].errors, &ops[op].bytes};
+      fprintf(out, "%s{op=\"%s\"} %lu\n", op_counters[c][0], op_labels[op],
+              (unsigned long) __atomic_load_n(values[c], __ATOMIC_RELAXED));
+    }
+  }
+
+  stats_hist_t *copy = malloc(sizeof(stats_hist_t));
+  if (!copy) {
+    fclose(out);
+    free(text);
+    return 0;
+  }
+  fprintf(out, "# HELP nufs_op_latency_seconds Time taken by FUSE operations.\n"
+               "# TYPE nufs_op_latency_seconds summary\n");
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    char labels[32];
+    snprintf(labels, sizeof(labels), "op=\"%s\"", op_labels[op]);
+    hist_snapshot(&ops[op].latency, copy);
+    print_summary(out, "nufs_op_latency_seconds", labels, copy, 1e-9);
+  }
+
+  for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_names[c][0],
+            counter_names[c][1], counter_names[c][0], counter_names[c][0],
+            (unsigned long) __atomic_load_n(&counters[c], __ATOMIC_RELAXED));
+  }
+
+  for (int d = 0; d < STATS_DIST_COUNT; d++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", dist_names[d][0],
+            dist_names[d][1], dist_names[d][0]);
+    hist_snapshot(&dists[d], copy);
+    print_summary(out, dist_names[d][0], "", copy, 1);
+  }
+  free(copy);
+
+  if (fclose(out) != 0) {
+    free(text);
+    return 0;
+  }
+  return text;
+}
+
+void stats_reset() {
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    __atomic_store_n(&ops[op].calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ops[op].errors, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ops[op].bytes, 0, __ATOMIC_RELAXED);
+    hist_clear(&ops[op].latency);
+  }
+  for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+    __atomic_store_n(&counters[c], 0, __ATOMIC_RELAXED);
+  }
+  for (int d = 0; d < STATS_DIST_COUNT; d++) {
+    hist_clear(&dists[d]);
+  }
+}
@@ -0,0 +1,134 @@
+/**
+ * @file stats.h
+ *
+ * Counters and latency histograms for finding out where nufs spends its
+ * time, served as Prometheus text from the high-level front end's
+ * /.nufs_stats file.
+ *
+ * Each FUSE operation counts its calls, errors and bytes moved and keeps a
+ * histogram of its latency; the storage layers count allocations and keep
+ * histograms of how far they had to search. A histogram has a bucket for
+ * each value below 2^(STATS_SUB_BITS + 1) and, above that, 2^STATS_SUB_BITS
+ * buckets per power of two (as HdrHistogram does), so any value lands in a
+ * bucket no more than 1/2^STATS_SUB_BITS as wide as itself. Recording is a
+ * few relaxed atomic adds; nothing takes a lock.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_SUB_BITS 3 // sub-buckets per power of two: 2^3 = 8, so within 12.5%
+#define STATS_BUCKETS ((65 - STATS_SUB_BITS) << STATS_SUB_BITS)
+
+// name, label
+#define STATS_OPS(X)                                                           \
+  X(INIT, "init")                                                              \
+  X(DESTROY, "destroy")                                                        \
+  X(ACCESS, "access")                                                          \
+  X(GETATTR, "getattr")                                                        \
+  X(FGETATTR, "fgetattr")                                                      \
+  X(READDIR, "readdir")                                                        \
+  X(MKNOD, "mknod")                                                            \
+  X(MKDIR, "mkdir")                                                            \
+  X(CREATE, "create")                                                          \
+  X(UNLINK, "unlink")                                                          \
+  X(RMDIR, "rmdir")                                                            \
+  X(LINK, "link")                                                              \
+  X(RENAME, "rename")                                                          \
+  X(CHMOD, "chmod")                                                            \
+  X(TRUNCATE, "truncate")                                                      \
+  X(FTRUNCATE, "ftruncate")                                                    \
+  X(UTIMENS, "utimens")                                                        \
+  X(OPEN, "open")                                                              \
+  X(FLUSH, "flush")                                                            \
+  X(RELEASE, "release")                                                        \
+  X(FSYNC, "fsync")                                                            \
+  X(FSYNCDIR, "fsyncdir")                                                      \
+  X(READ, "read")                                                              \
+  X(WRITE, "write")                                                            \
+  X(WRITE_BUF, "write_buf")                                                    \
+  X(IOCTL, "ioctl")
+
+// name, metric, help
+#define STATS_COUNTERS(X)                                                      \
+  X(BLOCK_ALLOCS, "nufs_block_allocs_total",                                   \
+    "Calls of alloc_block and alloc_blocks that found space.")                 \
+  X(BLOCKS_ALLOCATED, "nufs_blocks_allocated_total", "Blocks allocated.")      \
+  X(BLOCKS_FREED, "nufs_blocks_freed_total", "Blocks freed.")                  \
+  X(IMAGE_GROWS, "nufs_image_grows_total", "Times the image file was grown.")  \
+  X(INODES_ALLOCATED, "nufs_inodes_allocated_total", "Inodes allocated.")      \
+  X(INODES_FREED, "nufs_inodes_freed_total", "Inodes freed.")                  \
+  X(PATH_CACHE_HITS, "nufs_path_cache_hits_total",                             \
+    "tree_lookup calls answered by the whole-path cache.")
+
+// name, metric, help
+#define STATS_DISTS(X)                                                         \
+  X(BLOCK_SCAN, "nufs_block_bitmap_scan_bits",                                 \
+    "Bits of the block bitmap searched per allocation.")                       \
+  X(INODE_SCAN, "nufs_inode_bitmap_scan_bits",                                 \
+    "Bits of the inode bitmap searched per allocation.")                       \
+  X(LOOKUP_DEPTH, "nufs_tree_lookup_depth",                                    \
+    "Path components resolved per tree_lookup that missed the path cache.")    \
+  X(DIR_SCAN, "nufs_directory_scan_entries",                                   \
+    "Directory entries compared per directory_lookup.")
+
+#define STATS_ENUM(name, ...) STATS_##name,
+typedef enum { STATS_OPS(STATS_ENUM) STATS_OP_COUNT } stats_op_t;
+typedef enum { STATS_COUNTERS(STATS_ENUM) STATS_COUNTER_COUNT } stats_counter_t;
+typedef enum { STATS_DISTS(STATS_ENUM) STATS_DIST_COUNT } stats_dist_t;
+#undef STATS_ENUM
+
+/**
+ * Get the time to pass to stats_op.
+ *
+ * @return CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t stats_now();
+
+/**
+ * Record a finished FUSE operation.
+ *
+ * @param op The operation.
+ * @param start stats_now() when it began.
+ * @param result What it returned; negative counts as an error.
+ * @param bytes Bytes it read or wrote, if any.
+ */
+void stats_op(stats_op_t op, uint64_t start, int result, uint64_t bytes);
+
+/**
+ * Add to a counter.
+ *
+ * @param counter The counter.
+ * @param n How much.
+ */
+void stats_count(stats_counter_t counter, uint64_t n);
+
+/**
+ * Record a value in a distribution.
+ *
+ * @param dist The distribution.
+ * @param value The value.
+ */
+void stats_record(stats_dist_t dist, uint64_t value);
+
+/**
+ * Render everything in the Prometheus text exposition format: counters of
+ * calls, errors and bytes for each operation, each operation's latency as a
+ * summary (quantiles 0.5, 0.9, 0.99 and 0.999, _sum and _count, in seconds),
+ * the block-layer counters, and the distributions as summaries.
+ *
+ * @param len Set to the length of the text.
+ *
+ * @return The text, which the caller frees, or NULL if out of memory.
+ */
+char *stats_format(size_t *len);
+
+/**
+ * Set every counter and histogram back to zero. Operations in flight may
+ * land on either side of the reset.
+ */
+void stats_reset();
+
+#endif
@@ -1,235 +1,1463 @@
+#define _GNU_SOURCE // SEEK_DATA and SEEK_HOLE
+#include <assert.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
 
 #include "storage.h"
 #include "blocks.h"
 #include "bitmap.h"
 #include "inode.h"
+#include "journal.h"
+#include "dcache.h"
 #include "directory.h"
+#include "openfile.h"
+#include "path.h"
+#include "trace.h"
+
+#define READAHEAD_MIN 4  // blocks read ahead once a handle reads sequentially
+#define READAHEAD_MAX 64 // the window doubles up to this many blocks
+#define WBUF_MAX_BYTES (16 * 1024 * 1024) // appends buffered across all files
+#define WBUF_FLUSH_MS 1000                // how long appends stay buffered at most
+#define TIMES_FLUSH_MS 60000              // how long lazytime updates stay in memory at most
+#define ATIME_MAX_AGE (24 * 3600)         // relatime updates an access time at least this often
+
+enum { ATIME_STRICT, ATIME_RELATIME, ATIME_NOATIME };
+static int atimeMode = ATIME_RELATIME;
+static int lazytime = 0;
+
+static int parent_lookup(const char* path, char* child);
+static int path_inum(const char* path);
+static int truncate_locked(int inum, off_t size);
+static int read_at(int inum, open_file_t* file, char* buf, size_t size, off_t offset);
+static void prefetch(inode_t* node, int first, int end, int hint);
+static int write_at(int inum, int* cursor, const char* buf, size_t size, off_t offset);
+static int write_locked(int inum, int* cursor, const char* buf, size_t size, off_t offset);
+static int extend_for_write(int inum, off_t offset, size_t size, int* meta);
+static void flush_appends(int inum);
+static int is_small_append(inode_t* node, size_t size, off_t offset);
+static void touch(int inum, int which, int onlyTimes);
+static void access_inode(int inum);
+static void start_flusher();
+static void stop_flusher();
+static int unlink_locked(int parent, const char* name);
+static int unlink_child_locked(int parent, const char* name, int child);
+static int link_locked(int inum, int parent, const char* name);
+static int sync_dirty(int inum, int wait, int* meta);
+
+// renames are the only operations holding two directory locks at once
+static pthread_mutex_t renameLock = PTHREAD_MUTEX_INITIALIZER;
+
+// starts an operation that changes an inode (and anything reached from it);
+// the journal comes first, since a commit waits for operations holding locks
+static void begin_update(int inum)
+{
+    journal_begin();
+    inode_write_lock(inum);
+}
+
+// ends an operation started with begin_update
+static void end_update(int inum)
+{
+    inode_unlock(inum);
+    journal_end();
+}
 
-static void set_parent_child(const char* path, char* parent, char* child);
 // finds minimum of two integers
 static int min(int y, int z) {
     return y > z ? z : y;
 }
 
-// initiliazes storage with the given path
-void storage_init(const char* path)
+// formats a fresh image of the given size in bytes; a negative journal
+// size picks a default and 0 leaves the image without a journal
+int storage_format(const char* path, long size, long max_size, int inodes, long journal)
+{
+    int blockCount = size / BLOCK_SIZE;
+
+    // by default the image may grow to 64 times its initial size
+    long maxBlocks = max_size > 0 ? max_size / BLOCK_SIZE : (long)blockCount * 64;
+    if (maxBlocks > NUFS_MAX_BLOCKS)
+        maxBlocks = NUFS_MAX_BLOCKS;
+
+    // by default one inode per four blocks, but never fewer than 256
+    if (inodes <= 0)
+        inodes = blockCount / 4 > 256 ? blockCount / 4 : 256;
+
+    // by default 1/256 of the largest image, within what one commit can use,
+    // and never more than a quarter of the initial image
+    int journalBlocks = journal >= 0 ? journal / BLOCK_SIZE : maxBlocks / 256;
+    if (journal < 0)
+    {
+        journalBlocks = journalBlocks < 64 ? 64 : journalBlocks > 1021 ? 1021 : journalBlocks;
+        if (journalBlocks > blockCount / 4)
+            journalBlocks = blockCount / 4;
+    }
+
+    printf("formatting %s: %d blocks (max %ld), %d inodes, %d journal blocks\n",
+           path, blockCount, maxBlocks, inodes, journalBlocks);
+    return blocks_format(path, blockCount, maxBlocks, inodes, sizeof(inode_t), journalBlocks);
+}
+
+// initiliazes storage with the given path; returns -errno if the image holds
+// something we must not mount or overwrite
+int storage_init(const char* path)
 {
-    // initialize blocks with path
+    // formats the image with the default geometry if it has no filesystem yet,
+    // but never one written by another version
+    int probe = blocks_probe(path);
+    if (probe == -EPROTONOSUPPORT)
+    {
+        fprintf(stderr, "nufs: %s was formatted by another version of nufs; not mounting it\n", path);
+        return probe;
+    }
+    if (probe < 0)
+    {
+        fprintf(stderr, "nufs: cannot read %s: %s\n", path, strerror(-probe));
+        return probe;
+    }
+    if (probe == 0)
+    {
+        int rv = storage_format(path, NUFS_DEFAULT_SIZE, 0, 0, -1);
+        assert(rv == 0);
+    }
+
+    // initialize blocks with path, replaying the journal if we crashed
     blocks_init(path);
+    inode_locks_init(get_superblock()->inode_count);
+    journal_init();
 
-    // ckhecks and allocates inode blocks if not already allocated
-    if (!bitmap_get(get_blocks_bitmap(), 1))
-        for (int i = 0; i < 3; i++)
-        {
-            int new_block = alloc_block();
-            printf("alloc inode block: %d\n", new_block);
-        }
+    journal_begin();
+    blocks_op_begin();
+    // frees files that were unlinked while open when the image was last used
+    void* inodeBitmap = get_inode_bitmap();
+    for (int inum = 1; inum < get_superblock()->inode_count; inum++)
+        if (bitmap_get(inodeBitmap, inum) && get_inode(inum)->refs <= 0)
+            free_inode(inum);
 
     // initializes root directory if not alreayd initialized
-    if (!bitmap_get(get_blocks_bitmap(), 4))
+    if (!bitmap_get(get_inode_bitmap(), 0))
     {
       printf("initializing root directory\n");
         directory_init();
     }
+    blocks_op_end();
+    journal_end();
+    start_flusher();
+    return 0;
+}
+
+// commits outstanding metadata and closes the image
+void storage_shutdown()
+{
+    stop_flusher();
+    journal_shutdown();
+    blocks_free();
+    trace_stop();
+}
+
+// parses a byte count with an optional K/M/G suffix (e.g. 512M)
+static long parse_size(const char* text)
+{
+    char* end;
+    long size = strtol(text, &end, 10);
+    switch (*end)
+    {
+    case 'G': case 'g': size *= 1024; // fall through
+    case 'M': case 'm': size *= 1024; // fall through
+    case 'K': case 'k': size *= 1024;
+    }
+    return size;
+}
+
+// pulls the image options and path out of a front end's command line,
+// formats the image if asked to, and initializes storage from it
+const char* storage_setup(int* argc, char* argv[])
+{
+    // --size, --max-size, --inodes and --journal only matter for a fresh image;
+    // --backend, --cache and --io choose how the image is reached, and
+    // --atime and --lazytime how timestamps are kept; --trace names the trace
+    // file of a build with tracing
+    long size = 0, max_size = 0, journal = -1, cache = 0;
+    int inodes = 0, lazy = 0;
+    const char* backend = "mmap";
+    const char* io = "sync";
+    const char* atime = "relatime";
+    const char* tracePath = NULL;
+    int kept = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        if (strncmp(argv[i], "--size=", 7) == 0)
+            size = parse_size(argv[i] + 7);
+        else if (strncmp(argv[i], "--max-size=", 11) == 0)
+            max_size = parse_size(argv[i] + 11);
+        else if (strncmp(argv[i], "--inodes=", 9) == 0)
+            inodes = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--journal=", 10) == 0)
+            journal = parse_size(argv[i] + 10);
+        else if (strncmp(argv[i], "--backend=", 10) == 0)
+            backend = argv[i] + 10;
+        else if (strncmp(argv[i], "--cache=", 8) == 0)
+            cache = parse_size(argv[i] + 8);
+        else if (strncmp(argv[i], "--io=", 5) == 0)
+            io = argv[i] + 5;
+        else if (strncmp(argv[i], "--atime=", 8) == 0)
+            atime = argv[i] + 8;
+        else if (strcmp(argv[i], "--lazytime") == 0)
+            lazy = 1;
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+            tracePath = argv[i] + 8;
+        else
+            argv[kept++] = argv[i];
+    }
+    *argc = kept;
+    if (kept < 3) // need at least a mount point and an image
+    {
+        fprintf(stderr, "usage: %s [options] [fuse options] mountpoint image\n", argv[0]);
+        return NULL;
+    }
+
+    // the image is always the last argument
+    const char* image = argv[--*argc];
+    if (blocks_probe(image) == 0 && (size > 0 || max_size > 0 || inodes > 0 || journal >= 0))
+    {
+        int rv = storage_format(image, size > 0 ? size : NUFS_DEFAULT_SIZE, max_size, inodes, journal);
+        if (rv < 0)
+        {
+            fprintf(stderr, "nufs: cannot format %s with that geometry\n", image);
+            return NULL;
+        }
+    }
+    if (blocks_set_backend(backend, cache) < 0)
+    {
+        fprintf(stderr, "nufs: unknown backend %s (use mmap, pread or direct)\n", backend);
+        return NULL;
+    }
+    if (blocks_set_io_engine(io) < 0)
+    {
+        fprintf(stderr, "nufs: unknown I/O engine %s (use sync or uring)\n", io);
+        return NULL;
+    }
+    if (storage_set_atime(atime, lazy) < 0)
+    {
+        fprintf(stderr, "nufs: unknown atime mode %s (use strict, relatime or noatime)\n", atime);
+        return NULL;
+    }
+    int rv = trace_start(tracePath);
+    if (rv < 0 && (tracePath || rv != -EOPNOTSUPP))
+        fprintf(stderr, "nufs: cannot trace to %s: %s\n", tracePath ? tracePath : "nufs.trace",
+                rv == -EOPNOTSUPP ? "built without TRACE=1" : strerror(-rv));
+    printf("mount %s as data file\n", image);
+    if (storage_init(image) < 0)
+    {
+        trace_stop();
+        return NULL;
+    }
+    return image;
+}
+
+// chooses how access times are updated and whether timestamps are lazy
+int storage_set_atime(const char* mode, int lazy)
+{
+    if (strcmp(mode, "strict") == 0)
+        atimeMode = ATIME_STRICT;
+    else if (strcmp(mode, "relatime") == 0)
+        atimeMode = ATIME_RELATIME;
+    else if (strcmp(mode, "noatime") == 0)
+        atimeMode = ATIME_NOATIME;
+    else
+        return -EINVAL;
+    lazytime = lazy;
+    return 0;
 }
 
 // gets file status
 int storage_stat(const char *path, struct stat *st)
 {
     // lookup inode and set stats if inode exists
-    int inodeNumber = tree_lookup(path);
-    if (inodeNumber > 0)
-    {
-        inode_t* node = get_inode(inodeNumber);
-        // setting various stats
-        st->st_size = node->size;
-        st->st_mode = node->mode;
-        st->st_nlink = node->refs;
-        st->st_atime = node->atime;
-        st->st_ctime = node->ctime;
-        st->st_mtime = node->mtime;
-        return 0;
-    }
-    return -ENOENT; 
+    int inodeNumber = path_inum(path);
+    if (inodeNumber < 0)
+        return inodeNumber;
+    return storage_stat_inum(inodeNumber, st);
+}
+
+// gets file status by inode number
+int storage_stat_inum(int inum, struct stat *st)
+{
+    inode_t* node = get_inode(inum);
+    // setting various stats
+    memset(st, 0, sizeof(struct stat));
+    inode_read_lock(inum);
+    st->st_ino = inum;
+    st->st_size = node->size;
+    st->st_mode = node->mode;
+    st->st_nlink = node->refs;
+    st->st_blocks = (blkcnt_t)inode_block_count(node) * (BLOCK_SIZE / 512);
+    st->st_blksize = BLOCK_SIZE;
+    struct timespec times[3];
+    inode_get_times(inum, times);
+    st->st_atim = times[0];
+    st->st_mtim = times[1];
+    st->st_ctim = times[2];
+    inode_unlock(inum);
+    return 0;
 }
 
 // reads data from storgae
 int storage_read(const char *path, char *buf, size_t size, off_t offset)
+{
+    int inodeNumber = path_inum(path);
+    if (inodeNumber < 0)
+        return inodeNumber;
+    return storage_read_inum(inodeNumber, buf, size, offset);
+}
+
+// reads data from an inode
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset)
+{
+    int rv = read_at(inum, NULL, buf, size, offset);
+    if (rv > 0)
+        access_inode(inum);
+    return rv;
+}
+
+// reads data through an open file handle
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset)
+{
+    open_file_t* file = openfile_get(fh);
+    if (!file)
+        return -EBADF;
+    int rv = read_at(file->inum, file, buf, size, offset);
+    if (rv > 0)
+        access_inode(file->inum);
+    return rv;
+}
+
+// checks whether one time is before another
+static int time_before(struct timespec a, struct timespec b)
+{
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// updates an inode's access time after a read, as often as the atime mode
+// asks; under relatime most reads find it recent enough and write nothing
+static void access_inode(int inum)
+{
+    if (atimeMode == ATIME_NOATIME)
+        return;
+    struct timespec now, times[3];
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    inode_read_lock(inum);
+    inode_get_times(inum, times);
+    int due = atimeMode == ATIME_STRICT
+        || !time_before(times[1], times[0]) || !time_before(times[2], times[0])
+        || now.tv_sec - times[0].tv_sec >= ATIME_MAX_AGE;
+    int alive = get_inode(inum)->refs > 0 || inode_is_open(inum); // a path read may race an unlink
+    if (due && alive && lazytime) // readers may record it side by side
+    {
+        struct timespec stamp[3] = {now, now, now};
+        inode_lazy_times(inum, INODE_ATIME, stamp);
+    }
+    inode_unlock(inum);
+    if (due && alive && !lazytime)
+    {
+        begin_update(inum);
+        touch(inum, INODE_ATIME, 1);
+        end_update(inum);
+    }
+}
+
+// sets the times picked by which (INODE_*TIME bits) of an inode, whose lock
+// the caller holds for an update, to now; with lazytime, an update that
+// changes nothing but the times (onlyTimes) is kept in memory
+static void touch(int inum, int which, int onlyTimes)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec times[3] = {now, now, now};
+    if (lazytime && onlyTimes)
+        inode_lazy_times(inum, which, times);
+    else
+        inode_set_times(inum, which, times);
+}
+
+// reads data from an inode; through a handle, starts the block map search
+// where the handle's last access ended and reads ahead if it's sequential
+static int read_at(int inum, open_file_t* file, char* buf, size_t size, off_t offset)
 {
     // gets inode and reads data into buffer
-    inode_t* node = get_inode(tree_lookup(path));
+    inode_t* node = get_inode(inum);
+    inode_read_lock(inum);
+
+    // never read past the end of the file
+    if (offset >= node->size)
+    {
+        inode_unlock(inum);
+        return 0;
+    }
+    if (offset + size > node->size)
+        size = node->size - offset;
+
+    // small files are read straight from the inode
+    if (inode_is_inline(node))
+    {
+        memcpy(buf, node->inline_data + offset, size);
+        inode_unlock(inum);
+        return size;
+    }
+
+    // buffered appends (at the end of the file) are copied from memory,
+    // the rest from blocks
+    inode_wbuf_t* wbuf = inode_get_wbuf(inum);
+    int fromBlocks = wbuf && wbuf->start < offset + size ? (wbuf->start > offset ? wbuf->start - offset : 0) : size;
+    if (fromBlocks < size)
+        memcpy(buf + fromBlocks, wbuf->data + (offset + fromBlocks - wbuf->start), size - fromBlocks);
 
     // indexes for buffer and source, and the size to read
+    int bytesRead = size;
     int bufferIndex = 0;
     int sourceIndex = offset;
-    int bytesToRead = size;
+    int bytesToRead = fromBlocks;
+    int* cursor = file ? &file->cursor : NULL;
+    int hint = cursor ? __atomic_load_n(cursor, __ATOMIC_RELAXED) : 0;
+
+    // a read starting where the handle's last one ended doubles the
+    // readahead window, any other read closes it
+    int window = 0;
+    if (file)
+    {
+        if (__atomic_load_n(&file->ra_next, __ATOMIC_RELAXED) == offset)
+        {
+            window = __atomic_load_n(&file->ra_window, __ATOMIC_RELAXED);
+            window = window ? min(window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+        }
+        __atomic_store_n(&file->ra_window, window, __ATOMIC_RELAXED);
+        __atomic_store_n(&file->ra_next, offset + size, __ATOMIC_RELAXED);
+    }
+    // fetch every cold block of the read (and the window) in one batch
+    // rather than one at a time in the loop below
+    int firstBlock = offset / BLOCK_SIZE;
+    int endBlock = fromBlocks ? (offset + fromBlocks - 1) / BLOCK_SIZE + 1 : firstBlock;
+    if (window > 0 || endBlock - firstBlock > 1)
+        prefetch(node, firstBlock, endBlock + window, hint);
 
     // loop to read data in blocks
     while (bytesToRead > 0)
     {
         // gets the block and calculates the size to copy
-        char* src = blocks_get_block(inode_get_pnum(node, sourceIndex));
-        src += sourceIndex % BLOCK_SIZE;
+        int pnum = inode_get_pnum_hint(node, sourceIndex / BLOCK_SIZE, &hint);
         int copy_size = min(bytesToRead, BLOCK_SIZE - (sourceIndex % BLOCK_SIZE));
-        memcpy(buf + bufferIndex, src, copy_size);
+        char* source = pnum < 0 ? NULL : blocks_get_block(pnum);
+        if (pnum >= 0 && !source) // unreadable: return what came before it
+        {
+            bytesRead = bufferIndex ? bufferIndex : -EIO;
+            break;
+        }
+        if (pnum < 0) // a hole reads as zeros
+            memset(buf + bufferIndex, 0, copy_size);
+        else
+            memcpy(buf + bufferIndex, source + sourceIndex % BLOCK_SIZE, copy_size);
         // updating indexes and remaining size
         bufferIndex += copy_size;
         sourceIndex += copy_size;
         bytesToRead -= copy_size;
     }
 
+    if (cursor)
+        __atomic_store_n(cursor, hint, __ATOMIC_RELAXED);
+    inode_unlock(inum);
+    return bytesRead;
+}
+
+// describes the bytes [offset, offset + size) of a file as ranges of the
+// image file, one per run of physically contiguous blocks, or returns NULL
+// if they take in a hole
+static storage_segment_t* map_range(inode_t* node, int* cursor, off_t offset, size_t size, int* count)
+{
+    int firstBlock = offset / BLOCK_SIZE;
+    int endBlock = size ? (offset + size - 1) / BLOCK_SIZE + 1 : firstBlock;
+    storage_segment_t* segs = malloc((endBlock - firstBlock + 1) * sizeof(storage_segment_t));
+    *count = 0;
+    int hint = __atomic_load_n(cursor, __ATOMIC_RELAXED);
+    off_t sourceIndex = offset;
+    size_t bytesLeft = size;
+    while (bytesLeft > 0)
+    {
+        int pnum = inode_get_pnum_hint(node, sourceIndex / BLOCK_SIZE, &hint);
+        if (pnum < 0) // a hole has nothing in the image to point at
+        {
+            free(segs);
+            return NULL;
+        }
+        off_t pos = (off_t)pnum * BLOCK_SIZE + sourceIndex % BLOCK_SIZE;
+        size_t length = min(bytesLeft, BLOCK_SIZE - (sourceIndex % BLOCK_SIZE));
+        storage_segment_t* last = *count ? &segs[*count - 1] : NULL;
+        if (last && last->pos + last->size == pos)
+            last->size += length; // continues the current run
+        else
+            segs[(*count)++] = (storage_segment_t){pos, length};
+        sourceIndex += length;
+        bytesLeft -= length;
+    }
+    __atomic_store_n(cursor, hint, __ATOMIC_RELAXED);
+    return segs;
+}
+
+// describes a read through a handle as ranges of the image file, leaving
+// the file read-locked until storage_read_unmap
+int storage_read_map(uint64_t fh, size_t size, off_t offset, int* fd,
+                     storage_segment_t** segs, int* count)
+{
+    open_file_t* file = openfile_get(fh);
+    if (!file)
+        return -EBADF;
+    *fd = blocks_image_fd();
+    if (*fd < 0)
+        return -EOPNOTSUPP;
+
+    int inum = file->inum;
+    inode_t* node = get_inode(inum);
+    inode_read_lock(inum);
+
+    // never read past the end of the file
+    if (offset >= node->size)
+        size = 0;
+    else if (offset + size > node->size)
+        size = node->size - offset;
+
+    // inline data, holes and buffered appends have no blocks to splice from
+    inode_wbuf_t* wbuf = inode_get_wbuf(inum);
+    *segs = inode_is_inline(node) || (wbuf && offset + size > wbuf->start) ? NULL
+        : map_range(node, &file->cursor, offset, size, count);
+    if (!*segs)
+    {
+        inode_unlock(inum);
+        return -EOPNOTSUPP;
+    }
+    return size;
+}
+
+// lets go of a file described by storage_read_map
+void storage_read_unmap(uint64_t fh, storage_segment_t* segs)
+{
+    free(segs);
+    int inum = openfile_get(fh)->inum;
+    inode_unlock(inum);
+    access_inode(inum);
+}
+
+// extends a file for a write through a handle and describes the bytes to
+// write as ranges of the image file, leaving the file locked for the update
+// until storage_write_unmap
+int storage_write_map(uint64_t fh, size_t size, off_t offset, int* fd,
+                      storage_segment_t** segs, int* count, off_t* oldSize)
+{
+    open_file_t* file = openfile_get(fh);
+    if (!file)
+        return -EBADF;
+    *fd = blocks_image_fd();
+    if (*fd < 0)
+        return -EOPNOTSUPP;
+
+    int inum = file->inum;
+    inode_t* node = get_inode(inum);
+    begin_update(inum);
+    if (is_small_append(node, size, offset)) // buffered by storage_write_fh instead
+    {
+        end_update(inum);
+        return -EOPNOTSUPP;
+    }
+    flush_appends(inum);
+    if (inode_is_inline(node) && offset + size <= INODE_INLINE_SIZE) // stays in the inode
+    {
+        end_update(inum);
+        return -EOPNOTSUPP;
+    }
+    *oldSize = node->size;
+    int meta;
+    int rv = extend_for_write(inum, offset, size, &meta);
+    if (rv < 0)
+    {
+        end_update(inum);
+        return rv;
+    }
+    size = rv;
+
+    *segs = map_range(node, &file->cursor, offset, size, count);
+    if (size > 0) // remembered so fsync only writes back what changed
+        inode_dirty_data(inum, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE + 1, meta);
+    touch(inum, INODE_MTIME | INODE_CTIME, !meta);
     return size;
 }
 
+// lets go of a file described by storage_write_map once the ranges are
+// written up to end, giving back what it grew past that
+void storage_write_unmap(uint64_t fh, storage_segment_t* segs, off_t oldSize, off_t end)
+{
+    free(segs);
+    int inum = openfile_get(fh)->inum;
+    inode_t* node = get_inode(inum);
+    if (node->size > end && node->size > oldSize)
+        truncate_locked(inum, end > oldSize ? end : oldSize);
+    end_update(inum);
+}
+
 // wirtes data to storage
 int storage_write(const char *path, const char *buf, size_t size, off_t offset)
+{
+    int inodeNumber = path_inum(path);
+    if (inodeNumber < 0)
+        return inodeNumber;
+    return storage_write_inum(inodeNumber, buf, size, offset);
+}
+
+// writes data to an inode
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset)
+{
+    return write_at(inum, NULL, buf, size, offset);
+}
+
+// writes data through an open file handle
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset)
+{
+    open_file_t* file = openfile_get(fh);
+    if (!file)
+        return -EBADF;
+    return write_at(file->inum, &file->cursor, buf, size, offset);
+}
+
+// asks for the blocks backing file blocks [first, end) to be brought in,
+// one run of physically contiguous blocks at a time
+static void prefetch(inode_t* node, int first, int end, int hint)
+{
+    int mapped = bytes_to_blocks(node->size);
+    if (end > mapped)
+        end = mapped;
+    int runStart = -1, runLength = 0;
+    for (int fpn = first; fpn < end; fpn++)
+    {
+        int pnum = inode_get_pnum_hint(node, fpn, &hint);
+        if (runLength > 0 && runStart + runLength == pnum)
+        {
+            runLength++; // continues the current run
+            continue;
+        }
+        if (runLength > 0)
+            blocks_prefetch(runStart, runLength);
+        runStart = pnum;
+        runLength = pnum >= 0; // nothing to fetch for a hole
+    }
+    if (runLength > 0)
+        blocks_prefetch(runStart, runLength);
+}
+
+// clears a newly allocated file block, if it has one
+static void zero_block(inode_t* node, int fpn)
+{
+    int pnum = inode_get_pnum(node, fpn);
+    char* block = pnum < 0 ? NULL : blocks_get_block(pnum);
+    if (!block) // unreadable blocks fail the write that follows
+        return;
+    memset(block, 0, BLOCK_SIZE);
+    blocks_mark_dirty(pnum);
+}
+
+// extends a file (whose lock the caller holds) for a write of size bytes at
+// offset, and backs the holes the write lands in with blocks; returns how
+// many bytes from offset can be written, fewer if the disk filled up, and
+// sets *meta if the size or block map changed
+static int extend_for_write(int inum, off_t offset, size_t size, int* meta)
+{
+    if (offset + (off_t)size > NUFS_MAX_FILE_SIZE)
+        return -EFBIG;
+    inode_t* node = get_inode(inum);
+    off_t oldSize = node->size;
+    int grew = node->size < size + offset;
+    *meta = grew;
+    if (grew)
+    {
+        int rv = truncate_locked(inum, size + offset);
+        if (rv < 0)
+            return rv;
+    }
+    if (inode_is_inline(node) || size == 0)
+        return size;
+
+    // the blocks the write covers completely need no clearing, just the ends
+    int first = offset / BLOCK_SIZE;
+    int end = (offset + size - 1) / BLOCK_SIZE + 1;
+    int clearFirst = offset % BLOCK_SIZE != 0 && inode_get_pnum(node, first) < 0;
+    int clearLast = (offset + size) % BLOCK_SIZE != 0 && inode_get_pnum(node, end - 1) < 0;
+    if (inode_next_hole(node, first) < end)
+        *meta = 1; // holes are about to get blocks
+    inode_alloc_blocks(node, first, end);
+    if (clearFirst)
+        zero_block(node, first);
+    if (clearLast)
+        zero_block(node, end - 1);
+
+    int hole = inode_next_hole(node, first);
+    if (hole >= end)
+        return size;
+    // out of space part way: keep what got blocks, give back the rest
+    off_t backed = (off_t)hole * BLOCK_SIZE > offset ? (off_t)hole * BLOCK_SIZE - offset : 0;
+    if (grew)
+        truncate_locked(inum, offset + backed > oldSize ? offset + backed : oldSize);
+    return backed > 0 ? backed : -ENOSPC;
+}
+
+// checks whether a write is an append small enough to buffer
+static int is_small_append(inode_t* node, size_t size, off_t offset)
+{
+    return size > 0 && size < BLOCK_SIZE && offset == node->size && !inode_is_inline(node);
+}
+
+// buffers a small append to a file whose lock the caller holds, so that
+// many of them get blocks at once; returns the bytes buffered, or 0 if the
+// write isn't a small append
+static int buffer_append(int inum, const char* buf, size_t size, off_t offset)
+{
+    inode_t* node = get_inode(inum);
+    if (!is_small_append(node, size, offset))
+        return 0;
+    inode_wbuf_t* wbuf = inode_get_wbuf(inum);
+    if (wbuf && wbuf->len + size > INODE_WBUF_SIZE) // full, give it blocks and start over
+        flush_appends(inum);
+
+    // the file grows now, but the new part stays a hole until it's flushed
+    truncate_locked(inum, offset + size);
+    inode_wbuf_append(inum, offset, buf, size);
+    inode_dirty_data(inum, 0, 0, 1);
+    if (inode_wbuf_bytes() > WBUF_MAX_BYTES) // too much memory tied up, start with this one
+        flush_appends(inum);
+    return size;
+}
+
+// gives an inode's buffered appends blocks, as few runs as the allocator
+// can manage, and writes them there; caller holds the lock for an update
+static void flush_appends(int inum)
+{
+    inode_wbuf_t* wbuf = inode_take_wbuf(inum);
+    if (!wbuf)
+        return;
+    int rv = write_locked(inum, NULL, wbuf->data, wbuf->len, wbuf->start);
+    if (rv < wbuf->len) // out of space: the file ends where the data made it
+    {
+        fprintf(stderr, "nufs: lost %d buffered bytes of inode %d: %s\n",
+                wbuf->len - (rv > 0 ? rv : 0), inum, strerror(rv < 0 ? -rv : ENOSPC));
+        truncate_locked(inum, wbuf->start + (rv > 0 ? rv : 0));
+    }
+    free(wbuf);
+}
+
+// flushes the buffered appends of every inode
+static void flush_all_appends()
+{
+    for (int inum = inode_wbuf_next(0); inum >= 0; inum = inode_wbuf_next(inum + 1))
+    {
+        begin_update(inum);
+        flush_appends(inum);
+        end_update(inum);
+    }
+}
+
+// writes back the pending lazytime updates of every inode
+static void flush_all_times()
+{
+    for (int inum = inode_times_next(0); inum >= 0; inum = inode_times_next(inum + 1))
+    {
+        begin_update(inum);
+        inode_write_times(inum);
+        end_update(inum);
+    }
+}
+
+// flushes buffered appends every WBUF_FLUSH_MS, and lazytime updates every
+// TIMES_FLUSH_MS, until told to stop
+static pthread_t flusher;
+static pthread_mutex_t flusherLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+static int flusherStop;
+
+static void* flusher_main(void* arg)
+{
+    int ticks = 0;
+    pthread_mutex_lock(&flusherLock);
+    while (!flusherStop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WBUF_FLUSH_MS % 1000 * 1000000L;
+        deadline.tv_sec += WBUF_FLUSH_MS / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&flusherWake, &flusherLock, &deadline);
+        int stopping = flusherStop;
+        pthread_mutex_unlock(&flusherLock);
+        flush_all_appends();
+        if (stopping || ++ticks * WBUF_FLUSH_MS >= TIMES_FLUSH_MS)
+        {
+            flush_all_times();
+            ticks = 0;
+        }
+        pthread_mutex_lock(&flusherLock);
+    }
+    pthread_mutex_unlock(&flusherLock);
+    return NULL;
+}
+
+static void start_flusher()
+{
+    flusherStop = 0;
+    int rv = pthread_create(&flusher, NULL, flusher_main, NULL);
+    assert(rv == 0);
+}
+
+// stops the flusher, which flushes one last time on the way out
+static void stop_flusher()
+{
+    pthread_mutex_lock(&flusherLock);
+    flusherStop = 1;
+    pthread_cond_signal(&flusherWake);
+    pthread_mutex_unlock(&flusherLock);
+    pthread_join(flusher, NULL);
+}
+
+// writes data to an inode, starting the block map search at *cursor if given
+static int write_at(int inum, int* cursor, const char* buf, size_t size, off_t offset)
+{
+    if (offset + (off_t)size > NUFS_MAX_FILE_SIZE)
+        return -EFBIG;
+    begin_update(inum);
+    off_t oldSize = get_inode(inum)->size;
+    int rv = buffer_append(inum, buf, size, offset);
+    if (rv == 0) // anything else waits for the buffered appends to land first
+    {
+        flush_appends(inum);
+        rv = write_locked(inum, cursor, buf, size, offset);
+    }
+    if (rv > 0)
+        touch(inum, INODE_MTIME | INODE_CTIME, get_inode(inum)->size == oldSize);
+    end_update(inum);
+    return rv;
+}
+
+// writes data to an inode whose lock the caller holds for an update
+static int write_locked(int inum, int* cursor, const char* buf, size_t size, off_t offset)
 {
     // gets inode and extends it if needed
-    inode_t* node = get_inode(tree_lookup(path));
-    if (node->size < size + offset)
-        storage_truncate(path, size + offset);
+    inode_t* node = get_inode(inum);
+    int meta;
+    int rv = extend_for_write(inum, offset, size, &meta);
+    if (rv < 0)
+        return rv;
+    size = rv; // fewer bytes if the disk filled up
+
+    // small files are written to the inode, through the journal like the rest of it
+    if (inode_is_inline(node))
+    {
+        inode_dirty(node);
+        memcpy(node->inline_data + offset, buf, size);
+        inode_dirty_data(inum, 0, 0, 1);
+        return size;
+    }
 
     // indexes for buffer and destination, and the size to write
     int bufferIndex = 0;
     int destinationIndex = offset;
     int bytesToWrite = size;
+    int hint = cursor ? __atomic_load_n(cursor, __ATOMIC_RELAXED) : 0;
 
     // loop to write data in blocks
     while (bytesToWrite > 0)
     {
         // gets the block and calculates the size to copy
-        char* dest = blocks_get_block(inode_get_pnum(node, destinationIndex));
+        int pnum = inode_get_pnum_hint(node, destinationIndex / BLOCK_SIZE, &hint);
+        char* dest = blocks_get_block(pnum);
+        if (!dest) // unreadable: keep what was written before it
+        {
+            size = bufferIndex;
+            if (size == 0)
+                return -EIO;
+            break;
+        }
         dest += destinationIndex % BLOCK_SIZE;
         int copy_size = min(bytesToWrite, BLOCK_SIZE - (destinationIndex % BLOCK_SIZE));
         memcpy(dest, buf + bufferIndex, copy_size);
+        blocks_mark_dirty(pnum);
         // updating indexes and remaining size
         bufferIndex += copy_size;
         destinationIndex += copy_size;
         bytesToWrite -= copy_size;
     }
 
+    if (cursor)
+        __atomic_store_n(cursor, hint, __ATOMIC_RELAXED);
+    if (size > 0) // remembered so fsync only writes back what changed
+        inode_dirty_data(inum, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE + 1, meta);
     return size;
 }
 
-// truncates a file to a specified size
-int storage_truncate(const char *path, off_t size)
+// finds the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset;
+// the end of the file counts as a hole
+off_t storage_seek_inum(int inum, off_t offset, int whence)
+{
+    inode_t* node = get_inode(inum);
+    inode_read_lock(inum);
+    off_t size = node->size;
+    off_t pos = -EINVAL;
+    if (offset >= size || offset < 0)
+        pos = -ENXIO;
+    else if (whence == SEEK_DATA)
+    {
+        int fpn = inode_is_inline(node) ? offset / BLOCK_SIZE : inode_next_data(node, offset / BLOCK_SIZE);
+        pos = fpn < 0 ? -ENXIO : (off_t)fpn * BLOCK_SIZE > offset ? (off_t)fpn * BLOCK_SIZE : offset;
+        if (pos >= size || pos < 0)
+            pos = -ENXIO;
+        // buffered appends are data, from where they start to the end of the file
+        inode_wbuf_t* wbuf = inode_get_wbuf(inum);
+        off_t buffered = wbuf ? wbuf->start : size;
+        if (buffered < size && (pos < 0 || pos > buffered))
+            pos = buffered > offset ? buffered : offset;
+    }
+    else if (whence == SEEK_HOLE)
+    {
+        off_t hole = inode_is_inline(node) ? size : (off_t)inode_next_hole(node, offset / BLOCK_SIZE) * BLOCK_SIZE;
+        inode_wbuf_t* wbuf = inode_get_wbuf(inum);
+        if (wbuf && hole >= wbuf->start)
+            hole = size; // the buffered appends run to the end
+        pos = hole < offset ? offset : hole > size ? size : hole;
+    }
+    inode_unlock(inum);
+    return pos;
+}
+
+// opens a file, returning a handle for the *_fh functions
+int storage_open(const char *path)
+{
+    int inodeNumber = path_inum(path);
+    if (inodeNumber < 0)
+        return inodeNumber;
+    return storage_open_inum(inodeNumber);
+}
+
+// opens an inode, keeping it alive until the handle is released
+int storage_open_inum(int inum)
+{
+    inode_write_lock(inum);
+    int fh = -ENOENT;
+    if (get_inode(inum)->refs > 0) // not unlinked since it was looked up
+    {
+        fh = openfile_alloc(inum);
+        if (fh >= 0)
+            inode_open(inum);
+    }
+    inode_unlock(inum);
+    return fh;
+}
+
+// gets the inode behind an open file handle
+int storage_fh_inum(uint64_t fh)
+{
+    open_file_t* file = openfile_get(fh);
+    return file ? file->inum : -EBADF;
+}
+
+// called on every close of a descriptor for the handle
+int storage_flush(uint64_t fh)
+{
+    open_file_t* file = openfile_get(fh);
+    if (!file)
+        return -EBADF;
+    // closing doesn't promise durability, but giving buffered appends
+    // blocks and starting the writeback now makes a later fsync cheaper
+    begin_update(file->inum);
+    flush_appends(file->inum);
+    end_update(file->inum);
+    int meta;
+    return sync_dirty(file->inum, 0, &meta);
+}
+
+// makes a file or directory durable
+int storage_fsync(const char *path, int datasync)
+{
+    int inodeNumber = path_inum(path);
+    if (inodeNumber < 0)
+        return inodeNumber;
+    return storage_fsync_inum(inodeNumber, datasync);
+}
+
+// makes what an inode has written durable: its dirty blocks with ranged
+// msync, then (unless only the data was asked for and the size and block
+// map are unchanged) its metadata with a journal commit
+int storage_fsync_inum(int inum, int datasync)
 {
-    // gets inode and adjusts its size
-    inode_t* node = get_inode(tree_lookup(path));
-    if (node->size < size)
-        grow_inode(node, size);
+    begin_update(inum);
+    flush_appends(inum);
+    if (!datasync) // lazy timestamps are metadata a data sync leaves behind
+        inode_write_times(inum);
+    end_update(inum);
+
+    int meta;
+    int rv = sync_dirty(inum, 1, &meta);
+    if (S_ISDIR(get_inode(inum)->mode)) // a directory's contents are metadata
+        meta = 1;
+    if (rv == 0 && (!datasync || meta))
+        rv = journal_commit();
+    return rv;
+}
+
+// writes an inode's dirty blocks back to the image, coalesced into runs of
+// physically contiguous blocks; waits for them and forgets them if wait is
+// set, otherwise only starts the writeback
+static int sync_dirty(int inum, int wait, int* meta)
+{
+    int runCount = 0;
+    int runCapacity = 16;
+    int* runStart = malloc(runCapacity * sizeof(int));
+    int* runLength = malloc(runCapacity * sizeof(int));
+
+    inode_write_lock(inum);
+    inode_t* node = get_inode(inum);
+    inode_dirty_t* dirty = inode_get_dirty(inum);
+    *meta = dirty ? dirty->meta : 0;
+    int mapped = bytes_to_blocks(node->size);
+    int hint = 0;
+    for (int i = 0; dirty && i < dirty->nranges; i++)
+        for (int fpn = dirty->first[i]; fpn < dirty->end[i] && fpn < mapped; fpn++)
+        {
+            int pnum = inode_get_pnum_hint(node, fpn, &hint);
+            if (pnum < 0) // a hole has nothing to write
+                continue;
+            if (runCount > 0 && runStart[runCount - 1] + runLength[runCount - 1] == pnum)
+            {
+                runLength[runCount - 1]++; // continues the previous run
+                continue;
+            }
+            if (runCount == runCapacity)
+            {
+                runCapacity *= 2;
+                runStart = realloc(runStart, runCapacity * sizeof(int));
+                runLength = realloc(runLength, runCapacity * sizeof(int));
+            }
+            runStart[runCount] = pnum;
+            runLength[runCount] = 1;
+            runCount++;
+        }
+    if (wait)
+        inode_clear_dirty(inum);
+    inode_unlock(inum);
+
+    int rv = 0;
+    for (int i = 0; i < runCount && rv == 0; i++)
+        rv = wait ? blocks_sync(runStart[i], runLength[i]) : blocks_writeback(runStart[i], runLength[i]);
+    free(runStart);
+    free(runLength);
+    return rv;
+}
+
+// closes a handle, freeing the inode if it was the last thing keeping it
+int storage_release(uint64_t fh)
+{
+    open_file_t* file = openfile_get(fh);
+    if (!file)
+        return -EBADF;
+    int inum = file->inum;
+    openfile_free(fh);
+
+    begin_update(inum);
+    int opens = inode_close(inum);
+    if (opens == 0 && get_inode(inum)->refs <= 0) // unlinked while open
+        free_inode(inum); // buffered appends and all
     else
-        shrink_inode(node, size);
+    {
+        flush_appends(inum);
+        if (opens == 0) // no one is left to keep lazy timestamps fresh for
+            inode_write_times(inum);
+    }
+    end_update(inum);
     return 0;
 }
 
+// truncates a file to a specified size
+int storage_truncate(const char *path, off_t size)
+{
+    int inodeNumber = path_inum(path);
+    if (inodeNumber < 0)
+        return inodeNumber;
+    return storage_truncate_inum(inodeNumber, size);
+}
+
+// truncates an inode to a specified size
+int storage_truncate_inum(int inum, off_t size)
+{
+    if (size < 0)
+        return -EINVAL;
+    if (size > NUFS_MAX_FILE_SIZE)
+        return -EFBIG;
+    begin_update(inum);
+    flush_appends(inum);
+    int rv = truncate_locked(inum, size);
+    inode_dirty_data(inum, 0, 0, 1); // only the size and block map changed
+    if (rv == 0)
+        touch(inum, INODE_MTIME | INODE_CTIME, 0);
+    end_update(inum);
+    return rv;
+}
+
+// adjusts the size of an inode whose lock the caller holds
+static int truncate_locked(int inum, off_t size)
+{
+    if (size > NUFS_MAX_FILE_SIZE) // the size wouldn't fit in the inode
+        return -EFBIG;
+    inode_t* node = get_inode(inum);
+    int wasInline = inode_is_inline(node);
+    int shrinking = size < node->size;
+    int rv = shrinking ? shrink_inode(node, size) : grow_inode(node, size);
+    if (wasInline && !inode_is_inline(node)) // the data moved out to a block that fsync must write
+        inode_dirty_data(inum, 0, 1, 1);
+    else if (shrinking && size % BLOCK_SIZE && !inode_is_inline(node)) // as does the cleared tail
+        inode_dirty_data(inum, size / BLOCK_SIZE, size / BLOCK_SIZE + 1, 1);
+    return rv;
+}
+
 // creates a new file node
 int storage_mknod(const char *path, mode_t mode)
 {
-    // checks if file exists and returns error if it does
-    if (tree_lookup(path) != -ENOENT)
-        return -EEXIST;
-    
-    // allocates memory for child and parent paths
-    char* child = (char*)malloc(DIR_NAME_LENGTH + 2);
-    char* parent = (char*)malloc(strlen(path));
-    set_parent_child(path, parent, child);
-
     // looks up parent inode and returns error if not found
-    int parentInodeNumber = tree_lookup(parent);
+    char child[DIR_NAME_LENGTH];
+    int parentInodeNumber = parent_lookup(path, child);
     if (parentInodeNumber < 0)
+        return parentInodeNumber;
+    int rv = storage_mknod_at(parentInodeNumber, child, mode);
+    return rv < 0 ? rv : 0;
+}
+
+// creates a new file node in a directory, returning its inode number
+int storage_mknod_at(int parent, const char *name, mode_t mode)
+{
+    // gets parent inode, checks if file exists and returns error if it does
+    inode_t* parent_node = get_inode(parent);
+    begin_update(parent);
+    if (parent_node->refs <= 0) // removed while we waited for it
     {
-        // freeing allocated memory before returning
-        free(child);
-        free(parent);
+        end_update(parent);
         return -ENOENT;
     }
-    // gets parent inode
-    inode_t* parent_node = get_inode(parentInodeNumber);
+    if (directory_lookup(parent_node, name) >= 0)
+    {
+        end_update(parent);
+        return -EEXIST;
+    }
 
-    // alloctes new inode and sets its properties
-    int newInodeNumber = alloc_inode();
+    // alloctes new inode and sets its properties; no one else can see it yet
+    int newInodeNumber = alloc_inode(mode);
+    if (newInodeNumber < 0)
+    {
+        end_update(parent);
+        return newInodeNumber;
+    }
     inode_t* node = get_inode(newInodeNumber);
-    node->mode = mode;
     node->size = 0;
     node->refs = 1;
+    node->parent = parent;
 
-    // adds new inode to parent directory and frees memory
-    directory_put(parent_node, child, newInodeNumber);
-    free(child);
-    free(parent);
-    return 0;
+    // adds new inode to parent directory
+    int putResult = directory_put(parent_node, name, newInodeNumber);
+    if (putResult < 0) // no room in the parent, give the inode back
+    {
+        free_inode(newInodeNumber);
+        end_update(parent);
+        return putResult;
+    }
+    dcache_insert(parent, name, newInodeNumber);
+    touch(parent, INODE_MTIME | INODE_CTIME, 0);
+    end_update(parent);
+    return newInodeNumber;
 }
 
 // removes a file link
 int storage_unlink(const char *path)
 {
-    // allocates memry for child and parent paths
-    char* child = (char*)malloc(DIR_NAME_LENGTH + 2);
-    char* parent = (char*)malloc(strlen(path));
-    set_parent_child(path, parent, child);
-
     // gets parent inode and deletes directory entry
-    inode_t* parent_node = get_inode(tree_lookup(parent));
-    int unlinkResult = directory_delete(parent_node, child);
+    char child[DIR_NAME_LENGTH];
+    int parentInodeNumber = parent_lookup(path, child);
+    if (parentInodeNumber < 0)
+        return parentInodeNumber;
+    return storage_unlink_at(parentInodeNumber, child);
+}
+
+// removes a name from a directory
+int storage_unlink_at(int parent, const char *name)
+{
+    begin_update(parent);
+    int rv = unlink_locked(parent, name);
+    end_update(parent);
+    return rv;
+}
+
+// removes a name from a directory whose lock the caller holds
+static int unlink_locked(int parent, const char* name)
+{
+    int childInodeNumber = directory_lookup(get_inode(parent), name);
+    if (childInodeNumber < 0)
+        return -ENOENT;
+
+    // wait out readers and writers of the child, since it may be freed
+    inode_write_lock(childInodeNumber);
+    int unlinkResult = unlink_child_locked(parent, name, childInodeNumber);
+    inode_unlock(childInodeNumber);
+    return unlinkResult;
+}
 
-    // freeing allocated memory
-    free(child);
-    free(parent);
+// removes the name of a child from a directory; the caller holds the locks
+// of both, so it can check the child first and nothing changes in between
+static int unlink_child_locked(int parent, const char* name, int child)
+{
+    int removedDirectory = S_ISDIR(get_inode(child)->mode);
+    int unlinkResult = directory_delete(get_inode(parent), name);
+    if (unlinkResult == 0 && get_inode(child)->refs > 0) // lost a link, not freed
+        touch(child, INODE_CTIME, 0);
+    if (unlinkResult == 0)
+        touch(parent, INODE_MTIME | INODE_CTIME, 0);
+    if (removedDirectory) // its inode may come back as another directory
+        dcache_flush();
+    else
+        dcache_remove(parent, name); // drop the name and any path through it
 
     return unlinkResult;
 }
 
+// whether a directory whose lock the caller holds has no entries
+static int directory_empty(int inum)
+{
+    off_t pos = 0;
+    return directory_next(get_inode(inum), &pos) == NULL;
+}
+
+// removes a directory
+int storage_rmdir(const char *path)
+{
+    char child[DIR_NAME_LENGTH];
+    int parentInodeNumber = parent_lookup(path, child);
+    if (parentInodeNumber < 0)
+        return parentInodeNumber;
+    return storage_rmdir_at(parentInodeNumber, child);
+}
+
+// removes an empty directory from its parent
+int storage_rmdir_at(int parent, const char *name)
+{
+    begin_update(parent);
+    int childInodeNumber = directory_lookup(get_inode(parent), name);
+    int rv = childInodeNumber;
+    if (childInodeNumber >= 0)
+    {
+        // checked and removed under the child's lock, so nothing is created
+        // in it meanwhile
+        inode_write_lock(childInodeNumber);
+        rv = !S_ISDIR(get_inode(childInodeNumber)->mode) ? -ENOTDIR
+            : !directory_empty(childInodeNumber) ? -ENOTEMPTY
+            : unlink_child_locked(parent, name, childInodeNumber);
+        inode_unlock(childInodeNumber);
+    }
+    end_update(parent);
+    return rv;
+}
+
 // creates a hard link to a file
 int storage_link(const char *from, const char *to)
 {
     // checks if target exists and returns error if it doesn't
-    int inodeNumber = tree_lookup(to);
+    int inodeNumber = path_inum(to);
     if (inodeNumber < 0)
         return inodeNumber;
 
-    // allocates memory for child and parent paths
-    char* child = (char*)malloc(DIR_NAME_LENGTH + 2);
-    char* parent = (char*)malloc(strlen(from));
-    set_parent_child(from, parent, child);
-
     // gets parent inode and adds a new directory entry
-    inode_t* parent_node = get_inode(tree_lookup(parent));
-    directory_put(parent_node, child, inodeNumber);
-    get_inode(inodeNumber)->refs++;
-    
-    // freeing allocated memory
-    free(child);
-    free(parent);
+    char child[DIR_NAME_LENGTH];
+    int parentInodeNumber = parent_lookup(from, child);
+    if (parentInodeNumber < 0)
+        return parentInodeNumber;
+    return storage_link_at(inodeNumber, parentInodeNumber, child);
+}
 
-    return 0;
+// adds a new name for an inode to a directory
+int storage_link_at(int inum, int parent, const char *name)
+{
+    if (S_ISDIR(get_inode(inum)->mode)) // a directory has one parent
+        return -EPERM;
+    begin_update(parent);
+    int rv = link_locked(inum, parent, name);
+    end_update(parent);
+    return rv;
+}
+
+// adds a name to a directory whose lock the caller holds
+static int link_locked(int inum, int parent, const char* name)
+{
+    int putResult = directory_put(get_inode(parent), name, inum);
+    if (putResult == 0)
+    {
+        inode_write_lock(inum);
+        inode_dirty(get_inode(inum));
+        get_inode(inum)->refs++;
+        touch(inum, INODE_CTIME, 0);
+        inode_unlock(inum);
+        dcache_insert(parent, name, inum);
+        touch(parent, INODE_MTIME | INODE_CTIME, 0);
+    }
+
+    return putResult;
 }
 
 // renames a file
 int storage_rename(const char *from, const char *to)
 {
-    // links new name to file and unlinks old name
-    storage_link(to, from);
-    storage_unlink(from);
-    return 0;
+    char fromChild[DIR_NAME_LENGTH];
+    char toChild[DIR_NAME_LENGTH];
+    int fromParent = parent_lookup(from, fromChild);
+    if (fromParent < 0)
+        return fromParent;
+    int toParent = parent_lookup(to, toChild);
+    if (toParent < 0)
+        return toParent;
+    return storage_rename_at(fromParent, fromChild, toParent, toChild);
+}
+
+// locks both directories of a rename; the second is only ever tried, so a
+// rename never waits on a directory while holding another one that some
+// other thread (walking down from an ancestor) may be waiting for
+static void rename_lock(int from_parent, int to_parent)
+{
+    journal_begin();
+    pthread_mutex_lock(&renameLock);
+    for (;;)
+    {
+        inode_write_lock(from_parent);
+        if (from_parent == to_parent || inode_try_write_lock(to_parent) == 0)
+            return;
+        inode_unlock(from_parent);
+        sched_yield(); // let the holder of to_parent finish
+    }
+}
+
+// releases the locks taken by rename_lock
+static void rename_unlock(int from_parent, int to_parent)
+{
+    if (from_parent != to_parent)
+        inode_unlock(to_parent);
+    inode_unlock(from_parent);
+    pthread_mutex_unlock(&renameLock);
+    journal_end();
+}
+
+// checks whether a directory is dir or lies below it, following parent
+// pointers up to the root; only renames change them, and those are
+// serialized, so the caller holding renameLock sees none move
+static int is_within(int inum, int dir)
+{
+    for (int depth = 0; depth <= get_superblock()->inode_count; depth++)
+    {
+        if (inum == dir)
+            return 1;
+        if (inum == 0)
+            return 0;
+        inum = get_inode(inum)->parent;
+    }
+    return 1; // a parent loop: refuse to add to it
+}
+
+// points a directory that was moved at its new parent
+static void set_parent(int inum, int parent)
+{
+    inode_write_lock(inum);
+    inode_dirty(get_inode(inum));
+    get_inode(inum)->parent = parent;
+    inode_unlock(inum);
+}
+
+// removes the target of a rename, as rename(2) allows: a file may replace a
+// file and a directory an empty directory; the caller holds the lock of the
+// target's directory
+static int replace_target(int to_parent, const char* to, int target, int isDir)
+{
+    inode_write_lock(target);
+    int targetIsDir = S_ISDIR(get_inode(target)->mode);
+    int rv = isDir && !targetIsDir ? -ENOTDIR
+        : !isDir && targetIsDir ? -EISDIR
+        : targetIsDir && !directory_empty(target) ? -ENOTEMPTY
+        : unlink_child_locked(to_parent, to, target);
+    inode_unlock(target);
+    return rv;
+}
+
+// moves a name from one directory to another
+int storage_rename_at(int from_parent, const char *from, int to_parent, const char *to)
+{
+    rename_lock(from_parent, to_parent);
+    int rv = directory_lookup(get_inode(from_parent), from);
+    if (rv >= 0 && !(from_parent == to_parent && !strcmp(from, to)))
+    {
+        int inodeNumber = rv;
+        int target = directory_lookup(get_inode(to_parent), to);
+        int isDir = S_ISDIR(get_inode(inodeNumber)->mode);
+        if (target == inodeNumber) // two links to one file: nothing to do
+            rv = 0;
+        else if (isDir && is_within(to_parent, inodeNumber)) // a directory can't move below itself
+            rv = -EINVAL;
+        else if (target == from_parent || target == to_parent) // nor replace its parent
+            rv = -ENOTEMPTY;
+        else
+        {
+            // replaces an existing target, then links new name to file and unlinks old name
+            rv = 0;
+            if (target >= 0)
+                rv = replace_target(to_parent, to, target, isDir);
+            if (rv == 0)
+                rv = link_locked(inodeNumber, to_parent, to);
+            if (rv == 0)
+                rv = unlink_locked(from_parent, from);
+            if (rv == 0 && isDir && from_parent != to_parent)
+                set_parent(inodeNumber, to_parent);
+        }
+    }
+    rename_unlock(from_parent, to_parent);
+    return rv < 0 ? rv : 0;
 }
 
 // sets access and modifcation times of a file
 int storage_set_time(const char *path, const struct timespec ts[2])
 {
     // looks up inode and sets times if inode exists
-    int inodeNumber = tree_lookup(path);
+    int inodeNumber = path_inum(path);
     if (inodeNumber < 0)
-        return -ENOENT; 
-    inode_t* node = get_inode(inodeNumber);
-    node->atime = ts[0].tv_sec;
-    node->mtime = ts[1].tv_sec;
+        return inodeNumber;
+    return storage_set_time_inum(inodeNumber, ts);
+}
+
+// sets access and modifcation times of an inode, as utimensat does: a time
+// with UTIME_NOW is set to now and one with UTIME_OMIT is left alone
+int storage_set_time_inum(int inum, const struct timespec ts[2])
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec times[3] = {ts[0], ts[1], now};
+    int which = INODE_CTIME;
+    for (int i = 0; i < 2; i++)
+    {
+        if (ts[i].tv_nsec == UTIME_OMIT)
+            continue;
+        if (ts[i].tv_nsec == UTIME_NOW)
+            times[i] = now;
+        which |= 1 << i;
+    }
+    begin_update(inum);
+    inode_set_times(inum, which, times);
+    end_update(inum);
     return 0;
 }
 
@@ -240,43 +1468,62 @@ slist_t *storage_list(const char *path)
     return directory_list(path);
 }
 
-// updates the creation time of a file
-int storage_ctime(const char* path)
-{
-    // looks up inode and sets creation time if inode exists
-    int inodeNumber = tree_lookup(path);
-    if (inodeNumber < 0)
-        return -ENOENT; 
-    get_inode(inodeNumber)->ctime = time(NULL);
-    return 0;
-}
-
 // changes file mode
 int storage_chmod(const char* path, mode_t mode)
 {
     // looks up inode and changes mode if inode exists
-    int inodeNumber = tree_lookup(path);
+    int inodeNumber = path_inum(path);
     if (inodeNumber < 0)
-        return -ENOENT;
-    get_inode(inodeNumber)->mode &= ~07777 & mode;
+        return inodeNumber;
+    return storage_chmod_inum(inodeNumber, mode);
+}
+
+// changes the permission bits of an inode, keeping its type
+int storage_chmod_inum(int inum, mode_t mode)
+{
+    inode_t* node = get_inode(inum);
+    begin_update(inum);
+    inode_dirty(node);
+    node->mode = (node->mode & ~07777) | (mode & 07777);
+    touch(inum, INODE_CTIME, 0);
+    end_update(inum);
     return 0;
 }
 
-// sets parent and child path from given path
-static void set_parent_child(const char* path, char* parent, char* child)
+// looks up a name in a directory
+int storage_lookup_at(int parent, const char *name)
 {
-    // explodes path into list, and constructs parent and child strings
-    slist_t* path_slist = slist_explode(path, '/');
-    slist_t* pt_slist = path_slist;
-    parent[0] = '\0';
-    while (pt_slist->next)
-    {
-        strncat(parent, "/", 1);
-        strncat(parent, pt_slist->data, DIR_NAME_LENGTH);
-        pt_slist = pt_slist->next;
-    }
-    memcpy(child, pt_slist->data, strlen(pt_slist->data));
-    child[strlen(pt_slist->data)] = '\0';
-    slist_free(path_slist);
+    int inum = dcache_lookup(parent, name);
+    if (inum >= 0)
+        return inum;
+    inode_read_lock(parent);
+    inum = directory_lookup(get_inode(parent), name);
+    if (inum >= 0)
+        dcache_insert(parent, name, inum);
+    inode_unlock(parent);
+    return inum < 0 ? -ENOENT : inum;
 }
 
+// resolves a path to its inode number
+static int path_inum(const char* path)
+{
+    int inodeNumber = tree_lookup(path);
+    return inodeNumber < 0 ? -ENOENT : inodeNumber;
+}
+
+// resolves the parent directory of a path and copies out the final name
+static int parent_lookup(const char* path, char* child)
+{
+    // splits the path in place, so nothing is allocated
+    const char* name;
+    int nameLength;
+    int parentLength = path_split(path, &name, &nameLength);
+    if (nameLength == 0) // the root has no parent
+        return -EINVAL;
+    if (nameLength >= DIR_NAME_LENGTH)
+        return -ENAMETOOLONG;
+    memcpy(child, name, nameLength);
+    child[nameLength] = '\0';
+    int parentInodeNumber = tree_lookup_span(path, parentLength);
+    return parentInodeNumber < 0 ? -ENOENT : parentInodeNumber;
+}
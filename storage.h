@@ -7,6 +7,8 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <limits.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -14,19 +16,98 @@
 
 #include "slist.h"
 
-void storage_init(const char *path);
+#define NUFS_DEFAULT_SIZE (1024 * 1024) // bytes in a freshly formatted image
+#define NUFS_MAX_BLOCKS (1 << 28)         // largest image we can grow to (1 TB)
+#define NUFS_MAX_FILE_SIZE INT_MAX        // inode sizes are ints on disk
+
+int storage_format(const char *path, long size, long max_size, int inodes, long journal);
+int storage_init(const char *path);
+void storage_shutdown();
+const char *storage_setup(int *argc, char *argv[]);
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, off_t size);
 int storage_mknod(const char *path, mode_t mode);
 int storage_unlink(const char *path);
+int storage_rmdir(const char *path);
+int storage_fsync(const char *path, int datasync);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
 slist_t *storage_list(const char *path);
 
-int storage_ctime(const char* path);
 int storage_chmod(const char* path, mode_t mode);
 
+// The same operations addressed by inode number (and directory inode number
+// plus name), for front ends that already know which inode they mean.
+// All of them lock the inodes they touch, so front ends may call them from
+// several threads at once.
+int storage_lookup_at(int parent, const char *name);
+int storage_stat_inum(int inum, struct stat *st);
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset);
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
+int storage_truncate_inum(int inum, off_t size);
+int storage_mknod_at(int parent, const char *name, mode_t mode);
+int storage_unlink_at(int parent, const char *name);
+int storage_rmdir_at(int parent, const char *name);
+int storage_link_at(int inum, int parent, const char *name);
+int storage_rename_at(int from_parent, const char *from, int to_parent, const char *to);
+int storage_set_time_inum(int inum, const struct timespec ts[2]);
+int storage_chmod_inum(int inum, mode_t mode);
+
+// Timestamps have nanosecond precision and are set by the operation that
+// changes the file. How reads update the access time is chosen with mode
+// "strict" (every read), "relatime" (the first read after a change, and at
+// least daily; the default) or "noatime" (never). With lazytime, updates
+// that change nothing but the timestamps stay in memory until fsync, the
+// file's last close or a periodic writeback. Returns -EINVAL for an unknown mode.
+int storage_set_atime(const char *mode, int lazytime);
+
+// Files are sparse: truncating a file up, or writing past its end, leaves a
+// hole that reads as zeros and takes no blocks. storage_seek_inum finds the
+// next data or hole at or after offset (whence is SEEK_DATA or SEEK_HOLE),
+// returning -ENXIO at or past the end of the file.
+off_t storage_seek_inum(int inum, off_t offset, int whence);
+
+// Open files. Opening resolves the file once and returns a handle that
+// reads and writes use directly; a file unlinked while open lives on until
+// its last handle is released. Writes are remembered per inode, so fsync
+// only writes back the blocks that changed (plus a journal commit).
+int storage_open(const char *path);
+int storage_open_inum(int inum);
+int storage_fh_inum(uint64_t fh);
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset);
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset);
+int storage_flush(uint64_t fh);
+int storage_fsync_inum(int inum, int datasync);
+int storage_release(uint64_t fh);
+
+// Zero-copy reads. storage_read_map describes what a read through a handle
+// would return as ranges of the image file, one per physically contiguous
+// run of blocks, so front ends can splice them instead of copying. It
+// returns the byte count (as a read would) with the file read-locked, so its
+// blocks cannot change or be freed until storage_read_unmap. It fails with
+// -EOPNOTSUPP if the image file may be out of date (a caching block backend),
+// in which case callers fall back to storage_read_fh.
+typedef struct storage_segment {
+    off_t pos;   // offset in the image file
+    size_t size; // bytes
+} storage_segment_t;
+
+int storage_read_map(uint64_t fh, size_t size, off_t offset, int* fd,
+                     storage_segment_t** segs, int* count);
+void storage_read_unmap(uint64_t fh, storage_segment_t* segs);
+
+// Zero-copy writes work the same way: storage_write_map extends the file to
+// cover the write and describes where its bytes go, and the caller writes
+// them to the image file before storage_write_unmap. If fewer bytes than
+// asked for made it, the caller passes the end of what did and the file
+// shrinks back to that (but never below oldSize, its size before the write).
+// Writes that stay inline and small appends, which storage_write_fh buffers,
+// fail with -EOPNOTSUPP, so callers fall back to it for them too.
+int storage_write_map(uint64_t fh, size_t size, off_t offset, int* fd,
+                      storage_segment_t** segs, int* count, off_t* oldSize);
+void storage_write_unmap(uint64_t fh, storage_segment_t* segs, off_t oldSize, off_t end);
+
 #endif
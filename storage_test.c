@@ -0,0 +1,328 @@
+/**
+ * @file storage_test.c
+ *
+ * Checks how the storage layer lays out file data: small files kept inline
+ * in the inode and moved in and out of blocks as truncate grows and shrinks
+ * them, sparse files whose holes read as zeros and take no blocks, and
+ * small appends buffered in memory that an unmount must not lose. Every
+ * file's contents are checked against a copy kept in memory, before
+ * and after the image is mounted again. Last, a full image must refuse a
+ * directory cleanly.
+ *
+ * Build with the storage sources:
+ *   gcc -g -pthread -o storage_test storage_test.c $(SRCS) -lm
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "inode.h"
+#include "storage.h"
+
+#define TEST_NAME "storage_test.img"
+#define FULL_NAME "storage_full.img" // an image that cannot grow
+#define MAX_SIZE (1 << 20) // largest file a test writes
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: " __VA_ARGS__);                                            \
+      putchar('\n');                                                           \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static char byte_at(int seed, int i) { return (char) ('a' + (i * 7 + seed) % 23); }
+
+static void fill(char *buf, int seed, int len) {
+  for (int i = 0; i < len; i++) {
+    buf[i] = byte_at(seed, i);
+  }
+}
+
+static inode_t *inode_of(const char *path) {
+  struct stat st;
+  return storage_stat(path, &st) == 0 ? get_inode(st.st_ino) : 0;
+}
+
+// Check that a file holds exactly the given bytes.
+static void check_contents(const char *path, const char *want, int size, const char *when) {
+  static char got[MAX_SIZE + 1];
+  struct stat st;
+  int rv = storage_stat(path, &st);
+  CHECK(rv == 0 && st.st_size == size, "%s: %s has size %ld, not %d", when, path,
+        rv == 0 ? (long) st.st_size : -1L, size);
+  int n = storage_read(path, got, size + 1, 0);
+  CHECK(n == size, "%s: read %d bytes of %s, not %d", when, n, path, size);
+  int i = 0;
+  while (i < size && i < n && got[i] == want[i]) {
+    i++;
+  }
+  CHECK(i >= size || i >= n, "%s: %s differs at byte %d", when, path, i);
+}
+
+// Small files live in the inode until they outgrow it, and move back into
+// it when truncated small again, keeping their bytes and reading zeros past
+// the old end.
+static void test_inline(char *want) {
+  static char buf[8192];
+  const char *path = "/inline";
+  CHECK(storage_mknod(path, 0100644) == 0, "cannot make %s", path);
+  inode_t *node = inode_of(path);
+
+  fill(want, 1, 100);
+  CHECK(storage_write(path, want, 100, 0) == 100, "cannot write %s", path);
+  CHECK(inode_is_inline(node) && inode_block_count(node) == 0,
+        "a 100-byte file is not inline");
+  check_contents(path, want, 100, "inline");
+
+  // shrinking and growing within the inode clears the cut bytes
+  CHECK(storage_truncate(path, 50) == 0, "cannot truncate %s to 50", path);
+  CHECK(storage_truncate(path, INODE_INLINE_SIZE) == 0, "cannot truncate %s to %d", path,
+        INODE_INLINE_SIZE);
+  memset(want + 50, 0, INODE_INLINE_SIZE - 50);
+  CHECK(inode_is_inline(node), "a file of %d bytes is not inline", INODE_INLINE_SIZE);
+  check_contents(path, want, INODE_INLINE_SIZE, "grown inline");
+
+  // growing past the inode moves the data out to a block, and the rest is a hole
+  CHECK(storage_truncate(path, 10000) == 0, "cannot truncate %s to 10000", path);
+  memset(want + INODE_INLINE_SIZE, 0, 10000 - INODE_INLINE_SIZE);
+  CHECK(!inode_is_inline(node) && inode_block_count(node) == 1,
+        "grown to 10000 bytes: inline %d with %d blocks, not 1", inode_is_inline(node),
+        inode_block_count(node));
+  check_contents(path, want, 10000, "moved out");
+
+  fill(buf, 2, sizeof(buf));
+  CHECK(storage_write(path, buf, 3000, 6000) == 3000, "cannot write into %s", path);
+  memcpy(want + 6000, buf, 3000);
+  check_contents(path, want, 10000, "written out of line");
+
+  // shrinking to what the inode holds moves the data back and frees the blocks
+  CHECK(storage_truncate(path, 120) == 0, "cannot truncate %s to 120", path);
+  CHECK(inode_is_inline(node) && inode_block_count(node) == 0,
+        "truncated to 120 bytes: inline %d with %d blocks", inode_is_inline(node),
+        inode_block_count(node));
+  check_contents(path, want, 120, "moved back");
+  CHECK(storage_truncate(path, 4000) == 0, "cannot truncate %s to 4000", path);
+  memset(want + 120, 0, 4000 - 120);
+  check_contents(path, want, 4000, "regrown");
+
+  // a write past the inode's room moves it out too
+  CHECK(storage_truncate(path, 0) == 0, "cannot truncate %s to 0", path);
+  CHECK(inode_is_inline(node), "an empty file is not inline");
+  fill(want, 3, 200);
+  CHECK(storage_write(path, want, 200, 0) == 200, "cannot write 200 bytes to %s", path);
+  CHECK(!inode_is_inline(node), "a 200-byte file is inline");
+  check_contents(path, want, 200, "written past the inode");
+}
+
+// Writing past the end of a file, or truncating it up, leaves a hole that
+// reads as zeros, takes no blocks and is skipped by SEEK_DATA.
+static void test_sparse(char *want) {
+  static char buf[8192];
+  const char *path = "/sparse";
+  CHECK(storage_mknod(path, 0100644) == 0, "cannot make %s", path);
+  struct stat st;
+  storage_stat(path, &st);
+  int inum = st.st_ino;
+  inode_t *node = get_inode(inum);
+
+  // one block written at 512K, with only holes before it
+  fill(buf, 4, BLOCK_SIZE);
+  CHECK(storage_write(path, buf, BLOCK_SIZE, 512 * 1024) == BLOCK_SIZE,
+        "cannot write %s at 512K", path);
+  memset(want, 0, MAX_SIZE);
+  memcpy(want + 512 * 1024, buf, BLOCK_SIZE);
+  CHECK(inode_block_count(node) == 1, "a file with one written block has %d blocks",
+        inode_block_count(node));
+  check_contents(path, want, 512 * 1024 + BLOCK_SIZE, "written past a hole");
+  CHECK(storage_seek_inum(inum, 0, SEEK_DATA) == 512 * 1024, "SEEK_DATA from 0 is %ld",
+        (long) storage_seek_inum(inum, 0, SEEK_DATA));
+  CHECK(storage_seek_inum(inum, 0, SEEK_HOLE) == 0, "SEEK_HOLE from 0 is %ld",
+        (long) storage_seek_inum(inum, 0, SEEK_HOLE));
+  CHECK(storage_seek_inum(inum, 512 * 1024, SEEK_HOLE) == 512 * 1024 + BLOCK_SIZE,
+        "SEEK_HOLE from the data is %ld",
+        (long) storage_seek_inum(inum, 512 * 1024, SEEK_HOLE));
+
+  // a write into the middle of the hole, straddling two blocks
+  fill(buf, 5, 6000);
+  CHECK(storage_write(path, buf, 6000, 100000) == 6000, "cannot write into the hole of %s", path);
+  memcpy(want + 100000, buf, 6000);
+  CHECK(inode_block_count(node) == 3, "%d blocks, not 3, after filling part of the hole",
+        inode_block_count(node));
+  check_contents(path, want, 512 * 1024 + BLOCK_SIZE, "hole partly filled");
+
+  // truncating up adds a hole without blocks
+  CHECK(storage_truncate(path, MAX_SIZE) == 0, "cannot truncate %s to %d", path, MAX_SIZE);
+  CHECK(inode_block_count(node) == 3, "truncating up allocated blocks");
+  check_contents(path, want, MAX_SIZE, "truncated up");
+  CHECK(storage_seek_inum(inum, 512 * 1024 + BLOCK_SIZE, SEEK_DATA) == -ENXIO,
+        "data found in the hole at the end");
+
+  // and sizes past what a file can hold are refused
+  CHECK(storage_truncate(path, (off_t) 1 << 32) == -EFBIG, "a 4G truncate was not refused");
+  CHECK(storage_write(path, buf, 1, (off_t) 1 << 32) == -EFBIG, "a write at 4G was not refused");
+  check_contents(path, want, MAX_SIZE, "after refusing 4G");
+}
+
+// Write through a handle the way nufs_ll's write_buf does: straight into the
+// image file where storage_write_map puts the bytes, or through
+// storage_write_fh when it declines. Counts the writes that went each way.
+static int mapped_writes, copied_writes;
+
+static int write_buf(int fh, const char *buf, int size, off_t offset) {
+  int fd, count;
+  off_t old_size;
+  storage_segment_t *segs;
+  int rv = storage_write_map(fh, size, offset, &fd, &segs, &count, &old_size);
+  if (rv == -EOPNOTSUPP) {
+    copied_writes++;
+    return storage_write_fh(fh, buf, size, offset);
+  }
+  if (rv < 0) {
+    return rv;
+  }
+  mapped_writes++;
+  int done = 0;
+  for (int i = 0; i < count && done < rv; i++) {
+    if (pwrite(fd, buf + done, segs[i].size, segs[i].pos) != segs[i].size) {
+      break;
+    }
+    done += segs[i].size;
+  }
+  storage_write_unmap(fh, segs, old_size, offset + done);
+  return done > 0 ? done : -EIO;
+}
+
+// Small appends to a file stay in memory and are given blocks together; an
+// unmount must write them out, for open files and closed ones alike. The
+// open file is written the way the low-level front end writes, so its
+// appends must be passed over by storage_write_map to be buffered.
+static void test_appends(char *want_log, char *want_open, int *appended) {
+  static char buf[8192];
+  const char *closed = "/log";
+  const char *held = "/open";
+  CHECK(storage_mknod(closed, 0100644) == 0, "cannot make %s", closed);
+  CHECK(storage_mknod(held, 0100644) == 0, "cannot make %s", held);
+  int fh = storage_open(held);
+  CHECK(fh >= 0, "cannot open %s", held);
+
+  // a first write of two whole blocks takes the files out of their inodes
+  fill(want_log, 6, MAX_SIZE);
+  fill(want_open, 7, MAX_SIZE);
+  CHECK(storage_write(closed, want_log, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE,
+        "cannot write %s", closed);
+  CHECK(write_buf(fh, want_open, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE,
+        "cannot write %s", held);
+  int size = 2 * BLOCK_SIZE;
+  for (int i = 0; i < 300; i++) {
+    int len = 1 + i * 37 % 200;
+    memcpy(buf, want_log + size, len);
+    CHECK(storage_write(closed, buf, len, size) == len, "cannot append to %s", closed);
+    memcpy(buf, want_open + size, len);
+    CHECK(write_buf(fh, buf, len, size) == len, "cannot append to %s", held);
+    size += len;
+  }
+  CHECK(inode_wbuf_bytes() > 0, "nothing buffered after %d bytes of appends", size);
+  CHECK(mapped_writes == 1 && copied_writes == 300,
+        "%d writes to %s mapped and %d copied, not 1 and 300", mapped_writes, held,
+        copied_writes);
+  struct stat st;
+  CHECK(storage_stat(held, &st) == 0 && inode_get_wbuf(st.st_ino),
+        "appends to %s through storage_write_map were not buffered", held);
+  check_contents(closed, want_log, size, "buffered");
+  check_contents(held, want_open, size, "buffered");
+  *appended = size;
+}
+
+// What a file that took appends looks like after remounting: all its blocks
+// written, in few extents (a flush by the timer may have split one).
+static void check_appended(const char *path, const char *want, int size) {
+  check_contents(path, want, size, "appended, after remounting");
+  inode_t *node = inode_of(path);
+  CHECK(node && inode_block_count(node) == bytes_to_blocks(size),
+        "%s has %d blocks, not %d", path, node ? inode_block_count(node) : -1,
+        bytes_to_blocks(size));
+  CHECK(node && node->nextents <= 3, "%s has %d extents", path, node ? node->nextents : -1);
+}
+
+static int inodes_in_use() {
+  int n = 0;
+  for (int i = 0; i < (int) get_superblock()->inode_count; i++) {
+    n += bitmap_get(get_inode_bitmap(), i);
+  }
+  return n;
+}
+
+// With every block taken, a directory, which needs one to start with, is
+// refused without using up an inode, while files, which start inline, can
+// still be made.
+static void test_full() {
+  static char buf[64 * 1024];
+  unlink(FULL_NAME);
+  if (storage_format(FULL_NAME, 1 << 20, 1 << 20, 64, -1) != 0) {
+    CHECK(0, "cannot format %s", FULL_NAME);
+    return;
+  }
+  storage_init(FULL_NAME);
+  storage_mknod("/fill", 0100644);
+  off_t size = 0;
+  int rv;
+  while ((rv = storage_write("/fill", buf, sizeof(buf), size)) > 0) {
+    size += rv;
+  }
+  CHECK(rv == -ENOSPC, "filling the image ended with %d, not -ENOSPC", rv);
+
+  int used = inodes_in_use();
+  rv = storage_mknod("/dir", 040755);
+  CHECK(rv == -ENOSPC, "mkdir on a full image gave %d, not -ENOSPC", rv);
+  CHECK(inodes_in_use() == used, "a refused mkdir left %d inodes in use, not %d",
+        inodes_in_use(), used);
+  CHECK(inode_of("/dir") == 0, "a refused mkdir left /dir behind");
+  CHECK(storage_mknod("/file", 0100644) == 0, "cannot make a file on a full image");
+
+  CHECK(storage_unlink("/fill") == 0, "cannot remove /fill");
+  storage_fsync("/", 0);
+  // blocks freed in a commit come back with the one after it
+  CHECK(storage_unlink("/file") == 0, "cannot remove /file");
+  storage_fsync("/", 0);
+  CHECK(storage_mknod("/dir", 040755) == 0, "cannot mkdir once blocks are free");
+  storage_shutdown();
+  unlink(FULL_NAME);
+}
+
+int main(int argc, char **argv) {
+  static char want_inline[MAX_SIZE];
+  static char want_sparse[MAX_SIZE];
+  static char want_log[MAX_SIZE], want_open[MAX_SIZE];
+  int appended;
+  setvbuf(stdout, 0, _IONBF, 0);
+  unlink(TEST_NAME);
+  if (storage_format(TEST_NAME, 4 << 20, 64 << 20, 1024, -1) != 0) {
+    return 1;
+  }
+  storage_init(TEST_NAME);
+  test_inline(want_inline);
+  test_sparse(want_sparse);
+  test_appends(want_log, want_open, &appended);
+  storage_shutdown();
+
+  storage_init(TEST_NAME);
+  check_contents("/inline", want_inline, 200, "after remounting");
+  check_contents("/sparse", want_sparse, MAX_SIZE, "after remounting");
+  check_appended("/log", want_log, appended);
+  check_appended("/open", want_open, appended);
+  storage_shutdown();
+  unlink(TEST_NAME);
+
+  test_full();
+  printf("storage_test: %s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
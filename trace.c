@@ -0,0 +1,205 @@
+/**
+ * @file trace.c
+ *
+ * Per-thread trace rings and the thread that drains them (see trace.h).
+ *
+ * A ring has one producer, the thread that owns it, and one consumer, the
+ * drain thread, so head and tail only need acquire/release ordering. Rings
+ * are linked into a list that only ever grows; a thread that exits gives its
+ * ring up, and the next new thread takes it over instead of adding another.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct trace_ring {
+  trace_record_t records[TRACE_RING_SIZE];
+  uint64_t head;    // next record to write, advanced by the owner
+  uint64_t tail;    // next record to drain, advanced by the drain thread
+  uint64_t dropped; // records lost to a full ring, not yet reported
+  uint32_t tid;     // owner's thread id
+  int owned;        // whether a live thread owns the ring
+  struct trace_ring *next;
+} trace_ring_t;
+
+static trace_ring_t *rings = 0; // every ring ever made
+static __thread trace_ring_t *my_ring = 0;
+static pthread_key_t ring_key; // gives the ring up when its thread exits
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int tracing = 0;
+static int trace_fd = -1;
+static pthread_t drainer;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_wake = PTHREAD_COND_INITIALIZER;
+static int drain_stop = 0;
+
+static void release_ring(void *ring) {
+  __atomic_store_n(&((trace_ring_t *) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void make_ring_key() {
+  pthread_key_create(&ring_key, release_ring);
+}
+
+// Find the calling thread's ring, taking over a released one or adding a
+// new one the first time.
+static trace_ring_t *get_ring() {
+  if (my_ring) {
+    return my_ring;
+  }
+  trace_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  for (; ring; ring = ring->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&ring->owned, &free, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (!ring) {
+    ring = calloc(1, sizeof(trace_ring_t));
+    if (!ring) {
+      return 0;
+    }
+    ring->owned = 1;
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  __atomic_store_n(&ring->tid, syscall(SYS_gettid), __ATOMIC_RELAXED);
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_setspecific(ring_key, ring);
+  my_ring = ring;
+  return ring;
+}
+
+void trace_emit(int event, const char *s1, const char *s2, const int64_t *args) {
+  if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+    return;
+  }
+  trace_ring_t *ring = get_ring();
+  if (!ring) {
+    return;
+  }
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  trace_record_t *rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rec->ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  rec->tid = ring->tid;
+  rec->event = event;
+  memcpy(rec->args, args, sizeof(rec->args));
+
+  // both strings, truncated to fit, each followed by a NUL
+  rec->nstr = 0;
+  size_t used = 0;
+  const char *strs[] = {s1, s2};
+  for (int i = 0; i < 2 && strs[i]; i++) {
+    size_t room = TRACE_STR_SIZE - used - 1 - (i == 0 && s2 ? TRACE_STR_SIZE / 2 : 0);
+    size_t len = strnlen(strs[i], room);
+    memcpy(rec->str + used, strs[i], len);
+    rec->str[used + len] = 0;
+    used += len + 1;
+    rec->nstr++;
+  }
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Write out everything the rings hold.
+static void drain() {
+  static trace_record_t batch[TRACE_RING_SIZE + 1]; // a full ring and a note
+  for (trace_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring;
+       ring = ring->next) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for (; tail < head; tail++) {
+      batch[n++] = ring->records[tail & (TRACE_RING_SIZE - 1)];
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+      trace_record_t *note = &batch[n++];
+      memset(note, 0, sizeof(*note));
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      note->ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+      note->tid = __atomic_load_n(&ring->tid, __ATOMIC_RELAXED);
+      note->event = TRACE_DROPPED;
+      note->args[0] = note->tid;
+      note->args[1] = dropped;
+    }
+    if (n > 0 && write(trace_fd, batch, n * sizeof(trace_record_t)) < 0) {
+      return; // nowhere to put them; the records are lost either way
+    }
+  }
+}
+
+static void *drain_main(void *arg) {
+  pthread_mutex_lock(&drain_lock);
+  while (!drain_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&drain_wake, &drain_lock, &deadline);
+    pthread_mutex_unlock(&drain_lock);
+    drain();
+    pthread_mutex_lock(&drain_lock);
+  }
+  pthread_mutex_unlock(&drain_lock);
+  return 0;
+}
+
+int trace_start(const char *path) {
+#ifndef NUFS_TRACE
+  return -EOPNOTSUPP;
+#endif
+  trace_fd = open(path ? path : "nufs.trace", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd < 0) {
+    return -errno;
+  }
+  trace_header_t hdr = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t),
+                        TRACE_EVENT_COUNT};
+  if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    int rv = -errno;
+    close(trace_fd);
+    trace_fd = -1;
+    return rv;
+  }
+  drain_stop = 0;
+  pthread_create(&drainer, 0, drain_main, 0);
+  __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void trace_stop() {
+  if (trace_fd < 0) {
+    return;
+  }
+  __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&drain_lock);
+  drain_stop = 1;
+  pthread_cond_signal(&drain_wake);
+  pthread_mutex_unlock(&drain_lock);
+  pthread_join(drainer, 0);
+  drain(); // what was traced since the last pass
+  close(trace_fd);
+  trace_fd = -1;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file trace.h
+ *
+ * Binary event tracing, compiled in only when NUFS_TRACE is defined
+ * (`make TRACE=1`); otherwise the TRACE macros expand to nothing.
+ *
+ * Each thread writes fixed-size records (a timestamp, an event number, up to
+ * TRACE_ARGS numbers and up to two short strings) into a ring buffer of its
+ * own, so tracing takes no lock and makes no system call. A drain thread
+ * empties the rings into a file every TRACE_DRAIN_MS; a thread whose ring
+ * is full drops records and the drain thread notes how many. trace_decode
+ * turns the file back into text, using the format strings of TRACE_EVENTS.
+ *
+ * Formats use %s for the strings and %ld-style conversions (with any flags,
+ * width or l-qualified conversion: %lu, %lo, %lx) for the numbers, each
+ * taken in the order the event passed them.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x43525454 // "TTRC"
+#define TRACE_VERSION 1
+#define TRACE_ARGS 6        // numbers a record holds
+#define TRACE_STR_SIZE 64   // bytes of strings a record holds (both, NUL-separated)
+#define TRACE_RING_SIZE 4096 // records per thread, a power of two
+#define TRACE_DRAIN_MS 50   // how often the drain thread empties the rings
+
+// name, format
+#define TRACE_EVENTS(X)                                                        \
+  X(DROPPED, "- thread %ld dropped %ld records")                               \
+  X(INIT, "init() -> want %#lx")                                               \
+  X(DESTROY, "destroy()")                                                      \
+  X(ACCESS, "access(%s, %04lo) -> %ld")                                        \
+  X(GETATTR, "getattr(%s) -> (%ld) {mode: %04lo, size: %ld}")                  \
+  X(FGETATTR, "fgetattr(%s) -> %ld")                                           \
+  X(READDIR, "readdir(%s, @%ld) -> %ld")                                       \
+  X(MKNOD, "mknod(%s, %04lo) -> %ld")                                          \
+  X(MKDIR, "mkdir(%s) -> %ld")                                                 \
+  X(CREATE, "create(%s, %04lo) -> %ld")                                        \
+  X(UNLINK, "unlink(%s) -> %ld")                                               \
+  X(RMDIR, "rmdir(%s) -> %ld")                                                 \
+  X(LINK, "link(%s => %s) -> %ld")                                             \
+  X(RENAME, "rename(%s => %s) -> %ld")                                         \
+  X(CHMOD, "chmod(%s, %04lo) -> %ld")                                          \
+  X(TRUNCATE, "truncate(%s, %ld bytes) -> %ld")                                \
+  X(FTRUNCATE, "ftruncate(%s, %ld bytes) -> %ld")                              \
+  X(UTIMENS, "utimens(%s, [%ld.%09ld; %ld.%09ld]) -> %ld")                     \
+  X(OPEN, "open(%s) -> %ld")                                                   \
+  X(FLUSH, "flush(%s) -> %ld")                                                 \
+  X(RELEASE, "release(%s) -> %ld")                                             \
+  X(FSYNC, "fsync(%s, %ld) -> %ld")                                            \
+  X(FSYNCDIR, "fsyncdir(%s, %ld) -> %ld")                                      \
+  X(READ, "read(%s, %ld bytes, @+%ld) -> %ld")                                 \
+  X(WRITE, "write(%s, %ld bytes, @+%ld) -> %ld")                               \
+  X(WRITE_BUF, "write_buf(%s, %ld bytes, @+%ld) -> %ld")                       \
+  X(IOCTL, "ioctl(%s, %ld, ...) -> %ld")                                       \
+  X(LL_LOOKUP, "lookup(%lu, %s) -> %ld")                                       \
+  X(LL_GETATTR, "getattr(%lu) -> {mode: %04lo, size: %ld}")                    \
+  X(LL_SETATTR, "setattr(%lu, %#lx) -> %ld")                                   \
+  X(LL_MKNOD, "mknod(%lu, %s, %04lo) -> %ld")                                  \
+  X(LL_MKDIR, "mkdir(%lu, %s) -> %ld")                                         \
+  X(LL_CREATE, "create(%lu, %s, %04lo) -> %ld")                                \
+  X(LL_UNLINK, "unlink(%lu, %s) -> %ld")                                       \
+  X(LL_RMDIR, "rmdir(%lu, %s) -> %ld")                                         \
+  X(LL_RENAME, "rename(%lu, %s => %lu, %s) -> %ld")                            \
+  X(LL_LINK, "link(%lu => %lu, %s) -> %ld")                                    \
+  X(LL_OPEN, "open(%lu) -> %ld")                                               \
+  X(LL_FLUSH, "flush(%lu) -> %ld")                                             \
+  X(LL_FSYNC, "fsync(%lu, %ld) -> %ld")                                        \
+  X(LL_RELEASE, "release(%lu) -> %ld")                                         \
+  X(LL_READ, "read(%lu, %ld bytes, @+%ld) -> %ld")                             \
+  X(LL_READ_SPLICE, "read(%lu, %ld bytes, @+%ld) -> %ld (%ld segments)")       \
+  X(LL_WRITE, "write(%lu, %ld bytes, @+%ld) -> %ld")                           \
+  X(LL_WRITE_BUF, "write_buf(%lu, %ld bytes, @+%ld) -> %ld")                   \
+  X(LL_READDIR, "readdir(%lu, @%ld) -> %ld bytes")                             \
+  X(LL_READDIRPLUS, "readdirplus(%lu, @%ld) -> %ld bytes")                     \
+  X(ALLOC_BLOCK, "+ alloc_block() -> %ld")                                     \
+  X(ALLOC_BLOCKS, "+ alloc_blocks(%ld, %ld) -> %ld (+%ld)")                    \
+  X(FREE_BLOCK, "+ free_block(%ld)")                                           \
+  X(FREE_BLOCKS, "+ free_blocks(%ld, %ld)")                                    \
+  X(BLOCKS_GROW, "+ blocks_grow() -> %ld blocks")                              \
+  X(FRAMES_GROW, "+ frame cache grown to %ld frames")                          \
+  X(ALLOC_INODE, "+ alloc_inode() -> %ld")                                     \
+  X(FREE_INODE, "+ free_inode(%ld)")                                           \
+  X(JOURNAL_COMMIT, "+ journal commit %ld: %ld blocks, overflowed %ld -> %ld")
+
+#define TRACE_ENUM(name, format) TRACE_##name,
+typedef enum { TRACE_EVENTS(TRACE_ENUM) TRACE_EVENT_COUNT } trace_event_t;
+#undef TRACE_ENUM
+
+/**
+ * The start of a trace file, followed by its records.
+ */
+typedef struct trace_header {
+  uint32_t magic;       // TRACE_MAGIC
+  uint32_t version;     // TRACE_VERSION
+  uint32_t record_size; // sizeof(trace_record_t)
+  uint32_t event_count; // TRACE_EVENT_COUNT when the file was written
+} trace_header_t;
+
+/**
+ * One traced event.
+ */
+typedef struct trace_record {
+  uint64_t ns;     // CLOCK_MONOTONIC time
+  uint32_t tid;    // thread that traced it
+  uint16_t event;  // trace_event_t
+  uint16_t nstr;   // strings in str
+  int64_t args[TRACE_ARGS];
+  char str[TRACE_STR_SIZE];
+} trace_record_t;
+
+/**
+ * Start tracing into a file, replacing it, and start the drain thread.
+ *
+ * @param path The file, or NULL for "nufs.trace".
+ *
+ * @return 0 on success, -errno if the file cannot be created, or
+ * -EOPNOTSUPP if nufs was built without NUFS_TRACE.
+ */
+int trace_start(const char *path);
+
+/**
+ * Stop tracing, drain what is left and close the file. Does nothing if
+ * tracing was not started.
+ */
+void trace_stop();
+
+/**
+ * Record an event in the calling thread's ring. Use the TRACE macros.
+ *
+ * @param event The event.
+ * @param s1 First string (may be NULL).
+ * @param s2 Second string (may be NULL).
+ * @param args TRACE_ARGS numbers, the unused ones zero.
+ */
+void trace_emit(int event, const char *s1, const char *s2, const int64_t *args);
+
+#ifdef NUFS_TRACE
+#define TRACE(event, ...)                                                      \
+  trace_emit(TRACE_##event, 0, 0, (const int64_t[TRACE_ARGS]){__VA_ARGS__})
+#define TRACE_S(event, s, ...)                                                 \
+  trace_emit(TRACE_##event, s, 0, (const int64_t[TRACE_ARGS]){__VA_ARGS__})
+#define TRACE_S2(event, s1, s2, ...)                                           \
+  trace_emit(TRACE_##event, s1, s2, (const int64_t[TRACE_ARGS]){__VA_ARGS__})
+#else
+#define TRACE(event, ...) ((void) 0)
+#define TRACE_S(event, s, ...) ((void) 0)
+#define TRACE_S2(event, s1, s2, ...) ((void) 0)
+#endif
+
+#endif
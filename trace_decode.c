@@ -0,0 +1,125 @@
+/**
+ * @file trace_decode.c
+ *
+ * Turns a trace file written by a nufs built with `make TRACE=1` into text,
+ * one line per record in time order:
+ *
+ *     seconds-since-first-record [thread] event
+ *
+ * Usage: trace_decode [FILE] (default nufs.trace)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define TRACE_FORMAT(name, format) format,
+static const char *formats[] = {TRACE_EVENTS(TRACE_FORMAT)};
+#undef TRACE_FORMAT
+
+// Record order: by time, then as written (each thread's records were
+// written in the order it traced them).
+static int by_time(const void *a, const void *b) {
+  const trace_record_t *x = *(trace_record_t *const *) a;
+  const trace_record_t *y = *(trace_record_t *const *) b;
+  if (x->ns != y->ns) {
+    return x->ns < y->ns ? -1 : 1;
+  }
+  return x < y ? -1 : x > y;
+}
+
+// Print a record's event with its format, handing each conversion the next
+// string or number.
+static void print_event(const trace_record_t *rec) {
+  if (rec->event >= TRACE_EVENT_COUNT) {
+    printf("? unknown event %d", rec->event);
+    return;
+  }
+  const char *strs[2] = {"", ""};
+  const char *next = rec->str;
+  for (int i = 0; i < rec->nstr && i < 2; i++) {
+    strs[i] = next;
+    next += strnlen(next, rec->str + TRACE_STR_SIZE - next) + 1;
+  }
+
+  int nstr = 0, narg = 0;
+  for (const char *p = formats[rec->event]; *p; p++) {
+    if (*p != '%') {
+      putchar(*p);
+      continue;
+    }
+    if (p[1] == '%') {
+      putchar('%');
+      p++;
+      continue;
+    }
+    // copy the conversion (flags, width, length) up to its letter
+    char spec[16];
+    int len = 0;
+    while (*p && !strchr("sdiuoxX", *p) && len < (int) sizeof(spec) - 2) {
+      spec[len++] = *p++;
+    }
+    spec[len++] = *p;
+    spec[len] = 0;
+    if (*p == 's') {
+      printf(spec, nstr < 2 ? strs[nstr++] : "");
+    } else {
+      printf(spec, narg < TRACE_ARGS ? (long) rec->args[narg++] : 0L);
+    }
+    if (!*p) {
+      break;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : "nufs.trace";
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+
+  trace_header_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, file) != 1 || hdr.magic != TRACE_MAGIC) {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    return 1;
+  }
+  if (hdr.version != TRACE_VERSION || hdr.record_size != sizeof(trace_record_t)
+      || hdr.event_count != TRACE_EVENT_COUNT) {
+    fprintf(stderr, "%s: written by a different build of nufs\n", path);
+    return 1;
+  }
+
+  size_t count = 0, capacity = 4096;
+  trace_record_t *records = malloc(capacity * sizeof(trace_record_t));
+  for (;;) {
+    if (count == capacity) {
+      capacity *= 2;
+      records = realloc(records, capacity * sizeof(trace_record_t));
+    }
+    if (fread(&records[count], sizeof(trace_record_t), 1, file) != 1) {
+      break;
+    }
+    count++;
+  }
+  fclose(file);
+
+  trace_record_t **order = malloc(count * sizeof(trace_record_t *));
+  for (size_t i = 0; i < count; i++) {
+    order[i] = &records[i];
+  }
+  qsort(order, count, sizeof(trace_record_t *), by_time);
+
+  uint64_t start = count ? order[0]->ns : 0;
+  for (size_t i = 0; i < count; i++) {
+    const trace_record_t *rec = order[i];
+    printf("%12.6f [%u] ", (rec->ns - start) / 1e9, rec->tid);
+    print_event(rec);
+    putchar('\n');
+  }
+  free(order);
+  free(records);
+  return 0;
+}